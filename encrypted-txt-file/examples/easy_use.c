@@ -1,4 +1,5 @@
 #include <crypwalk.h>
+#include <stdio.h>
 
 int main() {
 	int res = encrypt_file("./examples/test_file", "foobars");
@@ -15,4 +16,17 @@ int main() {
 
 
 	printf("DECRYPTION COMPLETED SUCCESSFULLY\n");
+
+	// the same round trip through memory mappings, for big files
+	res = encrypt_file_mmap("./examples/test_file", "foobars");
+	if (res != 0) {
+		return res;
+	}
+
+	res = decrypt_file_mmap("./examples/test_file.crenc", "foobars");
+	if (res != 0) {
+		return res;
+	}
+
+	printf("MMAP ROUND TRIP COMPLETED SUCCESSFULLY\n");
 }
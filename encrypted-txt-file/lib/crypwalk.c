@@ -2,6 +2,9 @@
 
 #include <stddef.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -10,7 +13,8 @@
 
 # define ENCRYPTED_FILE_EXTENSION ".crenc"
 # define DECRYPTED_FILE_EXTENSION ".drenc"
-# define BUFFER_SIZE 1024
+# define STREAM_CHUNK_SIZE (1024 * 1024) // a multiple of DES_BLOCK_BYTES
+# define STREAM_CHUNK_ALIGN 4096
 # define DES_BLOCK_BYTES 8
 
 // ***************** Read only / Immutable data structures ***************
@@ -35,16 +39,26 @@ const int INVERSE_INITIAL_PERMUTATION_LOOKUP[64] = {58, 50, 42, 34, 26, 18, 10,
 
 // ***************** forward decl utils *******************
 
-typedef struct {
-	unsigned char* buffer;
-	size_t buffer_size;
-} DynamicBufferResult;
+// what stream_blocks reports, mapped to each caller's own return codes
+typedef enum {
+	STREAM_SUCCESS = 0,
+	STREAM_READ_ERR = -1,
+	STREAM_WRITE_ERR = -2,
+	STREAM_ALGO_ERR = -3,
+	STREAM_ALLOC_ERR = -4,
+} StreamResult;
 
 int block_encrypt(unsigned char* block);
 int block_decrypt(unsigned char* block);
-DynamicBufferResult read_dynamic_buffer(const char* file_name);
+StreamResult stream_blocks(FILE* in, FILE* out, int (*transform)(unsigned char*));
+int map_blocks(const unsigned char* in, unsigned char* out, size_t size, int (*transform)(unsigned char*));
+int map_input_file(const char* path, unsigned char** data, size_t* size);
+unsigned char* map_output_file(const char* path, size_t size);
+char* encrypted_file_name_for(const char* file_name);
+char* decrypted_file_name_for(const char* file_name);
 unsigned long generateHash(const char* pswd);
 int verifyHash(const char* pswd, unsigned long hash);
+void advise_mapping(void* addr, size_t size);
 
 // ********** Public Func & structs Impl **********
 
@@ -63,38 +77,15 @@ ENCRYPT_FILE_RETURN encrypt_file(const char *file_name, const char* encryption_k
 	if (file  == NULL) {
 		return ENCRYPTION_FOPEN_ERR;
 	}
-	
-	DynamicBufferResult buf = read_dynamic_buffer(file_name);
-	unsigned char* concatenated_contents = buf.buffer;
-	size_t curr_size = buf.buffer_size;
+	setvbuf(file, NULL, _IONBF, 0);
 
-	if (concatenated_contents == NULL) {
-		return ENCRYPTION_FILE_ERR;
-	}
-	
-	// TODO: Later we can use concurrency here
-	// iterate over the concatenated_contents over 8 byte blocks
-	int num_rounds = curr_size / 8; // auto floor division
-	for (int i = 0; i < num_rounds; i++) {
-		unsigned char* block = concatenated_contents + (i*8); // move 8 bytes at a time
-		int res = block_encrypt(block);
-		if (res < 0) {
-			free(concatenated_contents);
-			return ENCRYPTION_ALGO_ERR;
-		}
-	}
-	
 	// write to a new file with mutated block and save with extension
-	size_t file_name_len = strlen(file_name);
-	char* encrypted_file_name = (char *)malloc(file_name_len + strlen(ENCRYPTED_FILE_EXTENSION) + 1);
+	char* encrypted_file_name = encrypted_file_name_for(file_name);
 	if (encrypted_file_name == NULL) {
-		free(concatenated_contents);
+		fclose(file);
 		return ENCRYPTION_ALLOC_ERR;
 	}
 	
-	strcpy(encrypted_file_name, file_name);
-	strcpy(encrypted_file_name + file_name_len, ENCRYPTED_FILE_EXTENSION);
-	
 	// create encrypted file header
 	CrypwalkHeader header;
 	header.data_offset = sizeof(CrypwalkHeader);
@@ -102,25 +93,46 @@ ENCRYPT_FILE_RETURN encrypt_file(const char *file_name, const char* encryption_k
 	header.hash_size = 13;
 
 	FILE* encrypted_file = fopen(encrypted_file_name, "wb");
+	if (encrypted_file == NULL) {
+		fclose(file);
+		free(encrypted_file_name);
+		return ENCRYPTION_WRITE_FILE_ERR;
+	}
+	setvbuf(encrypted_file, NULL, _IONBF, 0);
 
 	// write header into the file
 	if (fwrite(&header, sizeof(CrypwalkHeader), 1, encrypted_file) != 1) {
+		fclose(file);
 		fclose(encrypted_file);
-		free(concatenated_contents);
+		remove(encrypted_file_name);
 		free(encrypted_file_name);
 		return ENCRYPTION_WRITE_FILE_ERR;
 	}
 
-	// write encrypted contents into file
-	if(fwrite(concatenated_contents, sizeof (unsigned char), curr_size, encrypted_file) != curr_size) {
-		fclose(encrypted_file);
-		free(concatenated_contents);
+	// TODO: Later we can use concurrency here
+	// encrypt and write the contents a chunk at a time, 8 byte blocks
+	StreamResult res = stream_blocks(file, encrypted_file, block_encrypt);
+	fclose(file);
+	if (fclose(encrypted_file) != 0 && res == STREAM_SUCCESS) {
+		res = STREAM_WRITE_ERR;
+	}
+
+	if (res != STREAM_SUCCESS) {
+		// no half encrypted file is left behind
+		remove(encrypted_file_name);
 		free(encrypted_file_name);
-		return ENCRYPTION_WRITE_FILE_ERR;
+		switch (res) {
+		case STREAM_READ_ERR:
+			return ENCRYPTION_FILE_ERR;
+		case STREAM_ALGO_ERR:
+			return ENCRYPTION_ALGO_ERR;
+		case STREAM_ALLOC_ERR:
+			return ENCRYPTION_ALLOC_ERR;
+		default:
+			return ENCRYPTION_WRITE_FILE_ERR;
+		}
 	}
 
-	fclose(encrypted_file);
-	free(concatenated_contents);
 	free(encrypted_file_name);
 	return ENCRYPTION_SUCCESS;
 }
@@ -130,10 +142,15 @@ DECRYPT_FILE_RETURN decrypt_file(const char *file_name, const char *encryption_k
 		return DECRYPTION_INVALID_KEY;
 	}
 
+	if (strlen(file_name) <= strlen(ENCRYPTED_FILE_EXTENSION)) {
+		return DECRYPTION_FILE_ERR;
+	}
+
 	FILE* file = fopen(file_name, "rb");
 	if (file  == NULL) {
 		return DECRYPTION_FOPEN_ERR;
 	}
+	setvbuf(file, NULL, _IONBF, 0);
 	
 	// from the file read the header and let it move the offset as required
 	CrypwalkHeader header;
@@ -142,113 +159,334 @@ DECRYPT_FILE_RETURN decrypt_file(const char *file_name, const char *encryption_k
 		fclose(file);
 		return DECRYPTION_FILE_ERR;
 	}
-	fclose(file);
 	
 	// false is 0
 	if (verifyHash(encryption_key, header.hash) == 0) {
+		fclose(file);
 		return DECRYPTION_INCORRECT_KEY;
 	}
 
-	DynamicBufferResult buf = read_dynamic_buffer(file_name);
-	unsigned char* concatenated_contents_start = buf.buffer;
-	size_t curr_size = buf.buffer_size;
+	char* decrypt_file_name = decrypted_file_name_for(file_name);
+	if (decrypt_file_name == NULL) {
+		fclose(file);
+		return DECRYPTION_ALLOC_ERROR;
+	}
+	
+	FILE* new_file = fopen(decrypt_file_name, "wb");
+	if (new_file == NULL) {
+		fclose(file);
+		free(decrypt_file_name);
+		return DECRYPTION_ALLOC_ERROR;
+	}
+	setvbuf(new_file, NULL, _IONBF, 0);
+
+	// the file is positioned right past the header, decrypt what follows a
+	// chunk at a time into the new file
+	StreamResult res = stream_blocks(file, new_file, block_decrypt);
+	fclose(file);
+	if (fclose(new_file) != 0 && res == STREAM_SUCCESS) {
+		res = STREAM_WRITE_ERR;
+	}
+
+	if (res != STREAM_SUCCESS) {
+		remove(decrypt_file_name);
+		free(decrypt_file_name);
+		switch (res) {
+		case STREAM_ALGO_ERR:
+			return DECRYPTION_ALGO_ERR;
+		case STREAM_ALLOC_ERR:
+			return DECRYPTION_ALLOC_ERROR;
+		default:
+			return DECRYPTION_FILE_ERR;
+		}
+	}
+
+	free(decrypt_file_name);
+	return 0;
+}
+
+ENCRYPT_FILE_RETURN encrypt_file_mmap(const char *file_name, const char* encryption_key) {
+	if (encryption_key == NULL || strlen(encryption_key) > 7) {
+		return ENCRYPTION_INVALID_KEY;
+	}
+
+	unsigned char* contents;
+	size_t size;
+	int mapped = map_input_file(file_name, &contents, &size);
+	if (mapped == -1) {
+		return ENCRYPTION_FOPEN_ERR;
+	} else if (mapped != 0) {
+		return ENCRYPTION_FILE_ERR;
+	}
+
+	char* encrypted_file_name = encrypted_file_name_for(file_name);
+	if (encrypted_file_name == NULL) {
+		if (size > 0) {
+			munmap(contents, size);
+		}
+		return ENCRYPTION_ALLOC_ERR;
+	}
+
+	// the whole encrypted file, header and payload, is one mapping
+	size_t encrypted_size = sizeof(CrypwalkHeader) + size;
+	unsigned char* encrypted = map_output_file(encrypted_file_name, encrypted_size);
+	if (encrypted == NULL) {
+		if (size > 0) {
+			munmap(contents, size);
+		}
+		remove(encrypted_file_name);
+		free(encrypted_file_name);
+		return ENCRYPTION_WRITE_FILE_ERR;
+	}
+
+	CrypwalkHeader header;
+	header.data_offset = sizeof(CrypwalkHeader);
+	header.hash  = generateHash(encryption_key);
+	header.hash_size = 13;
+	memcpy(encrypted, &header, sizeof(CrypwalkHeader));
+
+	// blocks go straight from the input's pages to the output's
+	int res = map_blocks(contents, encrypted + sizeof(CrypwalkHeader), size, block_encrypt);
+	munmap(encrypted, encrypted_size);
+	if (size > 0) {
+		munmap(contents, size);
+	}
+
+	if (res < 0) {
+		remove(encrypted_file_name);
+		free(encrypted_file_name);
+		return ENCRYPTION_ALGO_ERR;
+	}
 
-	if (concatenated_contents_start == NULL) {
+	free(encrypted_file_name);
+	return ENCRYPTION_SUCCESS;
+}
+
+DECRYPT_FILE_RETURN decrypt_file_mmap(const char *file_name, const char *encryption_key) {
+	if (encryption_key == NULL || strlen(encryption_key) > 7) {
+		return DECRYPTION_INVALID_KEY;
+	}
+
+	if (strlen(file_name) <= strlen(ENCRYPTED_FILE_EXTENSION)) {
 		return DECRYPTION_FILE_ERR;
 	}
 
-	// skip past the header and hash
-	int offset = sizeof(CrypwalkHeader);
-	unsigned char* concatenated_contents = concatenated_contents_start + offset;
-	curr_size -= offset;
+	unsigned char* contents;
+	size_t size;
+	int mapped = map_input_file(file_name, &contents, &size);
+	if (mapped == -1) {
+		return DECRYPTION_FOPEN_ERR;
+	} else if (mapped != 0) {
+		return DECRYPTION_FILE_ERR;
+	}
 
-	int num_rounds = curr_size / 8; // auto floor division
-	for (int i = 0; i < num_rounds; i++) {
-		unsigned char* block = concatenated_contents + (i*8); // move 8 bytes at a time
-		int res = block_decrypt(block);
-		if (res < 0) {
-			free(concatenated_contents_start);
-			return DECRYPTION_ALGO_ERR;
+	if (size < sizeof(CrypwalkHeader)) {
+		if (size > 0) {
+			munmap(contents, size);
 		}
+		return DECRYPTION_FILE_ERR;
 	}
-	
-	int decrypt_file_name_sz = strlen(file_name) - strlen(ENCRYPTED_FILE_EXTENSION);
-	char* decrypt_file_name = (char*) malloc(decrypt_file_name_sz + 1);
-	strncpy(decrypt_file_name, file_name, decrypt_file_name_sz);
-	decrypt_file_name[decrypt_file_name_sz] = '\0';
-	
-	FILE* new_file = fopen(decrypt_file_name, "wb");
-	if (new_file == NULL) {
-		free(decrypt_file_name);
-		free(concatenated_contents_start);
+
+	CrypwalkHeader header;
+	memcpy(&header, contents, sizeof(CrypwalkHeader));
+
+	// false is 0
+	if (verifyHash(encryption_key, header.hash) == 0) {
+		munmap(contents, size);
+		return DECRYPTION_INCORRECT_KEY;
+	}
+
+	char* decrypt_file_name = decrypted_file_name_for(file_name);
+	if (decrypt_file_name == NULL) {
+		munmap(contents, size);
 		return DECRYPTION_ALLOC_ERROR;
 	}
 
-	// write to a new file
-	if (fwrite(concatenated_contents, sizeof(unsigned char), curr_size, new_file) != curr_size) {
-		fclose(new_file);
+	// the payload follows the header, an empty one has nothing to map.
+	// -1 is a failed block, -2 no output file, -3 a failed write
+	size_t decrypted_size = size - sizeof(CrypwalkHeader);
+	int res = 0;
+	if (decrypted_size == 0) {
+		FILE* new_file = fopen(decrypt_file_name, "wb");
+		if (new_file == NULL) {
+			res = -2;
+		} else if (fclose(new_file) != 0) {
+			res = -3;
+		}
+	} else {
+		unsigned char* decrypted = map_output_file(decrypt_file_name, decrypted_size);
+		if (decrypted == NULL) {
+			res = -2;
+		} else {
+			res = map_blocks(contents + sizeof(CrypwalkHeader), decrypted, decrypted_size, block_decrypt);
+			munmap(decrypted, decrypted_size);
+		}
+	}
+	munmap(contents, size);
+
+	if (res < 0) {
+		remove(decrypt_file_name);
 		free(decrypt_file_name);
-		free(concatenated_contents_start);
-		return DECRYPTION_FILE_ERR;
+		// the same codes decrypt_file returns for each of these
+		switch (res) {
+		case -1:
+			return DECRYPTION_ALGO_ERR;
+		case -2:
+			return DECRYPTION_ALLOC_ERROR;
+		default:
+			return DECRYPTION_FILE_ERR;
+		}
 	}
-	
-	fclose(new_file);
+
 	free(decrypt_file_name);
-	free(concatenated_contents_start);
 	return 0;
 }
 
 // ************* Utils implementation *****************
 
-DynamicBufferResult read_dynamic_buffer(const char* file_name) {
-	DynamicBufferResult resp = {NULL, 0};
-
-	FILE* file = fopen(file_name, "rb");
-	if (file  == NULL) {
-		return resp;
+// Reads in STREAM_CHUNK_SIZE chunks, transforms every whole 8 byte block of
+// a chunk in place and writes it out before reading the next one, so memory
+// use is one chunk whatever the size of the file. fread only comes back
+// short at the end of the file, so every chunk but the last is whole blocks
+// and a trailing partial block is copied as is, like it always was.
+// Callers make both streams unbuffered right after opening them, the chunks
+// are large enough that stdio's own buffers only add a copy.
+StreamResult stream_blocks(FILE* in, FILE* out, int (*transform)(unsigned char*)) {
+	unsigned char* chunk = (unsigned char*)aligned_alloc(STREAM_CHUNK_ALIGN, STREAM_CHUNK_SIZE);
+	if (chunk == NULL) {
+		return STREAM_ALLOC_ERR;
 	}
 
-	unsigned char* concatenated_contents = NULL;
-	size_t curr_size = 0;
-
-	char buffer[BUFFER_SIZE];	
-	size_t read = fread(&buffer, sizeof (char), BUFFER_SIZE, file);
+	size_t read = fread(chunk, sizeof (unsigned char), STREAM_CHUNK_SIZE, in);
 	while (read > 0) {
-		if (concatenated_contents == NULL) {
-			concatenated_contents = (unsigned char*)malloc(read * sizeof(unsigned char));
-			if (concatenated_contents == NULL) {
-				fclose(file);
-				return resp;
+		size_t num_rounds = read / DES_BLOCK_BYTES; // auto floor division
+		for (size_t i = 0; i < num_rounds; i++) {
+			unsigned char* block = chunk + (i * DES_BLOCK_BYTES); // move 8 bytes at a time
+			if (transform(block) < 0) {
+				free(chunk);
+				return STREAM_ALGO_ERR;
 			}
-			concatenated_contents = memcpy(concatenated_contents, &buffer, read);
-			if (concatenated_contents == NULL) {
-				fclose(file);
-				return resp;
-			}
-			curr_size += read;
-		} else {
-			// adjust concatenated_contents for increase in size
-			unsigned char* new_adjusted_concatenated = realloc(concatenated_contents, curr_size + read);
-			if (new_adjusted_concatenated == NULL) {
-				free(concatenated_contents);
-				fclose(file);
-				return resp;
-			}
-			concatenated_contents = new_adjusted_concatenated;
-			unsigned char* copied = memcpy(concatenated_contents + curr_size, &buffer, read);
-			if (copied == NULL) {
-				fclose(file);
-				return resp;
-			}
-			curr_size += read;
 		}
-		read = fread(&buffer, sizeof (unsigned char), BUFFER_SIZE, file);
+
+		if (fwrite(chunk, sizeof (unsigned char), read, out) != read) {
+			free(chunk);
+			return STREAM_WRITE_ERR;
+		}
+		read = fread(chunk, sizeof (unsigned char), STREAM_CHUNK_SIZE, in);
 	}
 
-	fclose(file);
-	resp.buffer = concatenated_contents;
-	resp.buffer_size = curr_size;
-	return resp;
+	free(chunk);
+	return ferror(in) ? STREAM_READ_ERR : STREAM_SUCCESS;
+}
+
+// Transforms the size bytes at in into out, both mapped, copying one 8 byte
+// block at a time into place and permuting it there. A trailing partial
+// block is copied as is, like the streaming path does
+int map_blocks(const unsigned char* in, unsigned char* out, size_t size, int (*transform)(unsigned char*)) {
+	size_t num_rounds = size / DES_BLOCK_BYTES; // auto floor division
+	for (size_t i = 0; i < num_rounds; i++) {
+		unsigned char* block = out + (i * DES_BLOCK_BYTES);
+		memcpy(block, in + (i * DES_BLOCK_BYTES), DES_BLOCK_BYTES);
+		if (transform(block) < 0) {
+			return -1;
+		}
+	}
+	size_t done = num_rounds * DES_BLOCK_BYTES;
+	if (size > done) {
+		memcpy(out + done, in + done, size - done);
+	}
+	return 0;
+}
+
+// pages of a mapping are walked front to back once, let the kernel read
+// ahead and drop them behind us, and back large mappings with huge pages
+// where the file system can
+void advise_mapping(void* addr, size_t size) {
+	madvise(addr, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	madvise(addr, size, MADV_HUGEPAGE);
+#endif
+}
+
+// Maps path read only. Returns 0 with *data and *size set, *data is NULL
+// for an empty file which has nothing to map, -1 if the file cannot be
+// opened and -2 if it cannot be mapped
+int map_input_file(const char* path, unsigned char** data, size_t* size) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -2;
+	}
+
+	*size = (size_t)st.st_size;
+	*data = NULL;
+	if (*size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	void* mapped = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) {
+		return -2;
+	}
+	advise_mapping(mapped, *size);
+	*data = (unsigned char*)mapped;
+	return 0;
+}
+
+// Creates path with size bytes and maps it shared, so stores into the
+// mapping are the file's contents. The blocks are allocated up front, a
+// full disk then fails here rather than as a SIGBUS on some page later.
+// size must not be 0. Returns NULL on failure
+unsigned char* map_output_file(const char* path, size_t size) {
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	if (posix_fallocate(fd, 0, (off_t)size) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) {
+		return NULL;
+	}
+	advise_mapping(mapped, size);
+	return (unsigned char*)mapped;
+}
+
+// file_name with ENCRYPTED_FILE_EXTENSION appended, NULL if out of memory
+char* encrypted_file_name_for(const char* file_name) {
+	size_t file_name_len = strlen(file_name);
+	char* encrypted_file_name = (char *)malloc(file_name_len + strlen(ENCRYPTED_FILE_EXTENSION) + 1);
+	if (encrypted_file_name == NULL) {
+		return NULL;
+	}
+	
+	strcpy(encrypted_file_name, file_name);
+	strcpy(encrypted_file_name + file_name_len, ENCRYPTED_FILE_EXTENSION);
+	return encrypted_file_name;
+}
+
+// file_name without its ENCRYPTED_FILE_EXTENSION, NULL if out of memory
+char* decrypted_file_name_for(const char* file_name) {
+	int decrypt_file_name_sz = strlen(file_name) - strlen(ENCRYPTED_FILE_EXTENSION);
+	char* decrypt_file_name = (char*) malloc(decrypt_file_name_sz + 1);
+	if (decrypt_file_name == NULL) {
+		return NULL;
+	}
+	strncpy(decrypt_file_name, file_name, decrypt_file_name_sz);
+	decrypt_file_name[decrypt_file_name_sz] = '\0';
+	return decrypt_file_name;
 }
 
 int block_encrypt(unsigned char* block) {
@@ -25,4 +25,12 @@ ENCRYPT_FILE_RETURN encrypt_file(const char* file_name, const char* encryption_k
 
 DECRYPT_FILE_RETURN decrypt_file(const char* file_name, const char* encryption_key);
 
+// Same results as encrypt_file and decrypt_file, through memory mappings: the
+// input is mapped read only, the output is created at its final size and
+// mapped shared, and blocks are permuted straight from one to the other.
+// Saves the copies through read and write buffers on big files
+ENCRYPT_FILE_RETURN encrypt_file_mmap(const char* file_name, const char* encryption_key);
+
+DECRYPT_FILE_RETURN decrypt_file_mmap(const char* file_name, const char* encryption_key);
+
 #endif
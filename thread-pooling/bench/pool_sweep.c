@@ -0,0 +1,225 @@
+#include <threadpool.h>
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Pool overhead across configurations, all timed with the wall clock:
+//  - throughput: producers flood the pool with empty tasks
+//  - latency: producers submit one empty task at a time to a mostly idle
+//    pool, and every task records how long after submission it started
+//  - fanout: a task spawns FANOUT children from inside the pool and waits
+//    for all of them, per round
+// for every mix of producer count, worker count and queue capacity.
+// One CSV row per run on stdout. Usage: pool_sweep [max_threads]
+
+#define THROUGHPUT_TASKS 200000
+#define LATENCY_TASKS 2000 // per producer
+#define LATENCY_GAP_NS 20000
+#define FANOUT 64
+#define FANOUT_ROUNDS 500 // per producer
+
+static const size_t capacities[] = {16, 1024};
+
+typedef struct {
+  ThreadPool *pool;
+  int producer;
+  int num_producers;
+  pthread_barrier_t *start;
+  uint64_t *latencies; // latency runs, one slot per task
+} Producer;
+
+typedef struct {
+  ThreadPool *pool;
+  atomic_int left;
+  TaskCompletion *done;
+} FanIn;
+
+typedef struct {
+  uint64_t submitted;
+  uint64_t *latency;
+} LatencyProbe;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void empty_task(void *in, void *out) {}
+
+static void probe_task(LatencyProbe *probe, void *out) {
+  *probe->latency = now_ns() - probe->submitted;
+  free(probe);
+}
+
+static void child_task(FanIn *fan, void *out) {
+  if (atomic_fetch_sub(&fan->left, 1) == 1) {
+    completion_signal(fan->done);
+  }
+}
+
+// fans out from inside the pool and fans back in, helping while it waits
+static void root_task(ThreadPool *pool, void *out) {
+  FanIn fan;
+  fan.pool = pool;
+  atomic_init(&fan.left, FANOUT);
+  fan.done = completion_acquire();
+
+  Task children[FANOUT];
+  for (int i = 0; i < FANOUT; i++) {
+    new_task(&children[i], (UserDefFunc_t)&child_task, &fan, NULL, 0, TRUE);
+  }
+  enqueue_tasks(pool, children, FANOUT);
+  while (!completion_is_done(fan.done)) {
+    if (!thread_pool_run_pending_task(pool)) {
+      completion_wait(fan.done);
+    }
+  }
+  completion_release(fan.done);
+}
+
+static void *throughput_producer(Producer *self) {
+  int share = THROUGHPUT_TASKS / self->num_producers;
+  pthread_barrier_wait(self->start);
+  Task task;
+  for (int i = 0; i < share; i++) {
+    new_task(&task, &empty_task, NULL, NULL, 0, TRUE);
+    enqueue_task(self->pool, task);
+  }
+  return NULL;
+}
+
+static void *latency_producer(Producer *self) {
+  pthread_barrier_wait(self->start);
+  Task task;
+  for (int i = 0; i < LATENCY_TASKS; i++) {
+    LatencyProbe *probe = (LatencyProbe *)malloc(sizeof(LatencyProbe));
+    probe->latency = &self->latencies[self->producer * LATENCY_TASKS + i];
+    new_task(&task, (UserDefFunc_t)&probe_task, probe, NULL, 0, TRUE);
+    // pace submissions so the pool is idle in between, what is measured is
+    // how fast an idle pool picks work up. Sleeping rather than spinning
+    // leaves the cpu to the workers when there are few of them
+    probe->submitted = now_ns();
+    enqueue_task(self->pool, task);
+    struct timespec gap = {0, LATENCY_GAP_NS};
+    nanosleep(&gap, NULL);
+  }
+  return NULL;
+}
+
+static void *fanout_producer(Producer *self) {
+  pthread_barrier_wait(self->start);
+  Task root;
+  for (int i = 0; i < FANOUT_ROUNDS; i++) {
+    new_task(&root, (UserDefFunc_t)&root_task, self->pool, NULL, 0, FALSE);
+    enqueue_task(self->pool, root);
+    await_task(&root);
+    destroy_task(&root);
+  }
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t left = *(const uint64_t *)a;
+  uint64_t right = *(const uint64_t *)b;
+  return (left > right) - (left < right);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double q) {
+  size_t rank = (size_t)(q * (double)n);
+  return sorted[rank < n ? rank : n - 1];
+}
+
+// starts the producers, returns the seconds from their common start until
+// the pool went idle
+static double run_producers(ThreadPool *pool, int num_producers,
+                            void *(*body)(Producer *), uint64_t *latencies) {
+  pthread_t threads[num_producers];
+  Producer producers[num_producers];
+  pthread_barrier_t start;
+  pthread_barrier_init(&start, NULL, (unsigned int)num_producers + 1);
+
+  for (int i = 0; i < num_producers; i++) {
+    producers[i].pool = pool;
+    producers[i].producer = i;
+    producers[i].num_producers = num_producers;
+    producers[i].start = &start;
+    producers[i].latencies = latencies;
+    pthread_create(&threads[i], NULL, (void *(*)(void *))body, &producers[i]);
+  }
+
+  pthread_barrier_wait(&start);
+  uint64_t begin = now_ns();
+  for (int i = 0; i < num_producers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  thread_pool_wait_idle(pool);
+  double seconds = (double)(now_ns() - begin) / 1e9;
+
+  pthread_barrier_destroy(&start);
+  return seconds;
+}
+
+static void run_config(int num_producers, int num_workers, size_t capacity) {
+  ThreadPool pool;
+  ThreadPoolOptions opts;
+  thread_pool_default_options(&opts, num_workers);
+  opts.queue_capacity = capacity;
+  if (init_thread_pool_with_options(&pool, &opts) != INIT_THREAD_POOL_SUCCESS) {
+    fprintf(stderr, "Failed to initialize thread pool\n");
+    exit(1);
+  }
+
+  int tasks = THROUGHPUT_TASKS / num_producers * num_producers;
+  double seconds =
+      run_producers(&pool, num_producers, &throughput_producer, NULL);
+  printf("throughput,%d,%d,%zu,%d,%.6f,%.0f,,,\n", num_producers, num_workers,
+         capacity, tasks, seconds, tasks / seconds);
+
+  size_t samples = (size_t)num_producers * LATENCY_TASKS;
+  uint64_t *latencies = (uint64_t *)malloc(sizeof(uint64_t) * samples);
+  assert(latencies != NULL);
+  seconds = run_producers(&pool, num_producers, &latency_producer, latencies);
+  qsort(latencies, samples, sizeof(uint64_t), &compare_u64);
+  printf("latency,%d,%d,%zu,%zu,%.6f,%.0f,%" PRIu64 ",%" PRIu64 ",%" PRIu64
+         "\n",
+         num_producers, num_workers, capacity, samples, seconds,
+         samples / seconds,
+         percentile(latencies, samples, 0.5),
+         percentile(latencies, samples, 0.99),
+         percentile(latencies, samples, 0.999));
+  free(latencies);
+
+  int rounds = num_producers * FANOUT_ROUNDS;
+  seconds = run_producers(&pool, num_producers, &fanout_producer, NULL);
+  printf("fanout,%d,%d,%zu,%d,%.6f,%.0f,,,\n", num_producers, num_workers,
+         capacity, rounds, seconds, rounds / seconds);
+  fflush(stdout);
+
+  destroy_thread_pool(&pool);
+}
+
+int main(int argc, char **argv) {
+  int max_threads = argc > 1 ? atoi(argv[1]) : 4;
+  if (max_threads < 1) {
+    fprintf(stderr, "usage: %s [max_threads]\n", argv[0]);
+    return 1;
+  }
+
+  printf("scenario,producers,workers,capacity,operations,seconds,ops_per_sec,"
+         "p50_ns,p99_ns,p999_ns\n");
+  for (int producers = 1; producers <= max_threads; producers *= 2) {
+    for (int workers = 1; workers <= max_threads; workers *= 2) {
+      for (size_t i = 0; i < sizeof(capacities) / sizeof(capacities[0]);
+           i++) {
+        run_config(producers, workers, capacities[i]);
+      }
+    }
+  }
+  return 0;
+}
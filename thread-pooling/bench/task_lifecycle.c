@@ -0,0 +1,123 @@
+#include <threadpool.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+// Measures what a task costs the submitter outside of running it:
+// creating and destroying awaitable tasks on their own, and the full
+// create -> enqueue -> await -> destroy round trip through a pool.
+// Built with LIFECYCLE_BASELINE (make bench-baseline) it measures the
+// lifecycle from before the completion slab instead, for comparison.
+
+#define NUMBER_TASKS 100000
+#define ROUNDS 5
+
+static Task tasks[NUMBER_TASKS];
+static int results[NUMBER_TASKS];
+
+static void noop(void *in, int *out) { *out = 1; }
+
+#ifdef LIFECYCLE_BASELINE
+#include <semaphore.h>
+#include <stdlib.h>
+#include <uuid/uuid.h>
+
+// Every awaitable task used to malloc and sem_init its own semaphore and
+// generate a uuid string, the worker posted the semaphore once it was done.
+// The tasks still go through today's queue, only their lifecycle is old
+typedef struct {
+  sem_t *awaiter;
+  char uuid_str[37];
+  int *out;
+} BaselineTask;
+
+static BaselineTask baseline[NUMBER_TASKS];
+
+static void run_baseline(BaselineTask *task, void *unused) {
+  noop(NULL, task->out);
+  sem_post(task->awaiter);
+}
+
+static void create_task(int i) {
+  BaselineTask *task = &baseline[i];
+  uuid_t uuid;
+  uuid_generate(uuid);
+  uuid_unparse_lower(uuid, task->uuid_str);
+  task->awaiter = (sem_t *)malloc(sizeof(sem_t));
+  sem_init(task->awaiter, 0, 0);
+  task->out = &results[i];
+  new_task(&tasks[i], (UserDefFunc_t)&run_baseline, task, NULL, 0, TRUE);
+}
+
+static void await_created(int i) { sem_wait(baseline[i].awaiter); }
+
+static void destroy_created(int i) {
+  sem_destroy(baseline[i].awaiter);
+  free(baseline[i].awaiter);
+}
+#else
+static void create_task(int i) {
+  new_task(&tasks[i], (UserDefFunc_t)&noop, NULL, &results[i], sizeof(int),
+           FALSE);
+}
+
+static void await_created(int i) { await_task(&tasks[i]); }
+
+static void destroy_created(int i) { destroy_task(&tasks[i]); }
+#endif
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static double bench_create_destroy() {
+  double start = now_ns();
+  for (int i = 0; i < NUMBER_TASKS; i++) {
+    create_task(i);
+  }
+  for (int i = 0; i < NUMBER_TASKS; i++) {
+    destroy_created(i);
+  }
+  return (now_ns() - start) / NUMBER_TASKS;
+}
+
+static double bench_round_trip(ThreadPool *tp) {
+  double start = now_ns();
+  for (int i = 0; i < NUMBER_TASKS; i++) {
+    results[i] = 0;
+    create_task(i);
+  }
+  enqueue_tasks(tp, tasks, NUMBER_TASKS);
+  for (int i = 0; i < NUMBER_TASKS; i++) {
+    await_created(i);
+  }
+  for (int i = 0; i < NUMBER_TASKS; i++) {
+    assert(results[i] == 1);
+    destroy_created(i);
+  }
+  return (now_ns() - start) / NUMBER_TASKS;
+}
+
+int main() {
+  ThreadPool tp;
+  ThreadPoolOptions opts;
+  thread_pool_default_options(&opts, 4);
+  opts.queue_capacity = 1024;
+  if (init_thread_pool_with_options(&tp, &opts) != INIT_THREAD_POOL_SUCCESS) {
+    printf("Failed to initialize thread pool\n");
+    return -1;
+  }
+
+  printf("round,create_destroy_ns_per_task,round_trip_ns_per_task\n");
+  for (int round = 0; round < ROUNDS; round++) {
+    double create_destroy = bench_create_destroy();
+    double round_trip = bench_round_trip(&tp);
+    printf("%d,%.1f,%.1f\n", round, create_destroy, round_trip);
+  }
+
+  destroy_thread_pool(&tp);
+  return 0;
+}
@@ -0,0 +1,94 @@
+#include <threadpool.h>
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+// A request fans out into slow lookups, gives up on them after a deadline
+// and cancels whatever is still queued or running, so workers stop burning
+// time on answers nobody will read.
+
+#define NUM_LOOKUPS 16
+#define STEPS 50
+
+typedef struct {
+  CancelToken *token;
+  int key;
+} Lookup;
+
+// long running and cooperative, checks its token between steps
+void slow_lookup(Lookup *lookup, int *result) {
+  for (int step = 0; step < STEPS; step++) {
+    if (cancel_token_is_cancelled(lookup->token)) {
+      *result = -1;
+      return;
+    }
+    usleep(1000);
+  }
+  *result = lookup->key * 2;
+}
+
+int main() {
+  ThreadPool tp;
+  if (init_thread_pool(&tp, 2) != INIT_THREAD_POOL_SUCCESS) {
+    printf("Failed to initialize thread pool\n");
+    return 1;
+  }
+
+  CancelToken token;
+  cancel_token_init(&token);
+  Lookup lookups[NUM_LOOKUPS];
+  int results[NUM_LOOKUPS];
+  Task tasks[NUM_LOOKUPS];
+  for (int i = 0; i < NUM_LOOKUPS; i++) {
+    lookups[i].token = &token;
+    lookups[i].key = i;
+    new_task(&tasks[i], (UserDefFunc_t)&slow_lookup, &lookups[i], &results[i],
+             sizeof(int), FALSE);
+    task_set_cancel_token(&tasks[i], &token);
+  }
+  enqueue_tasks(&tp, tasks, NUM_LOOKUPS);
+
+  // the request may take 120 ms, enough for a few lookups
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_nsec += 120 * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  int done = 0, timed_out = 0;
+  for (int i = 0; i < NUM_LOOKUPS; i++) {
+    AwaitTaskResult res = await_task_timed(&tasks[i], &deadline);
+    if (res == AWAIT_TASK_DONE) {
+      done++;
+    } else {
+      timed_out++;
+    }
+  }
+  cancel_token_cancel(&token);
+
+  // the abandoned ones still have to finish before their tasks go away, the
+  // queued ones are skipped and the running ones stop at their next step
+  int skipped = 0;
+  for (int i = 0; i < NUM_LOOKUPS; i++) {
+    if (await_task_timed(&tasks[i], NULL) == AWAIT_TASK_CANCELLED) {
+      skipped++;
+    }
+    destroy_task(&tasks[i]);
+  }
+  assert(done + timed_out == NUM_LOOKUPS);
+  printf("in time: %d, abandoned: %d, of which never ran: %d\n", done,
+         timed_out, skipped);
+
+  ThreadPoolStats stats;
+  thread_pool_stats(&tp, &stats);
+  printf("tasks run: %" PRIu64 ", skipped: %" PRIu64 "\n",
+         stats.tasks_executed, stats.tasks_cancelled);
+
+  destroy_thread_pool(&tp);
+  return 0;
+}
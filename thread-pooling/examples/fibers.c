@@ -0,0 +1,75 @@
+#include <threadpool.h>
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+// Recursive fork and join: every call submits its two halves and awaits
+// them from inside the pool. Plain await_task would tie up a worker per
+// level of recursion and deadlock a pool this small, with fibers a waiting
+// task parks and its worker runs the children meanwhile.
+
+#define NUM_WORKERS 2
+#define CUTOFF 12
+
+typedef struct {
+  ThreadPool *pool;
+  int n;
+} FibArgs;
+
+long fib_serial(int n) {
+  return n < 2 ? n : fib_serial(n - 1) + fib_serial(n - 2);
+}
+
+void fib_task(FibArgs *args, long *result) {
+  if (args->n < CUTOFF) {
+    *result = fib_serial(args->n);
+    return;
+  }
+
+  FibArgs left = {args->pool, args->n - 1};
+  FibArgs right = {args->pool, args->n - 2};
+  long left_result, right_result;
+  Task children[2];
+  new_task(&children[0], (UserDefFunc_t)&fib_task, &left, &left_result,
+           sizeof(long), FALSE);
+  new_task(&children[1], (UserDefFunc_t)&fib_task, &right, &right_result,
+           sizeof(long), FALSE);
+  enqueue_tasks(args->pool, children, 2);
+  await_tasks(children, 2);
+  destroy_task(&children[0]);
+  destroy_task(&children[1]);
+  *result = left_result + right_result;
+}
+
+int main() {
+  ThreadPool tp;
+  ThreadPoolOptions opts;
+  thread_pool_default_options(&opts, NUM_WORKERS);
+  opts.fibers = TRUE;
+  opts.fiber_stack_size = 64 * 1024;
+  if (init_thread_pool_with_options(&tp, &opts) != INIT_THREAD_POOL_SUCCESS) {
+    printf("Failed to initialize thread pool\n");
+    return 1;
+  }
+
+  int n = 27;
+  FibArgs args = {&tp, n};
+  long result;
+  Task root;
+  new_task(&root, (UserDefFunc_t)&fib_task, &args, &result, sizeof(long),
+           FALSE);
+  enqueue_task(&tp, root);
+  await_task(&root);
+  destroy_task(&root);
+
+  assert(result == fib_serial(n));
+  printf("fib(%d) = %ld on %d workers\n", n, result, NUM_WORKERS);
+
+  ThreadPoolStats stats;
+  thread_pool_stats(&tp, &stats);
+  printf("tasks executed: %" PRIu64 "\n", stats.tasks_executed);
+
+  destroy_thread_pool(&tp);
+  return 0;
+}
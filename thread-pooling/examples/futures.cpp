@@ -0,0 +1,60 @@
+#include <threadpool.hpp>
+
+#include <cassert>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+int main() {
+  threadpool::Pool pool(4);
+
+  // plain values come back through the future
+  threadpool::Future<int> answer = pool.submit([] { return 6 * 7; });
+  printf("answer: %d\n", answer.get());
+
+  // move only captures and results, nothing is copied on the way
+  auto numbers = std::make_unique<std::vector<int>>(1000);
+  std::iota(numbers->begin(), numbers->end(), 1);
+  auto total = pool.submit([numbers = std::move(numbers)] {
+    return std::accumulate(numbers->begin(), numbers->end(), 0L);
+  });
+  auto text = pool.submit([] { return std::make_unique<std::string>("moved"); });
+  printf("total: %ld, text: %s\n", total.get(), text.get()->c_str());
+
+  // a task can wait on tasks it submits, it helps run them meanwhile
+  auto outer = pool.submit([&pool] {
+    std::vector<threadpool::Future<long>> parts;
+    for (long part = 0; part < 8; part++) {
+      parts.push_back(pool.submit([part] { return part * part; }));
+    }
+    long sum = 0;
+    for (auto &part : parts) {
+      sum += part.get();
+    }
+    return sum;
+  });
+  printf("sum of squares: %ld\n", outer.get());
+
+  // exceptions travel to get()
+  auto failing = pool.submit([]() -> int { throw std::runtime_error("boom"); });
+  try {
+    failing.get();
+    assert(0);
+  } catch (const std::runtime_error &err) {
+    printf("task threw: %s\n", err.what());
+  }
+
+  // fire and forget, high priority
+  std::atomic_int posted{0};
+  for (int i = 0; i < 100; i++) {
+    pool.post([&posted] { posted.fetch_add(1); }, TASK_PRIORITY_HIGH);
+  }
+  pool.wait_idle();
+  printf("posted tasks run: %d\n", posted.load());
+  assert(posted.load() == 100);
+  return 0;
+}
@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+#include <io_reactor.h>
+#include <threadpool.h>
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Writes a file in chunks, reads every chunk back as soon as it is on disk
+// and fsyncs once all of them match, then accepts a connection and reads
+// what the client sent. Workers only run the steps between the I/O, the
+// reactor waits for it. Pass "epoll" or "uring" to pick a backend.
+
+#define NUM_CHUNKS 64
+#define CHUNK_SIZE 16384
+
+typedef struct {
+  IoReactor *reactor;
+  int fd;
+  atomic_int chunks_left;
+  IoRequest fsync_req;
+  unsigned char written[NUM_CHUNKS * CHUNK_SIZE];
+  unsigned char read_back[NUM_CHUNKS * CHUNK_SIZE];
+} FileJob;
+
+typedef struct {
+  FileJob *job;
+  int index;
+  IoRequest req;
+} Chunk;
+
+void file_synced(FileJob *job, void *unused) {
+  assert(job->fsync_req.result == 0);
+}
+
+void chunk_read(Chunk *chunk, void *unused) {
+  FileJob *job = chunk->job;
+  size_t at = (size_t)chunk->index * CHUNK_SIZE;
+  assert(chunk->req.result == CHUNK_SIZE);
+  assert(memcmp(job->written + at, job->read_back + at, CHUNK_SIZE) == 0);
+  // the last chunk to check makes the file durable
+  if (atomic_fetch_sub(&job->chunks_left, 1) == 1) {
+    io_submit(job->reactor, &job->fsync_req);
+  }
+}
+
+void chunk_written(Chunk *chunk, void *unused) {
+  FileJob *job = chunk->job;
+  size_t at = (size_t)chunk->index * CHUNK_SIZE;
+  assert(chunk->req.result == CHUNK_SIZE);
+  // the request is ours again, reuse it for the read back
+  Task then;
+  new_task(&then, (UserDefFunc_t)&chunk_read, chunk, NULL, 0, TRUE);
+  io_request_read(&chunk->req, job->fd, job->read_back + at, CHUNK_SIZE, at,
+                  then);
+  io_submit(job->reactor, &chunk->req);
+}
+
+typedef struct {
+  IoReactor *reactor;
+  IoRequest accept_req;
+  IoRequest read_req;
+  char message[64];
+} Connection;
+
+void message_read(Connection *conn, void *unused) {
+  assert(conn->read_req.result > 0);
+  conn->message[conn->read_req.result] = '\0';
+  close(conn->read_req.fd);
+}
+
+void accepted(Connection *conn, void *unused) {
+  int fd = (int)conn->accept_req.result;
+  assert(fd >= 0);
+  // the epoll backend waits for readiness, so its fds must not block
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  conn->read_req.fd = fd;
+  io_submit(conn->reactor, &conn->read_req);
+}
+
+int main(int argc, char **argv) {
+  IoBackend backend = IO_BACKEND_AUTO;
+  if (argc > 1 && strcmp(argv[1], "epoll") == 0) {
+    backend = IO_BACKEND_EPOLL;
+  } else if (argc > 1 && strcmp(argv[1], "uring") == 0) {
+    backend = IO_BACKEND_URING;
+  }
+
+  ThreadPool tp;
+  if (init_thread_pool(&tp, 4) != INIT_THREAD_POOL_SUCCESS) {
+    printf("Failed to initialize thread pool\n");
+    return 1;
+  }
+  IoReactor reactor;
+  IoReactorResult res = io_reactor_init(&reactor, &tp, backend);
+  if (res != IO_REACTOR_SUCCESS) {
+    printf("Failed to start the reactor (%d)\n", res);
+    destroy_thread_pool(&tp);
+    return 1;
+  }
+  printf("backend: %s\n",
+         reactor.backend == IO_BACKEND_URING ? "io_uring" : "epoll");
+
+  // file: write, read back, fsync
+  FileJob *job = malloc(sizeof(FileJob));
+  char path[] = "/tmp/io_pipeline_XXXXXX";
+  job->reactor = &reactor;
+  job->fd = mkstemp(path);
+  assert(job->fd >= 0);
+  unlink(path);
+  atomic_store(&job->chunks_left, NUM_CHUNKS);
+  for (size_t i = 0; i < sizeof(job->written); i++) {
+    job->written[i] = (unsigned char)(i * 31 + i / CHUNK_SIZE);
+  }
+  Task synced;
+  new_task(&synced, (UserDefFunc_t)&file_synced, job, NULL, 0, FALSE);
+  io_request_fsync(&job->fsync_req, job->fd, synced);
+
+  Chunk chunks[NUM_CHUNKS];
+  for (int i = 0; i < NUM_CHUNKS; i++) {
+    size_t at = (size_t)i * CHUNK_SIZE;
+    chunks[i].job = job;
+    chunks[i].index = i;
+    Task then;
+    new_task(&then, (UserDefFunc_t)&chunk_written, &chunks[i], NULL, 0, TRUE);
+    io_request_write(&chunks[i].req, job->fd, job->written + at, CHUNK_SIZE,
+                     at, then);
+    io_submit(&reactor, &chunks[i].req);
+  }
+  await_task(&synced);
+  printf("wrote, checked and synced %d chunks of %d bytes\n", NUM_CHUNKS,
+         CHUNK_SIZE);
+  destroy_task(&synced);
+  close(job->fd);
+  free(job);
+
+  // socket: accept, then read what the client sent
+  int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+  if (listener < 0 || bind(listener, (struct sockaddr *)&addr, addr_len) ||
+      listen(listener, 1) ||
+      getsockname(listener, (struct sockaddr *)&addr, &addr_len)) {
+    printf("Failed to listen on localhost (%d)\n", errno);
+    io_reactor_destroy(&reactor);
+    destroy_thread_pool(&tp);
+    return 1;
+  }
+
+  Connection conn;
+  conn.reactor = &reactor;
+  Task got_message, then;
+  new_task(&got_message, (UserDefFunc_t)&message_read, &conn, NULL, 0, FALSE);
+  io_request_read(&conn.read_req, -1, conn.message, sizeof(conn.message) - 1,
+                  IO_OFFSET_CURRENT, got_message);
+  new_task(&then, (UserDefFunc_t)&accepted, &conn, NULL, 0, TRUE);
+  io_request_accept(&conn.accept_req, listener, then);
+  io_submit(&reactor, &conn.accept_req);
+
+  int client = socket(AF_INET, SOCK_STREAM, 0);
+  const char hello[] = "hello through the reactor";
+  if (connect(client, (struct sockaddr *)&addr, addr_len) != 0 ||
+      write(client, hello, strlen(hello)) != (ssize_t)strlen(hello)) {
+    printf("Failed to send to the server (%d)\n", errno);
+    return 1;
+  }
+  await_task(&got_message);
+  printf("server read: %s\n", conn.message);
+  destroy_task(&got_message);
+  close(client);
+  close(listener);
+
+  io_reactor_destroy(&reactor);
+  destroy_thread_pool(&tp);
+  return 0;
+}
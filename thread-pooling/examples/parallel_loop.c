@@ -0,0 +1,52 @@
+#include <parallel.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NUMBER_ELEMENTS 1000000
+
+typedef struct {
+  double *values;
+} LoopCtx;
+
+void fill(size_t begin, size_t end, LoopCtx *ctx) {
+  for (size_t i = begin; i < end; i++) {
+    ctx->values[i] = (double)i;
+  }
+}
+
+void sum(size_t begin, size_t end, LoopCtx *ctx, double *acc) {
+  for (size_t i = begin; i < end; i++) {
+    *acc += ctx->values[i];
+  }
+}
+
+void add(double *acc, const double *other, LoopCtx *ctx) { *acc += *other; }
+
+int main() {
+  ThreadPool tp;
+  if (init_thread_pool(&tp, 4) != INIT_THREAD_POOL_SUCCESS) {
+    printf("Failed to initialize thread pool\n");
+    return -1;
+  }
+
+  LoopCtx ctx;
+  ctx.values = (double *)malloc(sizeof(double) * NUMBER_ELEMENTS);
+
+  // no Task per element, the pool splits the range itself
+  parallel_for(&tp, 0, NUMBER_ELEMENTS, 0, (RangeFunc_t)&fill, &ctx);
+
+  double zero = 0;
+  double total;
+  parallel_reduce(&tp, 0, NUMBER_ELEMENTS, 0, (RangeReduceFunc_t)&sum,
+                  (CombineFunc_t)&add, &zero, sizeof(double), &total, &ctx);
+
+  double expected = (double)NUMBER_ELEMENTS * (NUMBER_ELEMENTS - 1) / 2;
+  assert(total == expected);
+  printf("Sum of 0..%d is %.0f\n", NUMBER_ELEMENTS - 1, total);
+
+  free(ctx.values);
+  destroy_thread_pool(&tp);
+  return 0;
+}
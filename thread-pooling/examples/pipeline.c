@@ -0,0 +1,88 @@
+#include <task_graph.h>
+
+#include <stdio.h>
+
+#define NUMBER_CHUNKS 4
+#define CHUNK_SIZE 1000
+
+typedef struct {
+  int values[CHUNK_SIZE];
+  long sum;
+} Chunk;
+
+void load(Chunk *chunk, void *out) {
+  for (int i = 0; i < CHUNK_SIZE; i++) {
+    chunk->values[i] = i;
+  }
+}
+
+void square(Chunk *chunk, void *out) {
+  for (int i = 0; i < CHUNK_SIZE; i++) {
+    chunk->values[i] *= chunk->values[i];
+  }
+}
+
+void sum(Chunk *chunk, void *out) {
+  chunk->sum = 0;
+  for (int i = 0; i < CHUNK_SIZE; i++) {
+    chunk->sum += chunk->values[i];
+  }
+}
+
+void report(Chunk *chunks, long *out) {
+  *out = 0;
+  for (int i = 0; i < NUMBER_CHUNKS; i++) {
+    *out += chunks[i].sum;
+  }
+}
+
+int main() {
+  ThreadPool tp;
+  if (init_thread_pool(&tp, 4) != INIT_THREAD_POOL_SUCCESS) {
+    printf("Failed to initialize thread pool\n");
+    return -1;
+  }
+
+  // load -> square -> sum for every chunk, and one report after all sums.
+  // No thread waits between the stages, each one is started by the worker
+  // that finished the one before it
+  Chunk chunks[NUMBER_CHUNKS];
+  long total;
+  TaskGraph graph;
+  task_graph_init(&graph);
+
+  // the report keeps its awaiter, so it can be awaited like any other task
+  Task report_task;
+  new_task(&report_task, (UserDefFunc_t)&report, chunks, &total, sizeof(long),
+           FALSE);
+  GraphTask *last = task_graph_add(&graph, report_task);
+
+  Task task;
+  for (int i = 0; i < NUMBER_CHUNKS; i++) {
+    UserDefFunc_t stages[] = {(UserDefFunc_t)&load, (UserDefFunc_t)&square,
+                              (UserDefFunc_t)&sum};
+    GraphTask *prev = NULL;
+    for (int s = 0; s < 3; s++) {
+      new_task(&task, stages[s], &chunks[i], NULL, 0, TRUE);
+      GraphTask *node = task_graph_add(&graph, task);
+      if (prev != NULL) {
+        task_then(prev, node);
+      }
+      prev = node;
+    }
+    task_then(prev, last);
+  }
+
+  if (task_graph_submit(&tp, &graph) != TASK_GRAPH_SUCCESS) {
+    printf("Failed to submit the graph\n");
+    return -1;
+  }
+  await_task(&report_task);
+  printf("Sum of squares over %d chunks: %ld\n", NUMBER_CHUNKS, total);
+
+  task_graph_wait(&graph);
+  destroy_task(&report_task);
+  task_graph_destroy(&graph);
+  destroy_thread_pool(&tp);
+  return 0;
+}
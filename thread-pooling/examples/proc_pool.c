@@ -0,0 +1,99 @@
+#include <proc_pool.h>
+
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Runs a "plugin" over a batch of inputs in worker processes. One input
+// makes the plugin crash, which costs that input its result and nothing
+// else: the other tasks finish, the dead worker is replaced, and the pool
+// keeps going.
+
+#define NUM_INPUTS 64
+#define POISON 13
+
+typedef struct {
+  int input;
+} PluginArgs;
+
+typedef struct {
+  int output;
+  pid_t worker;
+} PluginResult;
+
+// a plugin with a bug, it dereferences garbage on one input
+void plugin_run(PluginArgs *args, PluginResult *result) {
+  if (args->input == POISON) {
+    raise(SIGSEGV);
+  }
+  result->output = args->input * args->input;
+  result->worker = getpid();
+}
+
+int main() {
+  ProcPoolOptions opts;
+  proc_pool_default_options(&opts, 4);
+  opts.queue_capacity = 16;
+
+  // plugins would be loaded before here, workers are forked by init
+  ProcPool pool;
+  ProcPoolResult res = proc_pool_init(&pool, &opts);
+  if (res != PROC_POOL_SUCCESS) {
+    printf("Failed to start the process pool (%d)\n", res);
+    return 1;
+  }
+
+  ProcTask tasks[NUM_INPUTS];
+  PluginResult results[NUM_INPUTS];
+  for (int i = 0; i < NUM_INPUTS; i++) {
+    PluginArgs args = {i};
+    proc_new_task(&tasks[i], (ProcTaskFunc)&plugin_run, &args, sizeof(args),
+                  &results[i], sizeof(PluginResult), FALSE);
+    if (proc_enqueue_task(&pool, &tasks[i]) != PROC_ENQUEUE_SUCCESS) {
+      printf("Failed to enqueue input %d\n", i);
+      return 1;
+    }
+  }
+
+  int done = 0;
+  pid_t workers[NUM_INPUTS];
+  int num_workers = 0;
+  for (int i = 0; i < NUM_INPUTS; i++) {
+    ProcAwaitResult awaited = proc_await_task(&tasks[i]);
+    if (i == POISON) {
+      assert(awaited == PROC_TASK_CRASHED);
+    } else {
+      assert(awaited == PROC_TASK_DONE);
+      assert(results[i].output == i * i);
+      done++;
+      int seen = 0;
+      for (int w = 0; w < num_workers; w++) {
+        seen |= workers[w] == results[i].worker;
+      }
+      if (!seen) {
+        workers[num_workers++] = results[i].worker;
+      }
+    }
+    proc_destroy_task(&tasks[i]);
+  }
+  printf("%d inputs done, input %d crashed its worker\n", done, POISON);
+
+  // the replacement takes work like any other worker
+  ProcTask after;
+  PluginResult after_result;
+  PluginArgs args = {7};
+  proc_new_task(&after, (ProcTaskFunc)&plugin_run, &args, sizeof(args),
+                &after_result, sizeof(PluginResult), FALSE);
+  proc_enqueue_task(&pool, &after);
+  assert(proc_await_task(&after) == PROC_TASK_DONE);
+  assert(after_result.output == 49);
+  proc_destroy_task(&after);
+
+  printf("%d worker processes ran tasks, %llu crash(es)\n", num_workers,
+         (unsigned long long)proc_pool_crashes(&pool));
+  assert(proc_pool_crashes(&pool) == 1);
+  proc_pool_destroy(&pool);
+  return 0;
+}
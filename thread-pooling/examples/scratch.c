@@ -0,0 +1,127 @@
+#include <threadpool.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Parses batches of CSV records. Every task splits its batch into fields
+// held in scratch memory, which goes away by itself when the task returns,
+// and counts into a per worker tally set up once per thread, so the hot path
+// neither mallocs nor shares a counter.
+
+#define NUM_BATCHES 2000
+#define RECORDS_PER_BATCH 32
+#define FIELDS_PER_RECORD 4
+
+typedef struct {
+  long records;
+  long sum;
+} Tally;
+
+// what every worker adds its tally to on exit
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+static Tally totals;
+static int workers_seen;
+
+void *tally_init(int index, void *arg) { return calloc(1, sizeof(Tally)); }
+
+void tally_exit(Tally *tally, void *arg) {
+  pthread_mutex_lock(&totals_lock);
+  totals.records += tally->records;
+  totals.sum += tally->sum;
+  workers_seen++;
+  pthread_mutex_unlock(&totals_lock);
+  free(tally);
+}
+
+typedef struct {
+  int batch;
+} Batch;
+
+void parse_batch(Batch *batch, long *out) {
+  // a batch as it would come off the wire
+  size_t text_size = RECORDS_PER_BATCH * FIELDS_PER_RECORD * 12;
+  char *text = thread_pool_scratch_alloc(text_size);
+  char *at = text;
+  for (int r = 0; r < RECORDS_PER_BATCH; r++) {
+    for (int f = 0; f < FIELDS_PER_RECORD; f++) {
+      at += sprintf(at, f == FIELDS_PER_RECORD - 1 ? "%d\n" : "%d,",
+                    batch->batch + r + f);
+    }
+  }
+
+  // every record gets its own field array, the kind of short lived buffers
+  // that would otherwise be a malloc and a free each
+  long sum = 0;
+  char *line = text;
+  for (int r = 0; r < RECORDS_PER_BATCH; r++) {
+    char **fields = thread_pool_scratch_alloc(sizeof(char *) * FIELDS_PER_RECORD);
+    size_t len = strcspn(line, "\n");
+    char *copy = thread_pool_scratch_alloc(len + 1);
+    memcpy(copy, line, len);
+    copy[len] = '\0';
+    char *save;
+    int n = 0;
+    for (char *tok = strtok_r(copy, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save)) {
+      fields[n++] = tok;
+    }
+    assert(n == FIELDS_PER_RECORD);
+    for (int f = 0; f < n; f++) {
+      sum += atol(fields[f]);
+    }
+    line += len + 1;
+  }
+
+  Tally *tally = thread_pool_worker_context();
+  tally->records += RECORDS_PER_BATCH;
+  tally->sum += sum;
+  *out = sum;
+}
+
+int main() {
+  ThreadPoolOptions opts;
+  thread_pool_default_options(&opts, 4);
+  opts.queue_capacity = 256;
+  opts.worker_init = &tally_init;
+  opts.worker_exit = (WorkerExitFunc)&tally_exit;
+
+  ThreadPool tp;
+  if (init_thread_pool_with_options(&tp, &opts) != INIT_THREAD_POOL_SUCCESS) {
+    printf("Failed to initialize thread pool\n");
+    return 1;
+  }
+
+  static Batch batches[NUM_BATCHES];
+  static long sums[NUM_BATCHES];
+  static Task tasks[NUM_BATCHES];
+  long expected = 0;
+  for (int i = 0; i < NUM_BATCHES; i++) {
+    batches[i].batch = i;
+    for (int r = 0; r < RECORDS_PER_BATCH; r++) {
+      for (int f = 0; f < FIELDS_PER_RECORD; f++) {
+        expected += i + r + f;
+      }
+    }
+    new_task(&tasks[i], (UserDefFunc_t)&parse_batch, &batches[i], &sums[i],
+             sizeof(long), FALSE);
+    enqueue_task(&tp, tasks[i]);
+  }
+
+  long sum = 0;
+  for (int i = 0; i < NUM_BATCHES; i++) {
+    await_task(&tasks[i]);
+    sum += sums[i];
+    destroy_task(&tasks[i]);
+  }
+  assert(sum == expected);
+
+  // the tallies arrive as the workers exit
+  destroy_thread_pool(&tp);
+  assert(totals.sum == expected);
+  printf("parsed %ld records on %d workers, sum %ld\n", totals.records,
+         workers_seen, totals.sum);
+  return 0;
+}
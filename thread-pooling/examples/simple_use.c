@@ -10,19 +10,35 @@
 typedef struct {
 	int x;
 	int y;
+	ThreadPool *pool;
 } AddArgs;
 
 void add(AddArgs* args, int* out) {
     int milliseconds = 30 * 1000;
+    // the worker sleeps, the pool may start another one meanwhile
+    thread_pool_begin_blocking(args->pool);
     usleep(milliseconds);
+    thread_pool_end_blocking(args->pool);
 	*out = args->x + args->y;
 }
 
+// elapsed wall clock time, clock() would only count cpu time and miss the
+// time spent waiting on the pool
+double wall_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
 int main() {
   ThreadPool tp;
   InitThreadPoolResult tp_init_res;
 
-  tp_init_res = init_thread_pool(&tp, 15);
+  ThreadPoolOptions opts;
+  thread_pool_default_options(&opts, 15);
+  // every task sleeps, up to 15 more workers keep the queue moving meanwhile
+  opts.max_blocking_threads = 15;
+  tp_init_res = init_thread_pool_with_options(&tp, &opts);
 
   printf("thread pool was created with result %d \n", tp_init_res);
 
@@ -35,9 +51,9 @@ int main() {
   int seq_results[NUMBER_TASKS];
 
   printf("######## SEQUENTIAL ASYNC AWAIT #############\n");
-  clock_t sequential_start = clock();
+  double sequential_start = wall_seconds();
   Task sequential_tasks[NUMBER_TASKS];
-  AddArgs args = {2, 3};
+  AddArgs args = {2, 3, &tp};
   for (int i = 0; i < NUMBER_TASKS; i++) {
     new_task(&sequential_tasks[i], (UserDefFunc_t)&add, &args, &seq_results[i], sizeof(int), FALSE);
     enqueue_task(&tp, sequential_tasks[i]);
@@ -46,15 +62,15 @@ int main() {
     assert(seq_results[i] == 5);
     destroy_task(&sequential_tasks[i]);
   }
-  clock_t sequential_end = clock();
-  double seq_diff = ((double) (sequential_end - sequential_start)) / CLOCKS_PER_SEC;
-  printf("---- (Cpu Clock time) Sequential Task Processing Completed In: %f -----\n", seq_diff);
+  double sequential_end = wall_seconds();
+  double seq_diff = sequential_end - sequential_start;
+  printf("---- (Wall Clock time) Sequential Task Processing Completed In: %f -----\n", seq_diff);
 
 
   int con_results[NUMBER_TASKS];
   printf("######### CONCURRENT ASYNC AWAIT ############\n");
-  AddArgs con_args = {5, 3};
-  clock_t conc_start = clock();
+  AddArgs con_args = {5, 3, &tp};
+  double conc_start = wall_seconds();
   Task concurrent_tasks[NUMBER_TASKS];
   for (int i = 0; i < NUMBER_TASKS; i++) {
     new_task(&concurrent_tasks[i], (UserDefFunc_t) &add, &con_args, &con_results[i], sizeof(int), FALSE);
@@ -67,9 +83,63 @@ int main() {
     assert(con_results[i] == 8);
     destroy_task(&concurrent_tasks[i]);
   }
-  clock_t conc_end = clock();
-  double conc_diff = ((double) (conc_end- conc_start)) / CLOCKS_PER_SEC;
-  printf("---- (Cpu Clock time) Concurrent Task Processing Completed In: %f ---- \n", conc_diff);
+  double conc_end = wall_seconds();
+  double conc_diff = conc_end - conc_start;
+  printf("---- (Wall Clock time) Concurrent Task Processing Completed In: %f ---- \n", conc_diff);
+
+  int batch_results[NUMBER_TASKS];
+  printf("######### BATCHED ASYNC AWAIT ############\n");
+  AddArgs batch_args = {4, 4, &tp};
+  double batch_start = wall_seconds();
+  Task batch_tasks[NUMBER_TASKS];
+  for (int i = 0; i < NUMBER_TASKS; i++) {
+    new_task(&batch_tasks[i], (UserDefFunc_t) &add, &batch_args, &batch_results[i], sizeof(int), FALSE);
+  }
+
+  // one reservation and one wakeup round for the whole batch
+  enqueue_tasks(&tp, batch_tasks, NUMBER_TASKS);
+  await_tasks(batch_tasks, NUMBER_TASKS);
+  for (int i = 0; i < NUMBER_TASKS; i++) {
+    assert(batch_results[i] == 8);
+    destroy_task(&batch_tasks[i]);
+  }
+  double batch_end = wall_seconds();
+  double batch_diff = batch_end - batch_start;
+  printf("---- (Wall Clock time) Batched Task Processing Completed In: %f ---- \n", batch_diff);
+
+  int queued_results[NUMBER_TASKS];
+  printf("######### COMPLETION QUEUE ############\n");
+  AddArgs queued_args = {6, 1, &tp};
+  double queued_start = wall_seconds();
+  CompletionQueue done;
+  if (completion_queue_init(&done, NUMBER_TASKS) != 0) {
+    printf("Failed to create the completion queue\n");
+    return -1;
+  }
+  Task queued_tasks[NUMBER_TASKS];
+  for (int i = 0; i < NUMBER_TASKS; i++) {
+    new_task(&queued_tasks[i], (UserDefFunc_t) &add, &queued_args, &queued_results[i], sizeof(int), FALSE);
+    // the tag is the index, so a harvested tag leads straight to its task
+    task_set_completion_queue(&queued_tasks[i], &done, (uint64_t)i);
+  }
+  enqueue_tasks(&tp, queued_tasks, NUMBER_TASKS);
+
+  // results come in the order tasks finish, as many per wakeup as are there
+  int harvested = 0, wakeups = 0;
+  uint64_t tags[NUMBER_TASKS];
+  while (harvested < NUMBER_TASKS) {
+    size_t n = completion_queue_wait(&done, tags, NUMBER_TASKS, NULL);
+    for (size_t j = 0; j < n; j++) {
+      assert(queued_results[tags[j]] == 7);
+      destroy_task(&queued_tasks[tags[j]]);
+    }
+    harvested += (int)n;
+    wakeups++;
+  }
+  completion_queue_destroy(&done);
+  double queued_end = wall_seconds();
+  double queued_diff = queued_end - queued_start;
+  printf("---- (Wall Clock time) Completion Queue Processing Completed In: %f, %d wakeups ---- \n", queued_diff, wakeups);
 
   // ----- DESTRUCTION -------
   printf("Requesting thread pool destruction\n");
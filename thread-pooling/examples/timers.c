@@ -0,0 +1,43 @@
+#include <threadpool.h>
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <unistd.h>
+
+atomic_int heartbeats;
+
+void heartbeat(void *args, void *out) { atomic_fetch_add(&heartbeats, 1); }
+
+void reminder(const char *msg, void *out) { printf("%s\n", msg); }
+
+int main() {
+  ThreadPool tp;
+  if (init_thread_pool(&tp, 2) != INIT_THREAD_POOL_SUCCESS) {
+    printf("Failed to initialize thread pool\n");
+    return -1;
+  }
+
+  // no worker sleeps for these, the timer thread hands them over when due
+  Task beat;
+  new_task(&beat, &heartbeat, NULL, NULL, 0, TRUE);
+  TimerHandle beat_timer;
+  enqueue_task_every(&tp, beat, 10, &beat_timer);
+
+  Task later;
+  new_task(&later, (UserDefFunc_t)&reminder, "100ms later", NULL, 0, FALSE);
+  enqueue_task_after(&tp, later, 100, NULL);
+  await_task(&later);
+  destroy_task(&later);
+
+  Task never;
+  new_task(&never, (UserDefFunc_t)&reminder, "never printed", NULL, 0, TRUE);
+  TimerHandle never_timer;
+  enqueue_task_after(&tp, never, 1000, &never_timer);
+  cancel_timer(&tp, never_timer);
+
+  cancel_timer(&tp, beat_timer);
+  printf("Heartbeats in the first 100ms: %d\n", atomic_load(&heartbeats));
+
+  destroy_thread_pool(&tp);
+  return 0;
+}
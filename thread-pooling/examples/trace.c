@@ -0,0 +1,70 @@
+#include <threadpool.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+// Records a trace of a workload with a convoy in it: every burst has one
+// slow task, and the short ones queued behind it on the same worker wait
+// until a thief comes along. Open the output in ui.perfetto.dev or
+// chrome://tracing to see the queue waits, the idle gaps between bursts
+// and which worker ran what. The first argument names the file,
+// trace.json by default.
+
+#define NUM_BURSTS 8
+#define BURST_SIZE 32
+
+void spin_for_us(long *us, void *unused) {
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while ((now.tv_sec - start.tv_sec) * 1000000 +
+               (now.tv_nsec - start.tv_nsec) / 1000 <
+           *us);
+}
+
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : "trace.json";
+
+  ThreadPoolOptions opts;
+  thread_pool_default_options(&opts, 4);
+  opts.queue_capacity = 64;
+  opts.trace = TRUE;
+  ThreadPool tp;
+  if (init_thread_pool_with_options(&tp, &opts) != INIT_THREAD_POOL_SUCCESS) {
+    printf("Failed to initialize thread pool\n");
+    return 1;
+  }
+
+  static long durations[BURST_SIZE];
+  for (int i = 0; i < BURST_SIZE; i++) {
+    durations[i] = i == 0 ? 2000 : 50;
+  }
+  for (int burst = 0; burst < NUM_BURSTS; burst++) {
+    Task tasks[BURST_SIZE];
+    for (int i = 0; i < BURST_SIZE; i++) {
+      new_task(&tasks[i], (UserDefFunc_t)&spin_for_us, &durations[i], NULL, 0,
+               TRUE);
+    }
+    enqueue_tasks(&tp, tasks, BURST_SIZE);
+    thread_pool_wait_idle(&tp);
+    // long enough for the workers to park, so the gaps show as idle
+    struct timespec pause = {0, 2000000};
+    nanosleep(&pause, NULL);
+  }
+
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    printf("Failed to open %s\n", path);
+    destroy_thread_pool(&tp);
+    return 1;
+  }
+  bool_t written = thread_pool_trace_write(&tp, out);
+  fclose(out);
+  assert(written);
+  printf("wrote the trace of %d tasks to %s\n", NUM_BURSTS * BURST_SIZE, path);
+
+  destroy_thread_pool(&tp);
+  return 0;
+}
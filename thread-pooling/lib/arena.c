@@ -0,0 +1,69 @@
+#include "arena.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// usable memory starts right after the header, kept aligned
+#define CHUNK_HEADER                                                           \
+  ((sizeof(ArenaChunk) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN)
+
+static char *chunk_data(ArenaChunk *chunk) {
+  return (char *)chunk + CHUNK_HEADER;
+}
+
+void arena_init(Arena *arena, size_t chunk_size) {
+  arena->chunk = NULL;
+  arena->cursor = NULL;
+  arena->chunk_size = chunk_size;
+}
+
+void arena_destroy(Arena *arena) {
+  while (arena->chunk != NULL) {
+    ArenaChunk *prev = arena->chunk->prev;
+    free(arena->chunk);
+    arena->chunk = prev;
+  }
+  arena->cursor = NULL;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+  if (arena->chunk != NULL) {
+    uintptr_t at = ((uintptr_t)arena->cursor + ARENA_ALIGN - 1) &
+                   ~(uintptr_t)(ARENA_ALIGN - 1);
+    if (size <= (size_t)((uintptr_t)arena->chunk->end - at)) {
+      arena->cursor = (char *)at + size;
+      return (void *)at;
+    }
+  }
+
+  // the rest of the current chunk is wasted until the next rewind
+  size_t usable = size > arena->chunk_size ? size : arena->chunk_size;
+  if (usable > SIZE_MAX - CHUNK_HEADER) {
+    return NULL;
+  }
+  ArenaChunk *chunk = (ArenaChunk *)malloc(CHUNK_HEADER + usable);
+  if (chunk == NULL) {
+    return NULL;
+  }
+  chunk->prev = arena->chunk;
+  chunk->size = usable;
+  chunk->end = chunk_data(chunk) + usable;
+  arena->chunk = chunk;
+  arena->cursor = chunk_data(chunk) + size;
+  return chunk_data(chunk);
+}
+
+void arena_rewind(Arena *arena, ArenaMark mark) {
+  while (arena->chunk != mark.chunk) {
+    ArenaChunk *chunk = arena->chunk;
+    if (chunk->prev == NULL && chunk->size == arena->chunk_size) {
+      // the first chunk, kept for the next round
+      arena->cursor = chunk_data(chunk);
+      return;
+    }
+    arena->chunk = chunk->prev;
+    free(chunk);
+  }
+  arena->cursor = mark.cursor;
+}
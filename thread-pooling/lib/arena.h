@@ -0,0 +1,53 @@
+#ifndef ARENA
+#define ARENA
+
+#include <stddef.h>
+
+// allocations are aligned for any type, like malloc's
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+typedef struct __arena_chunk {
+  struct __arena_chunk *prev; // chunk allocated before this one
+  char *end;
+  size_t size; // usable bytes
+} ArenaChunk;
+
+/*
+ * Bump allocator for memory that dies all at once. Allocating moves a
+ * cursor through a chunk, freeing only happens by rewinding to a mark, so
+ * neither ever takes a lock or looks at other threads. A request that does
+ * not fit starts a new chunk, chunk_size bytes or the request if larger.
+ * The first chunk of chunk_size stays allocated once made and is reused by
+ * every rewind, later ones are freed when a rewind passes them.
+ * Single threaded, each arena belongs to one thread or fiber at a time.
+ */
+typedef struct {
+  ArenaChunk *chunk; // newest, NULL before the first allocation
+  char *cursor;
+  size_t chunk_size;
+} Arena;
+
+// position to rewind to, everything allocated after it goes at once
+typedef struct {
+  ArenaChunk *chunk;
+  char *cursor;
+} ArenaMark;
+
+// allocates nothing until the first arena_alloc
+void arena_init(Arena *arena, size_t chunk_size);
+
+// frees every chunk, the arena can be used again afterwards
+void arena_destroy(Arena *arena);
+
+// NULL only if a new chunk was needed and malloc failed
+void *arena_alloc(Arena *arena, size_t size);
+
+static inline ArenaMark arena_mark(Arena *arena) {
+  ArenaMark mark = {arena->chunk, arena->cursor};
+  return mark;
+}
+
+// frees everything allocated since mark was taken
+void arena_rewind(Arena *arena, ArenaMark mark);
+
+#endif
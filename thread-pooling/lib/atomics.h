@@ -0,0 +1,34 @@
+#ifndef ATOMICS
+#define ATOMICS
+
+// The public headers are C11, this lets C++ include them too, see
+// threadpool.hpp. With gcc and clang std::atomic<T> has the same size,
+// alignment and representation as _Atomic T for the integer types used
+// here, which C++23 spells out in its own <stdatomic.h>.
+// Members of the shared structs are aligned with TP_ALIGNAS, _Alignas in C
+// and alignas in C++
+#ifdef __cplusplus
+#include <atomic>
+#include <cstdint>
+
+#define TP_ALIGNAS(n) alignas(n)
+
+using std::atomic_int;
+using std::atomic_llong;
+using std::atomic_size_t;
+using std::atomic_uint;
+using std::atomic_uint_least64_t;
+using std::atomic_uintptr_t;
+
+using std::atomic_load_explicit;
+using std::atomic_store_explicit;
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+#else
+#include <stdatomic.h>
+
+#define TP_ALIGNAS(n) _Alignas(n)
+#endif
+
+#endif
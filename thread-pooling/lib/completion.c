@@ -0,0 +1,266 @@
+#include "completion.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "fiber.h"
+#include "futex.h"
+
+#define COMPLETION_CHUNK_BITS 10
+#define COMPLETION_CHUNK_SIZE (1u << COMPLETION_CHUNK_BITS)
+#define COMPLETION_MAX_CHUNKS 4096
+
+// parked list of a signalled completion, no waiter is ever registered after
+#define PARKED_CLOSED ((uintptr_t)1)
+
+/*
+ * The slab is a table of fixed size chunks that only ever grows, slots are
+ * never handed back to the allocator so a pointer to a released slot stays
+ * valid (a late futex_wake on a recycled slot is just a spurious wakeup).
+ *
+ * Free slots form a lock free stack linked by index. The head packs a
+ * generation tag in the upper 32 bits next to the index so a pop that races
+ * a pop/push pair of the same slot (ABA) fails its CAS.
+ */
+static TaskCompletion *chunks[COMPLETION_MAX_CHUNKS];
+static size_t num_chunks = 0;
+static pthread_mutex_t grow_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic uint64_t free_head = 0;
+
+static TaskCompletion *slot_at(uint32_t index) {
+  return &chunks[index >> COMPLETION_CHUNK_BITS]
+                [index & (COMPLETION_CHUNK_SIZE - 1)];
+}
+
+// push the already linked list first..last onto the free stack
+static void push_free_list(TaskCompletion *first, TaskCompletion *last) {
+  uint64_t head = atomic_load(&free_head);
+  uint64_t next;
+  do {
+    atomic_store_explicit(&last->next_free, (uint32_t)head,
+                          memory_order_relaxed);
+    next = ((head >> 32) + 1) << 32 | (first->index + 1);
+  } while (!atomic_compare_exchange_weak(&free_head, &head, next));
+}
+
+// add one chunk of slots to the slab, returns 0 if the slab is maxed out or
+// the allocation failed
+static int grow() {
+  pthread_mutex_lock(&grow_mutex);
+  if (num_chunks == COMPLETION_MAX_CHUNKS) {
+    pthread_mutex_unlock(&grow_mutex);
+    return 0;
+  }
+
+  TaskCompletion *chunk = (TaskCompletion *)aligned_alloc(
+      CACHE_LINE_SIZE, sizeof(TaskCompletion) * COMPLETION_CHUNK_SIZE);
+  if (chunk == NULL) {
+    pthread_mutex_unlock(&grow_mutex);
+    return 0;
+  }
+
+  uint32_t base = (uint32_t)(num_chunks << COMPLETION_CHUNK_BITS);
+  for (uint32_t i = 0; i < COMPLETION_CHUNK_SIZE; i++) {
+    chunk[i].index = base + i;
+    atomic_init(&chunk[i].state, COMPLETION_PENDING);
+    atomic_init(&chunk[i].waiters, 0);
+    atomic_init(&chunk[i].next_free, base + i + 2);
+    atomic_init(&chunk[i].parked, 0);
+    chunk[i].queue = NULL;
+  }
+  chunks[num_chunks] = chunk;
+  num_chunks++;
+  pthread_mutex_unlock(&grow_mutex);
+
+  push_free_list(&chunk[0], &chunk[COMPLETION_CHUNK_SIZE - 1]);
+  return 1;
+}
+
+TaskCompletion *completion_acquire() {
+  uint64_t head = atomic_load(&free_head);
+  while (1) {
+    uint32_t top = (uint32_t)head;
+    if (top == 0) {
+      if (!grow()) {
+        return NULL;
+      }
+      head = atomic_load(&free_head);
+      continue;
+    }
+
+    TaskCompletion *slot = slot_at(top - 1);
+    uint32_t next =
+        atomic_load_explicit(&slot->next_free, memory_order_relaxed);
+    uint64_t new_head = ((head >> 32) + 1) << 32 | next;
+    if (atomic_compare_exchange_weak(&free_head, &head, new_head)) {
+      atomic_store_explicit(&slot->state, COMPLETION_PENDING,
+                            memory_order_relaxed);
+      atomic_store_explicit(&slot->parked, 0, memory_order_relaxed);
+      slot->queue = NULL;
+      return slot;
+    }
+  }
+}
+
+void completion_release(TaskCompletion *completion) {
+  push_free_list(completion, completion);
+}
+
+void completion_reserve(size_t n) {
+  pthread_mutex_lock(&grow_mutex);
+  size_t have = num_chunks << COMPLETION_CHUNK_BITS;
+  pthread_mutex_unlock(&grow_mutex);
+
+  while (have < n && grow()) {
+    have += COMPLETION_CHUNK_SIZE;
+  }
+}
+
+/*
+ * state is stored before waiters is read and a waiter registers before the
+ * kernel re-checks state, both seq_cst, so either the signaller sees the
+ * waiter or the waiter sees the completion done and never sleeps.
+ * Parked waiters are taken off in one exchange that also closes the list, a
+ * park racing it either lands in the taken list or finds it closed. The
+ * exchange is unconditional, checking for an empty list first would let a
+ * park slip in between. It comes before state is stored, once state is done
+ * a waiter may release the slot and a new owner acquire it, and the list
+ * then belongs to the new owner. A park that finds the list closed while
+ * state is still pending is the short window in between, see fiber_await.
+ * The queue and tag are read first, a waiter may release the slot as soon
+ * as it sees it done, and pushed last, a harvester may release it as soon
+ * as it has the tag.
+ */
+static void signal_state(TaskCompletion *completion, unsigned int state) {
+  CompletionQueue *queue = completion->queue;
+  uint64_t tag = completion->tag;
+  uintptr_t parked = atomic_exchange(&completion->parked, PARKED_CLOSED);
+  atomic_store(&completion->state, state);
+  if (atomic_load(&completion->waiters) > 0) {
+    futex_wake_all(&completion->state);
+  }
+  while (parked != 0 && parked != PARKED_CLOSED) {
+    CompletionWaiter *waiter = (CompletionWaiter *)parked;
+    // the waiter may be reused as soon as it is woken
+    parked = (uintptr_t)waiter->next;
+    waiter->wake(waiter);
+  }
+  if (queue != NULL) {
+    // bound completions never outnumber the slots, the push finds room
+    mpmc_ring_try_push(&queue->ring, &tag);
+    fsem_post(&queue->ready);
+  }
+}
+
+void completion_signal(TaskCompletion *completion) {
+  signal_state(completion, COMPLETION_DONE);
+}
+
+void completion_cancel(TaskCompletion *completion) {
+  signal_state(completion, COMPLETION_CANCELLED);
+}
+
+int completion_park(TaskCompletion *completion, CompletionWaiter *waiter) {
+  uintptr_t head = atomic_load(&completion->parked);
+  do {
+    if (head == PARKED_CLOSED) {
+      return 0;
+    }
+    waiter->next = (CompletionWaiter *)head;
+  } while (!atomic_compare_exchange_weak(&completion->parked, &head,
+                                         (uintptr_t)waiter));
+  return 1;
+}
+
+void completion_wait(TaskCompletion *completion) {
+  if (atomic_load(&completion->state) != COMPLETION_PENDING) {
+    return;
+  }
+  if (fiber_current() != NULL) {
+    fiber_await(completion);
+    return;
+  }
+  while (atomic_load(&completion->state) == COMPLETION_PENDING) {
+    atomic_fetch_add(&completion->waiters, 1);
+    futex_wait(&completion->state, COMPLETION_PENDING, NULL);
+    atomic_fetch_sub(&completion->waiters, 1);
+  }
+}
+
+int completion_wait_until(TaskCompletion *completion,
+                          const struct timespec *deadline) {
+  if (deadline == NULL) {
+    completion_wait(completion);
+    return 0;
+  }
+  while (atomic_load(&completion->state) == COMPLETION_PENDING) {
+    atomic_fetch_add(&completion->waiters, 1);
+    int err = futex_wait(&completion->state, COMPLETION_PENDING, deadline);
+    atomic_fetch_sub(&completion->waiters, 1);
+    if (err == ETIMEDOUT) {
+      return atomic_load(&completion->state) == COMPLETION_PENDING ? ETIMEDOUT
+                                                                   : 0;
+    }
+  }
+  return 0;
+}
+
+int completion_queue_init(CompletionQueue *queue, size_t capacity) {
+  if (capacity == 0 || capacity > UINT_MAX) {
+    return -1;
+  }
+  if (mpmc_ring_init(&queue->ring, capacity, sizeof(uint64_t)) != 0) {
+    return -1;
+  }
+  fsem_init(&queue->ready, 0);
+  atomic_init(&queue->bound, 0);
+  queue->capacity = capacity;
+  return 0;
+}
+
+void completion_queue_destroy(CompletionQueue *queue) {
+  mpmc_ring_destroy(&queue->ring);
+}
+
+int completion_queue_bind(CompletionQueue *queue, TaskCompletion *completion,
+                          uint64_t tag) {
+  size_t bound = atomic_load(&queue->bound);
+  do {
+    if (bound == queue->capacity) {
+      return -1;
+    }
+  } while (!atomic_compare_exchange_weak(&queue->bound, &bound, bound + 1));
+  completion->tag = tag;
+  completion->queue = queue;
+  return 0;
+}
+
+// Pops the n tags whose tokens were taken. A token is posted after its push
+// is complete, but pushes claim positions in the ring before completing, so
+// the oldest position may still be mid push by a signaller that has not
+// posted yet. It is done within a few instructions, spin until it is
+static size_t harvest(CompletionQueue *queue, uint64_t *tags, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    while (!mpmc_ring_try_pop(&queue->ring, &tags[i])) {
+      CPU_RELAX();
+    }
+  }
+  atomic_fetch_sub(&queue->bound, n);
+  return n;
+}
+
+size_t completion_queue_wait(CompletionQueue *queue, uint64_t *tags,
+                             size_t max, const struct timespec *deadline) {
+  unsigned int want = max > UINT_MAX ? UINT_MAX : (unsigned int)max;
+  return harvest(queue, tags, fsem_wait_upto(&queue->ready, want, deadline));
+}
+
+size_t completion_queue_try_drain(CompletionQueue *queue, uint64_t *tags,
+                                  size_t max) {
+  unsigned int want = max > UINT_MAX ? UINT_MAX : (unsigned int)max;
+  return harvest(queue, tags, fsem_try_wait_upto(&queue->ready, want));
+}
@@ -0,0 +1,121 @@
+#ifndef COMPLETION
+#define COMPLETION
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "atomics.h"
+#include "fsem.h"
+#include "mpmc_ring.h"
+
+#define COMPLETION_PENDING 0
+#define COMPLETION_DONE 1
+#define COMPLETION_CANCELLED 2 // done, but the task never ran
+
+/*
+ * Something parked on a completion without a thread sleeping on it, a fiber
+ * waiting for a task. wake is called once, on the signalling thread, after
+ * the completion is done.
+ */
+typedef struct __completion_waiter {
+  struct __completion_waiter *next;
+  void (*wake)(struct __completion_waiter *waiter);
+} CompletionWaiter;
+
+struct __completion_queue;
+
+/*
+ * Completion slot an awaitable task signals when it finishes.
+ * Slots come from a process wide slab and go back to it on destroy_task, so
+ * creating a task never touches malloc or sem_init. Waiting is a futex on
+ * state, signalling is one store plus a wake only if somebody is asleep.
+ */
+typedef struct __task_completion {
+  // one slot per cache line, neighbouring tasks finish on different workers.
+  // COMPLETION_PENDING, COMPLETION_DONE or COMPLETION_CANCELLED, this is
+  // the futex word
+  TP_ALIGNAS(CACHE_LINE_SIZE) atomic_uint state;
+  atomic_uint waiters;
+  atomic_uint next_free; // free list link, slot index + 1, 0 ends the list
+  uint32_t index;
+  // CompletionWaiter list, closed once the completion is signalled
+  atomic_uintptr_t parked;
+  // where tag goes once signalled, NULL unless bound with
+  // completion_queue_bind
+  struct __completion_queue *queue;
+  uint64_t tag;
+} TaskCompletion;
+
+/*
+ * Collects the tags of bound completions in the order they are signalled,
+ * so a caller with many tasks in flight handles each as it finishes instead
+ * of awaiting them one by one. Signalling pushes the tag into a lock free
+ * ring and posts one token, a caller takes as many tokens as it wants tags
+ * in one go and sleeps only when there are none.
+ * At most capacity completions are bound and not yet harvested at any time,
+ * so a signaller always finds room and never waits. A queue must outlive
+ * the completions bound to it.
+ */
+typedef struct __completion_queue {
+  MpmcRing ring; // tags of signalled completions
+  FutexSem ready; // one token per tag in the ring
+  atomic_size_t bound; // bound and not harvested yet
+  size_t capacity;
+} CompletionQueue;
+
+// take a pending slot from the slab, growing it if it is empty.
+// Returns NULL only if the slab could not grow
+TaskCompletion *completion_acquire();
+
+// give a slot back to the slab
+void completion_release(TaskCompletion *completion);
+
+// make sure at least n slots exist so the next n acquires do not allocate
+void completion_reserve(size_t n);
+
+void completion_signal(TaskCompletion *completion);
+
+// signal that the task was skipped or dropped without running
+void completion_cancel(TaskCompletion *completion);
+
+// blocks until the completion is signalled. Called on a fiber it parks the
+// fiber instead and lets its thread run something else meanwhile
+void completion_wait(TaskCompletion *completion);
+
+// Blocks until the completion is signalled or the absolute CLOCK_MONOTONIC
+// deadline passes, returns 0 or ETIMEDOUT. A NULL deadline is
+// completion_wait. Blocks the thread even on a fiber
+int completion_wait_until(TaskCompletion *completion,
+                          const struct timespec *deadline);
+
+// registers waiter to be woken once the completion is signalled. Returns 0,
+// without registering, if that already happened
+int completion_park(TaskCompletion *completion, CompletionWaiter *waiter);
+
+// returns 0 on success, -1 if the ring could not be allocated
+int completion_queue_init(CompletionQueue *queue, size_t capacity);
+
+void completion_queue_destroy(CompletionQueue *queue);
+
+// Pushes tag to queue once the pending completion is signalled, cancelled
+// or not. Returns 0, or -1 if capacity completions are bound already
+int completion_queue_bind(CompletionQueue *queue, TaskCompletion *completion,
+                          uint64_t tag);
+
+// Takes between 1 and max tags, oldest first, sleeping while there are none
+// until the absolute CLOCK_MONOTONIC deadline, NULL waits forever. Returns
+// how many were taken, 0 only if the deadline passed
+size_t completion_queue_wait(CompletionQueue *queue, uint64_t *tags,
+                             size_t max, const struct timespec *deadline);
+
+// takes up to max tags without waiting, returns how many
+size_t completion_queue_try_drain(CompletionQueue *queue, uint64_t *tags,
+                                  size_t max);
+
+static inline int completion_is_done(TaskCompletion *completion) {
+  return atomic_load_explicit(&completion->state, memory_order_acquire) !=
+         COMPLETION_PENDING;
+}
+
+#endif
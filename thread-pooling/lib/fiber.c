@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+#include "fiber.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// set while a fiber runs on this thread. A fiber that parked may resume on
+// another thread, so nothing running on one may hold on to the address of a
+// thread local across a wait, which is what plain accesses compile to in a
+// static library
+static __thread Fiber *current_fiber = NULL;
+
+Fiber *fiber_current() { return current_fiber; }
+
+// Bottom frame of every fiber. makecontext only passes int arguments, so the
+// fiber is found through current_fiber, which is set before switching to it.
+// A finished fiber switches out and starts over from here with its next
+// entry, the context is only ever made once
+static void fiber_main() {
+  Fiber *self = fiber_current();
+  while (1) {
+    self->entry(self);
+    self->state = FIBER_FINISHED;
+    swapcontext(&self->context, self->caller);
+  }
+}
+
+static void fiber_woken(CompletionWaiter *waiter) {
+  Fiber *fiber = (Fiber *)((char *)waiter - offsetof(Fiber, waiter));
+  fiber->on_wake(fiber);
+}
+
+int fiber_init(Fiber *fiber, size_t stack_size) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  stack_size = (stack_size + page - 1) / page * page;
+
+  // one extra page at the bottom, stacks grow down into it and fault
+  fiber->stack_size = stack_size + page;
+  fiber->stack = mmap(NULL, fiber->stack_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (fiber->stack == MAP_FAILED) {
+    return -1;
+  }
+  if (mprotect(fiber->stack, page, PROT_NONE) != 0 ||
+      getcontext(&fiber->context) != 0) {
+    munmap(fiber->stack, fiber->stack_size);
+    return -1;
+  }
+  fiber->context.uc_stack.ss_sp = (char *)fiber->stack + page;
+  fiber->context.uc_stack.ss_size = stack_size;
+  fiber->context.uc_link = NULL;
+  makecontext(&fiber->context, &fiber_main, 0);
+
+  fiber->caller = NULL;
+  fiber->entry = NULL;
+  fiber->state = FIBER_FINISHED;
+  fiber->parked_on = NULL;
+  fiber->waiter.next = NULL;
+  fiber->waiter.wake = &fiber_woken;
+  fiber->on_wake = NULL;
+  fiber->data = NULL;
+  fiber->next = NULL;
+  return 0;
+}
+
+void fiber_destroy(Fiber *fiber) { munmap(fiber->stack, fiber->stack_size); }
+
+void fiber_start(Fiber *fiber, FiberFunc entry) {
+  fiber->entry = entry;
+  fiber->state = FIBER_RUNNING;
+}
+
+/*
+ * A fiber that waits only marks itself and switches back here, it is only
+ * parked on the completion once we are off its stack. Parking it while still
+ * on it would let the signaller resume it on another thread while this one
+ * is still saving its registers.
+ */
+FiberState fiber_switch_to(Fiber *fiber) {
+  Fiber *outer = current_fiber;
+  ucontext_t here;
+  FiberState state;
+
+  fiber->caller = &here;
+  fiber->state = FIBER_RUNNING;
+  current_fiber = fiber;
+  while (1) {
+    swapcontext(&here, &fiber->context);
+    state = fiber->state;
+    if (state != FIBER_PARKED ||
+        completion_park(fiber->parked_on, &fiber->waiter)) {
+      break;
+    }
+    // signalled while it was switching out, carry on with it right away.
+    // The signaller closes the list just before it publishes state
+    while (atomic_load(&fiber->parked_on->state) == COMPLETION_PENDING) {
+      CPU_RELAX();
+    }
+    fiber->state = FIBER_RUNNING;
+  }
+  current_fiber = outer;
+  return state;
+}
+
+void fiber_await(TaskCompletion *completion) {
+  Fiber *self = current_fiber;
+  // resumed by whoever took the fiber after the wake, maybe another thread.
+  // Only state says the completion is done, park again on anything else
+  while (atomic_load(&completion->state) == COMPLETION_PENDING) {
+    self->parked_on = completion;
+    self->state = FIBER_PARKED;
+    swapcontext(&self->context, self->caller);
+  }
+}
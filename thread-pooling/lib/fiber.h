@@ -0,0 +1,65 @@
+#ifndef FIBER
+#define FIBER
+
+#include <stddef.h>
+#include <ucontext.h>
+
+#include "completion.h"
+
+typedef enum {
+  FIBER_RUNNING = 0,
+  FIBER_PARKED = 1,   // waiting for a completion, its wake resumes it
+  FIBER_FINISHED = 2, // its entry returned, the fiber can be started again
+} FiberState;
+
+struct __fiber;
+
+typedef void (*FiberFunc)(struct __fiber *fiber);
+
+/*
+ * Stackful coroutine on its own mmap'ed stack with a guard page below it.
+ * A fiber runs until its entry returns or it waits for a completion, then
+ * control goes back to whoever switched to it. A parked fiber is handed to
+ * its on_wake once the completion is signalled, and whoever resumes it next
+ * may be on another thread.
+ * A finished fiber keeps its stack and context and can be started again
+ * with a new entry, so stacks are paid for once and pooled by the owner.
+ */
+typedef struct __fiber {
+  ucontext_t context;
+  ucontext_t *caller; // context that switched to the fiber last
+  void *stack;        // mapping, guard page included
+  size_t stack_size;
+  FiberFunc entry;
+  FiberState state;
+  TaskCompletion *parked_on; // set while switching out to park
+  CompletionWaiter waiter;
+  // called on the signalling thread when a parked fiber may run again,
+  // must arrange for fiber_switch_to to be called on it
+  void (*on_wake)(struct __fiber *fiber);
+  void *data; // owner's
+  struct __fiber *next; // owner's, e.g. free and ready lists
+} Fiber;
+
+// maps a stack of at least stack_size bytes, returns 0 on success
+int fiber_init(Fiber *fiber, size_t stack_size);
+
+void fiber_destroy(Fiber *fiber);
+
+// entry runs on the fiber the next time it is switched to. Only for fresh or
+// finished fibers
+void fiber_start(Fiber *fiber, FiberFunc entry);
+
+// Runs the fiber on the calling thread until it finishes or parks, returns
+// FIBER_FINISHED or FIBER_PARKED. Once parked the fiber belongs to its
+// on_wake and must not be touched by the caller anymore
+FiberState fiber_switch_to(Fiber *fiber);
+
+// the fiber running on the calling thread, NULL outside of fibers
+Fiber *fiber_current();
+
+// Called on a fiber, parks it until completion is signalled and lets the
+// thread that switched to it carry on
+void fiber_await(TaskCompletion *completion);
+
+#endif
@@ -0,0 +1,97 @@
+#include "fsem.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+
+#include "futex.h"
+
+void fsem_init(FutexSem *sem, unsigned int value) {
+  atomic_init(&sem->value, value);
+  atomic_init(&sem->sleepers, 0);
+  sem->shared = 0;
+}
+
+void fsem_init_shared(FutexSem *sem, unsigned int value) {
+  fsem_init(sem, value);
+  sem->shared = 1;
+}
+
+// private futexes are cheaper, the kernel keys them by address alone
+static int sleep_on(FutexSem *sem, const struct timespec *deadline) {
+  return sem->shared ? futex_wait_shared(&sem->value, 0, deadline)
+                     : futex_wait(&sem->value, 0, deadline);
+}
+
+/*
+ * Tokens are published before sleepers is read, and a sleeper registers
+ * itself before the kernel re-checks value, both seq_cst. So either the
+ * poster sees the sleeper and wakes it, or the sleeper's futex_wait sees the
+ * new tokens and does not go to sleep.
+ */
+void fsem_post_n(FutexSem *sem, unsigned int n) {
+  if (n == 0) {
+    return;
+  }
+  atomic_fetch_add(&sem->value, n);
+  unsigned int sleepers = atomic_load(&sem->sleepers);
+  if (sleepers > 0) {
+    int count = (int)(n < sleepers ? n : sleepers);
+    if (sem->shared) {
+      futex_wake_shared(&sem->value, count);
+    } else {
+      futex_wake(&sem->value, count);
+    }
+  }
+}
+
+int fsem_try_wait_n(FutexSem *sem, unsigned int n) {
+  unsigned int value = atomic_load_explicit(&sem->value, memory_order_relaxed);
+  while (value >= n) {
+    if (atomic_compare_exchange_weak_explicit(&sem->value, &value, value - n,
+                                              memory_order_acquire,
+                                              memory_order_relaxed)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+unsigned int fsem_try_wait_upto(FutexSem *sem, unsigned int n) {
+  unsigned int value = atomic_load_explicit(&sem->value, memory_order_relaxed);
+  while (value > 0) {
+    unsigned int take = value < n ? value : n;
+    if (atomic_compare_exchange_weak_explicit(&sem->value, &value,
+                                              value - take,
+                                              memory_order_acquire,
+                                              memory_order_relaxed)) {
+      return take;
+    }
+  }
+  return 0;
+}
+
+unsigned int fsem_wait_upto(FutexSem *sem, unsigned int n,
+                            const struct timespec *deadline) {
+  unsigned int value = atomic_load_explicit(&sem->value, memory_order_relaxed);
+  while (1) {
+    if (value > 0) {
+      unsigned int take = value < n ? value : n;
+      if (atomic_compare_exchange_weak_explicit(&sem->value, &value,
+                                                value - take,
+                                                memory_order_acquire,
+                                                memory_order_relaxed)) {
+        return take;
+      }
+      continue;
+    }
+
+    atomic_fetch_add(&sem->sleepers, 1);
+    int res = sleep_on(sem, deadline);
+    atomic_fetch_sub(&sem->sleepers, 1);
+    if (res == ETIMEDOUT) {
+      // one last look, a post may have raced the timeout
+      return fsem_try_wait_n(sem, 1);
+    }
+    value = atomic_load_explicit(&sem->value, memory_order_relaxed);
+  }
+}
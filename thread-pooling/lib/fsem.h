@@ -0,0 +1,53 @@
+#ifndef FSEM
+#define FSEM
+
+#include <stddef.h>
+#include <time.h>
+
+#include "atomics.h"
+#include "mpmc_ring.h"
+
+/*
+ * Futex based counting semaphore that can move many tokens in one atomic
+ * operation. A poster adding n tokens wakes at most min(n, sleepers) threads,
+ * and a taker can grab up to n tokens at once, which is what lets batches go
+ * through the pool with a single synchronization round.
+ * The uncontended paths are a single atomic op, the kernel is only entered to
+ * sleep when there are no tokens or to wake a thread that is really asleep.
+ */
+typedef struct {
+  TP_ALIGNAS(CACHE_LINE_SIZE) atomic_uint value; // tokens, also the futex word
+  atomic_uint sleepers;
+  int shared; // lives in memory shared between processes
+} FutexSem;
+
+void fsem_init(FutexSem *sem, unsigned int value);
+
+// for a semaphore in memory shared with other processes, which then post
+// and wait on it like threads would
+void fsem_init_shared(FutexSem *sem, unsigned int value);
+
+// add n tokens
+void fsem_post_n(FutexSem *sem, unsigned int n);
+
+static inline void fsem_post(FutexSem *sem) { fsem_post_n(sem, 1); }
+
+// take exactly n tokens if they are all there, returns 1 on success, 0 if not
+int fsem_try_wait_n(FutexSem *sem, unsigned int n);
+
+// take between 0 and n tokens without waiting, returns how many were taken
+unsigned int fsem_try_wait_upto(FutexSem *sem, unsigned int n);
+
+// take between 1 and n tokens, sleeping while there are none.
+// deadline is an absolute CLOCK_MONOTONIC time, NULL waits forever.
+// Returns the number of tokens taken, or 0 if the deadline passed
+unsigned int fsem_wait_upto(FutexSem *sem, unsigned int n,
+                            const struct timespec *deadline);
+
+static inline void fsem_wait(FutexSem *sem) { fsem_wait_upto(sem, 1, NULL); }
+
+static inline int fsem_try_wait(FutexSem *sem) {
+  return fsem_try_wait_n(sem, 1);
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef FUTEX_UTIL
+#define FUTEX_UTIL
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Thin wrappers over the futex syscall, glibc does not export one.
+// Waits only sleep while *addr still holds expected, so a wake that lands
+// between checking a condition and going to sleep is never lost.
+
+// deadline is an absolute CLOCK_MONOTONIC time, NULL waits forever.
+// Returns 0 when woken (possibly spuriously), ETIMEDOUT, EAGAIN if *addr
+// did not hold expected or EINTR
+static inline int futex_wait(atomic_uint *addr, uint32_t expected,
+                             const struct timespec *deadline) {
+  long res = syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_BITSET_PRIVATE,
+                     expected, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+  return res == 0 ? 0 : errno;
+}
+
+// wakes at most count threads sleeping on addr
+static inline void futex_wake(atomic_uint *addr, int count) {
+  syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL,
+          0);
+}
+
+static inline void futex_wake_all(atomic_uint *addr) {
+  futex_wake(addr, INT_MAX);
+}
+
+// The same for a word in memory shared between processes, which the private
+// variants cannot see across address spaces
+static inline int futex_wait_shared(atomic_uint *addr, uint32_t expected,
+                                    const struct timespec *deadline) {
+  long res = syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_BITSET, expected,
+                     deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+  return res == 0 ? 0 : errno;
+}
+
+static inline void futex_wake_shared(atomic_uint *addr, int count) {
+  syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+#endif
@@ -0,0 +1,79 @@
+#include "histogram.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// lowest value that falls into a bucket
+static uint64_t bucket_floor(int bucket) {
+  if (bucket < HISTOGRAM_SUB_BUCKETS) {
+    return (uint64_t)bucket;
+  }
+  int exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+  uint64_t sub = (uint64_t)(bucket % HISTOGRAM_SUB_BUCKETS);
+  return (HISTOGRAM_SUB_BUCKETS + sub) << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+// highest value that falls into a bucket
+static uint64_t bucket_ceiling(int bucket) {
+  if (bucket == HISTOGRAM_BUCKETS - 1) {
+    return UINT64_MAX;
+  }
+  return bucket_floor(bucket + 1) - 1;
+}
+
+void histogram_init(Histogram *histogram) {
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    atomic_init(&histogram->counts[i], 0);
+  }
+}
+
+void histogram_snapshot_init(HistogramSnapshot *snapshot, double unit_ns) {
+  memset(snapshot->counts, 0, sizeof(snapshot->counts));
+  snapshot->total = 0;
+  snapshot->unit_ns = unit_ns;
+}
+
+void histogram_add_to(Histogram *histogram, HistogramSnapshot *snapshot) {
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    uint64_t count =
+        atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+    snapshot->counts[i] += count;
+    snapshot->total += count;
+  }
+}
+
+uint64_t histogram_percentile(const HistogramSnapshot *snapshot, double q) {
+  if (snapshot->total == 0) {
+    return 0;
+  }
+  // rank of the value we are after, 1 based
+  uint64_t rank = (uint64_t)(q * (double)snapshot->total + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += snapshot->counts[i];
+    if (seen >= rank) {
+      return (uint64_t)((double)bucket_ceiling(i) * snapshot->unit_ns);
+    }
+  }
+  return (uint64_t)((double)UINT64_MAX * snapshot->unit_ns);
+}
+
+double histogram_mean(const HistogramSnapshot *snapshot) {
+  if (snapshot->total == 0) {
+    return 0;
+  }
+  double sum = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    if (snapshot->counts[i] != 0) {
+      double middle =
+          ((double)bucket_floor(i) + (double)bucket_ceiling(i)) / 2;
+      sum += middle * (double)snapshot->counts[i];
+    }
+  }
+  return sum / (double)snapshot->total * snapshot->unit_ns;
+}
@@ -0,0 +1,66 @@
+#ifndef HISTOGRAM
+#define HISTOGRAM
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "atomics.h"
+
+// every power of two range is split into 2^HISTOGRAM_SUB_BITS buckets, which
+// keeps the relative error of a recorded value under 1 / 16
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS                                                      \
+  ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/*
+ * HDR style log linear histogram over the full uint64_t range.
+ * Meant to have a single writer, recording is a relaxed load and store of
+ * one counter, no read modify write, while any thread may read it at the
+ * same time for a snapshot.
+ */
+typedef struct {
+  atomic_uint_least64_t counts[HISTOGRAM_BUCKETS];
+} Histogram;
+
+// plain copy of one or more histograms. Values were recorded in some unit,
+// unit_ns converts them to nanoseconds
+typedef struct {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total;
+  double unit_ns;
+} HistogramSnapshot;
+
+static inline int histogram_bucket(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS) {
+    return (int)value;
+  }
+  int exponent = 63 - __builtin_clzll(value);
+  int sub = (int)(value >> (exponent - HISTOGRAM_SUB_BITS)) &
+            (HISTOGRAM_SUB_BUCKETS - 1);
+  return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// single writer only
+static inline void histogram_record(Histogram *histogram, uint64_t value) {
+  atomic_uint_least64_t *count = &histogram->counts[histogram_bucket(value)];
+  atomic_store_explicit(
+      count, atomic_load_explicit(count, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+}
+
+void histogram_init(Histogram *histogram);
+
+void histogram_snapshot_init(HistogramSnapshot *snapshot, double unit_ns);
+
+// adds the current counts of histogram to snapshot
+void histogram_add_to(Histogram *histogram, HistogramSnapshot *snapshot);
+
+// smallest value, in ns, that at least fraction q of the recorded values do
+// not exceed, to within a bucket. 0 if nothing was recorded
+uint64_t histogram_percentile(const HistogramSnapshot *snapshot, double q);
+
+// mean of the recorded values in ns, taking every value as its bucket's middle
+double histogram_mean(const HistogramSnapshot *snapshot);
+
+#endif
@@ -0,0 +1,657 @@
+#define _GNU_SOURCE
+#include "io_reactor.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// submission queue size, the completion queue is twice that
+#define URING_ENTRIES 256
+// events taken per epoll_wait
+#define EPOLL_BATCH 64
+// initial size of the epoll fd table, it doubles past the highest fd seen
+#define FD_TABLE_SIZE 64
+
+// user_data of ring entries that are not requests
+#define WAKE_TAG 0
+#define CANCEL_TAG 1
+
+// kernel features the ring relies on: both rings in one mapping, no dropped
+// completions, and reads, writes and accepts on sockets and pipes that poll
+// inside the kernel instead of taking one of its worker threads
+#define URING_FEATURES                                                         \
+  (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL)
+
+void io_request_read(IoRequest *req, int fd, void *buf, size_t len,
+                     uint64_t offset, Task then) {
+  req->op = IO_OP_READ;
+  req->fd = fd;
+  req->buf = buf;
+  req->len = len;
+  req->offset = offset;
+  req->result = 0;
+  req->then = then;
+}
+
+void io_request_write(IoRequest *req, int fd, const void *buf, size_t len,
+                      uint64_t offset, Task then) {
+  io_request_read(req, fd, (void *)buf, len, offset, then);
+  req->op = IO_OP_WRITE;
+}
+
+void io_request_fsync(IoRequest *req, int fd, Task then) {
+  io_request_read(req, fd, NULL, 0, 0, then);
+  req->op = IO_OP_FSYNC;
+}
+
+void io_request_accept(IoRequest *req, int fd, Task then) {
+  io_request_read(req, fd, NULL, 0, 0, then);
+  req->op = IO_OP_ACCEPT;
+}
+
+static void list_push(IoRequest **head, IoRequest *req) {
+  req->prev = NULL;
+  req->next = *head;
+  if (*head != NULL) {
+    (*head)->prev = req;
+  }
+  *head = req;
+}
+
+static void list_remove(IoRequest **head, IoRequest *req) {
+  if (req->prev != NULL) {
+    req->prev->next = req->next;
+  } else {
+    *head = req->next;
+  }
+  if (req->next != NULL) {
+    req->next->prev = req->prev;
+  }
+}
+
+// Sets the result and hands the continuation to the pool. Blocking on a
+// full channel whatever the pool's overflow policy, like timers, so a
+// completion is never lost nor run on the reactor. The request belongs to
+// the caller again as soon as it is enqueued
+static void deliver(IoReactor *reactor, IoRequest *req, long result) {
+  req->result = result;
+  Task then = req->then;
+  EnqueueTaskResponse resp = enqueue_task_timed(reactor->pool, then, NULL);
+  if (resp.resp_code != ENQUEUE_TASK_SUCCESS) {
+    // the pool is shutting down, the continuation never runs
+    if (then.on_drop != NULL) {
+      then.on_drop(then.args);
+    }
+    if (then.task_awaiter != NULL) {
+      completion_cancel(then.task_awaiter);
+    }
+  }
+}
+
+// Takes what io_submit handed over, in submission order, and returns TRUE
+// once the reactor is stopping. The wake fd must be drained before, so a
+// submission after the take always wakes the reactor again
+static bool_t take_incoming(IoReactor *reactor, IoRequest **head) {
+  pthread_mutex_lock(&reactor->lock);
+  *head = reactor->incoming_head;
+  reactor->incoming_head = NULL;
+  reactor->incoming_tail = NULL;
+  bool_t stopping = reactor->stopping;
+  pthread_mutex_unlock(&reactor->lock);
+  return stopping;
+}
+
+static void drain_wake_fd(IoReactor *reactor) {
+  uint64_t count;
+  while (read(reactor->wake_fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+  }
+}
+
+// the system call of a request, on the calling thread. Returns what it
+// returned or -errno
+static long perform(IoRequest *req) {
+  ssize_t res = -1;
+  switch (req->op) {
+  case IO_OP_READ:
+    res = req->offset == IO_OFFSET_CURRENT
+              ? read(req->fd, req->buf, req->len)
+              : pread(req->fd, req->buf, req->len, (off_t)req->offset);
+    break;
+  case IO_OP_WRITE:
+    res = req->offset == IO_OFFSET_CURRENT
+              ? write(req->fd, req->buf, req->len)
+              : pwrite(req->fd, req->buf, req->len, (off_t)req->offset);
+    break;
+  case IO_OP_FSYNC:
+    res = fsync(req->fd);
+    break;
+  case IO_OP_ACCEPT:
+    res = accept4(req->fd, NULL, NULL, SOCK_CLOEXEC);
+    break;
+  }
+  return res < 0 ? -(long)errno : (long)res;
+}
+
+/*
+ * io_uring backend. Requests become ring entries whose user_data is the
+ * request itself, the kernel does the I/O and the reactor only moves
+ * completions to the pool. The reactor sleeps in io_uring_enter, a poll on
+ * the wake fd sitting in the ring brings it back for new submissions.
+ */
+
+static int uring_setup(IoReactor *reactor) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = (int)syscall(SYS_io_uring_setup, URING_ENTRIES, &params);
+  if (fd < 0) {
+    return -1;
+  }
+  if ((params.features & URING_FEATURES) != URING_FEATURES) {
+    close(fd);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  reactor->rings_size = sq_size > cq_size ? sq_size : cq_size;
+  reactor->rings = mmap(NULL, reactor->rings_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (reactor->rings == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  reactor->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  reactor->sqes = mmap(NULL, reactor->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (reactor->sqes == MAP_FAILED) {
+    munmap(reactor->rings, reactor->rings_size);
+    close(fd);
+    return -1;
+  }
+
+  char *rings = (char *)reactor->rings;
+  reactor->ring_fd = fd;
+  reactor->sq_head = (unsigned int *)(rings + params.sq_off.head);
+  reactor->sq_tail = (unsigned int *)(rings + params.sq_off.tail);
+  reactor->sq_array = (unsigned int *)(rings + params.sq_off.array);
+  reactor->sq_mask = *(unsigned int *)(rings + params.sq_off.ring_mask);
+  reactor->sq_entries = params.sq_entries;
+  reactor->sq_pending = 0;
+  reactor->cq_head = (unsigned int *)(rings + params.cq_off.head);
+  reactor->cq_tail = (unsigned int *)(rings + params.cq_off.tail);
+  reactor->cq_mask = *(unsigned int *)(rings + params.cq_off.ring_mask);
+  reactor->cqes = rings + params.cq_off.cqes;
+  return 0;
+}
+
+static void uring_teardown(IoReactor *reactor) {
+  munmap(reactor->sqes, reactor->sqes_size);
+  munmap(reactor->rings, reactor->rings_size);
+  close(reactor->ring_fd);
+}
+
+// Publishes the filled entries and, with wait, sleeps until at least one
+// completion is there. Without SQPOLL the kernel consumes every published
+// entry before it returns
+static void uring_enter(IoReactor *reactor, bool_t wait) {
+  unsigned int to_submit = reactor->sq_pending;
+  __atomic_store_n(reactor->sq_tail, *reactor->sq_tail + to_submit,
+                   __ATOMIC_RELEASE);
+  reactor->sq_pending = 0;
+  unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+  while (syscall(SYS_io_uring_enter, reactor->ring_fd, to_submit,
+                 wait ? 1 : 0, flags, NULL, 0) < 0 &&
+         errno == EINTR) {
+    // the entries were taken before the signal, only wait again
+    to_submit = 0;
+  }
+}
+
+// next free submission entry, zeroed. Flushes the queue if it is full
+static struct io_uring_sqe *uring_sqe(IoReactor *reactor) {
+  unsigned int head = __atomic_load_n(reactor->sq_head, __ATOMIC_ACQUIRE);
+  unsigned int tail = *reactor->sq_tail + reactor->sq_pending;
+  if (tail - head == reactor->sq_entries) {
+    uring_enter(reactor, FALSE);
+    tail = *reactor->sq_tail;
+  }
+  unsigned int index = tail & reactor->sq_mask;
+  struct io_uring_sqe *sqe = (struct io_uring_sqe *)reactor->sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  reactor->sq_array[index] = index;
+  reactor->sq_pending++;
+  return sqe;
+}
+
+static void uring_start(IoReactor *reactor, IoRequest *req) {
+  struct io_uring_sqe *sqe = uring_sqe(reactor);
+  sqe->fd = req->fd;
+  sqe->user_data = (uint64_t)(uintptr_t)req;
+  switch (req->op) {
+  case IO_OP_READ:
+  case IO_OP_WRITE:
+    sqe->opcode = req->op == IO_OP_READ ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->addr = (uint64_t)(uintptr_t)req->buf;
+    // a longer request comes back short, like a plain read would
+    sqe->len = req->len > UINT32_MAX ? UINT32_MAX : (uint32_t)req->len;
+    // -1 is the file position
+    sqe->off = req->offset;
+    break;
+  case IO_OP_FSYNC:
+    sqe->opcode = IORING_OP_FSYNC;
+    break;
+  case IO_OP_ACCEPT:
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    break;
+  }
+  list_push(&reactor->inflight, req);
+  reactor->num_inflight++;
+}
+
+static void uring_arm_wake(IoReactor *reactor) {
+  struct io_uring_sqe *sqe = uring_sqe(reactor);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = reactor->wake_fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = WAKE_TAG;
+}
+
+// moves every completion there is to the pool, returns FALSE if the wake
+// poll fired and has to be armed again
+static bool_t uring_reap(IoReactor *reactor) {
+  bool_t wake_armed = TRUE;
+  unsigned int head = *reactor->cq_head;
+  unsigned int tail = __atomic_load_n(reactor->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe *cqe =
+        (struct io_uring_cqe *)reactor->cqes + (head & reactor->cq_mask);
+    uint64_t tag = cqe->user_data;
+    long res = cqe->res;
+    // the slot is free again before delivering, which may block
+    head++;
+    __atomic_store_n(reactor->cq_head, head, __ATOMIC_RELEASE);
+
+    if (tag == WAKE_TAG) {
+      drain_wake_fd(reactor);
+      wake_armed = FALSE;
+    } else if (tag != CANCEL_TAG) {
+      IoRequest *req = (IoRequest *)(uintptr_t)tag;
+      list_remove(&reactor->inflight, req);
+      reactor->num_inflight--;
+      deliver(reactor, req, res);
+    }
+    if (head == tail) {
+      tail = __atomic_load_n(reactor->cq_tail, __ATOMIC_ACQUIRE);
+    }
+  }
+  return wake_armed;
+}
+
+static void uring_run(IoReactor *reactor) {
+  // requests that did not fit in flight yet, so the completion queue, twice
+  // the submission queue, always has room for every request and its cancel
+  IoRequest *backlog = NULL;
+  IoRequest *backlog_tail = NULL;
+  bool_t wake_armed = FALSE;
+  bool_t cancelled = FALSE;
+
+  while (1) {
+    if (!wake_armed) {
+      uring_arm_wake(reactor);
+      wake_armed = TRUE;
+    }
+
+    IoRequest *incoming;
+    bool_t stopping = take_incoming(reactor, &incoming);
+    if (incoming != NULL) {
+      if (backlog_tail == NULL) {
+        backlog = incoming;
+      } else {
+        backlog_tail->next = incoming;
+      }
+      for (backlog_tail = incoming; backlog_tail->next != NULL;
+           backlog_tail = backlog_tail->next) {
+      }
+    }
+
+    if (stopping) {
+      while (backlog != NULL) {
+        IoRequest *req = backlog;
+        backlog = req->next;
+        deliver(reactor, req, -ECANCELED);
+      }
+      backlog_tail = NULL;
+      if (!cancelled) {
+        // ones that cannot be cancelled, file reads and writes, complete
+        for (IoRequest *req = reactor->inflight; req != NULL; req = req->next) {
+          struct io_uring_sqe *sqe = uring_sqe(reactor);
+          sqe->opcode = IORING_OP_ASYNC_CANCEL;
+          sqe->addr = (uint64_t)(uintptr_t)req;
+          sqe->user_data = CANCEL_TAG;
+        }
+        cancelled = TRUE;
+      }
+      if (reactor->num_inflight == 0) {
+        break;
+      }
+    }
+
+    while (backlog != NULL && reactor->num_inflight < reactor->sq_entries - 1) {
+      IoRequest *req = backlog;
+      backlog = req->next;
+      if (backlog == NULL) {
+        backlog_tail = NULL;
+      }
+      uring_start(reactor, req);
+    }
+
+    uring_enter(reactor, TRUE);
+    wake_armed = uring_reap(reactor);
+  }
+}
+
+/*
+ * epoll backend. Every fd with waiting requests is registered for what the
+ * first of them needs, readable or writable, and once it is the reactor
+ * does the call itself. Files epoll cannot watch, regular files, and fsync
+ * are done right away on the reactor thread, which keeps them off the
+ * workers but serializes them.
+ */
+
+static int epoll_setup(IoReactor *reactor) {
+  reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (reactor->epoll_fd < 0) {
+    return -1;
+  }
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = reactor->wake_fd;
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &event) !=
+      0) {
+    close(reactor->epoll_fd);
+    return -1;
+  }
+  return 0;
+}
+
+// the waiters of fd, growing the table if needed. NULL if out of memory
+static IoFdWaiters *fd_waiters(IoReactor *reactor, int fd) {
+  if ((size_t)fd >= reactor->num_fds) {
+    size_t num_fds = reactor->num_fds == 0 ? FD_TABLE_SIZE : reactor->num_fds;
+    while (num_fds <= (size_t)fd) {
+      num_fds *= 2;
+    }
+    IoFdWaiters *table = (IoFdWaiters *)realloc(
+        reactor->fd_waiters, sizeof(IoFdWaiters) * num_fds);
+    if (table == NULL) {
+      return NULL;
+    }
+    memset(table + reactor->num_fds, 0,
+           sizeof(IoFdWaiters) * (num_fds - reactor->num_fds));
+    reactor->fd_waiters = table;
+    reactor->num_fds = num_fds;
+  }
+  return &reactor->fd_waiters[fd];
+}
+
+static uint32_t readiness(IoRequest *req) {
+  return req->op == IO_OP_WRITE ? EPOLLOUT : EPOLLIN;
+}
+
+// registers fd for what its waiting requests need, returns 0 or errno
+static int epoll_arm(IoReactor *reactor, int fd) {
+  IoFdWaiters *waiters = &reactor->fd_waiters[fd];
+  uint32_t want = 0;
+  for (IoRequest *req = waiters->waiting; req != NULL; req = req->next) {
+    want |= readiness(req);
+  }
+  if (want == waiters->armed) {
+    return 0;
+  }
+
+  struct epoll_event event;
+  event.events = want;
+  event.data.fd = fd;
+  int op = want == 0 ? EPOLL_CTL_DEL
+                     : (waiters->armed == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+  if (epoll_ctl(reactor->epoll_fd, op, fd, &event) != 0) {
+    return errno;
+  }
+  waiters->armed = want;
+  return 0;
+}
+
+static void epoll_start(IoReactor *reactor, IoRequest *req) {
+  if (req->op == IO_OP_FSYNC) {
+    deliver(reactor, req, perform(req));
+    return;
+  }
+  IoFdWaiters *waiters = req->fd >= 0 ? fd_waiters(reactor, req->fd) : NULL;
+  if (waiters == NULL) {
+    deliver(reactor, req, req->fd >= 0 ? -ENOMEM : -EBADF);
+    return;
+  }
+
+  // requests on one fd complete in the order they were submitted
+  req->next = NULL;
+  req->prev = NULL;
+  if (waiters->waiting == NULL) {
+    waiters->waiting = req;
+  } else {
+    IoRequest *last = waiters->waiting;
+    while (last->next != NULL) {
+      last = last->next;
+    }
+    last->next = req;
+    req->prev = last;
+  }
+  reactor->num_inflight++;
+
+  int err = epoll_arm(reactor, req->fd);
+  if (err == 0) {
+    return;
+  }
+  list_remove(&waiters->waiting, req);
+  reactor->num_inflight--;
+  // EPERM is a file epoll cannot watch, those are always ready
+  deliver(reactor, req, err == EPERM ? perform(req) : -(long)err);
+}
+
+// fd is ready as events say, runs the first waiting request of each
+// direction. Only the first, on a blocking fd the next one could block
+static void epoll_ready(IoReactor *reactor, int fd, uint32_t events) {
+  IoFdWaiters *waiters = &reactor->fd_waiters[fd];
+  uint32_t ready = events & (EPOLLERR | EPOLLHUP)
+                       ? (uint32_t)(EPOLLIN | EPOLLOUT)
+                       : events;
+  uint32_t done = 0;
+  IoRequest *req = waiters->waiting;
+  while (req != NULL) {
+    IoRequest *next = req->next;
+    uint32_t needs = readiness(req);
+    if ((ready & needs) && !(done & needs)) {
+      done |= needs;
+      long res = perform(req);
+      if (res != -EAGAIN && res != -EWOULDBLOCK) {
+        list_remove(&waiters->waiting, req);
+        reactor->num_inflight--;
+        deliver(reactor, req, res);
+      }
+    }
+    req = next;
+  }
+
+  int err = epoll_arm(reactor, fd);
+  if (err != 0) {
+    // the fd went away under us, nothing waiting on it can complete
+    while (waiters->waiting != NULL) {
+      req = waiters->waiting;
+      list_remove(&waiters->waiting, req);
+      reactor->num_inflight--;
+      deliver(reactor, req, -(long)err);
+    }
+    waiters->armed = 0;
+  }
+}
+
+static void epoll_cancel_all(IoReactor *reactor) {
+  for (size_t fd = 0; fd < reactor->num_fds; fd++) {
+    IoFdWaiters *waiters = &reactor->fd_waiters[fd];
+    while (waiters->waiting != NULL) {
+      IoRequest *req = waiters->waiting;
+      list_remove(&waiters->waiting, req);
+      reactor->num_inflight--;
+      deliver(reactor, req, -ECANCELED);
+    }
+  }
+}
+
+static void epoll_run(IoReactor *reactor) {
+  struct epoll_event events[EPOLL_BATCH];
+  while (1) {
+    IoRequest *incoming;
+    bool_t stopping = take_incoming(reactor, &incoming);
+    while (incoming != NULL) {
+      IoRequest *req = incoming;
+      incoming = req->next;
+      if (stopping) {
+        deliver(reactor, req, -ECANCELED);
+      } else {
+        epoll_start(reactor, req);
+      }
+    }
+    if (stopping) {
+      epoll_cancel_all(reactor);
+      return;
+    }
+
+    int n = epoll_wait(reactor->epoll_fd, events, EPOLL_BATCH, -1);
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.fd == reactor->wake_fd) {
+        drain_wake_fd(reactor);
+      } else {
+        epoll_ready(reactor, events[i].data.fd, events[i].events);
+      }
+    }
+  }
+}
+
+static void *reactor_runner(IoReactor *reactor) {
+  if (reactor->backend == IO_BACKEND_URING) {
+    uring_run(reactor);
+  } else {
+    epoll_run(reactor);
+  }
+  return NULL;
+}
+
+static void teardown(IoReactor *reactor) {
+  if (reactor->backend == IO_BACKEND_URING) {
+    uring_teardown(reactor);
+  } else {
+    close(reactor->epoll_fd);
+    free(reactor->fd_waiters);
+  }
+  close(reactor->wake_fd);
+}
+
+IoReactorResult io_reactor_init(IoReactor *reactor, ThreadPool *pool,
+                                IoBackend backend) {
+  reactor->pool = pool;
+  reactor->incoming_head = NULL;
+  reactor->incoming_tail = NULL;
+  reactor->stopping = FALSE;
+  reactor->inflight = NULL;
+  reactor->num_inflight = 0;
+  reactor->ring_fd = -1;
+  reactor->epoll_fd = -1;
+  reactor->fd_waiters = NULL;
+  reactor->num_fds = 0;
+
+  reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (reactor->wake_fd < 0) {
+    return IO_REACTOR_SYS_ERR;
+  }
+
+  if (backend != IO_BACKEND_EPOLL && uring_setup(reactor) == 0) {
+    reactor->backend = IO_BACKEND_URING;
+  } else if (backend == IO_BACKEND_URING) {
+    close(reactor->wake_fd);
+    return IO_REACTOR_UNSUPPORTED;
+  } else if (epoll_setup(reactor) == 0) {
+    reactor->backend = IO_BACKEND_EPOLL;
+  } else {
+    close(reactor->wake_fd);
+    return IO_REACTOR_SYS_ERR;
+  }
+
+  if (pthread_mutex_init(&reactor->lock, NULL) != 0) {
+    teardown(reactor);
+    return IO_REACTOR_SYS_ERR;
+  }
+  if (pthread_create(&reactor->thread, NULL,
+                     (void *(*)(void *)) & reactor_runner,
+                     (void *)reactor) != 0) {
+    pthread_mutex_destroy(&reactor->lock);
+    teardown(reactor);
+    return IO_REACTOR_THREAD_ERR;
+  }
+  return IO_REACTOR_SUCCESS;
+}
+
+static void wake(IoReactor *reactor) {
+  uint64_t one = 1;
+  while (write(reactor->wake_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+  }
+}
+
+EnqueueTaskResponse io_submit(IoReactor *reactor, IoRequest *req) {
+  EnqueueTaskResponse enq_resp;
+  enq_resp.resp_code = ENQUEUE_TASK_SUCCESS;
+  enq_resp.task_awaiter = req->then.task_awaiter;
+
+  req->next = NULL;
+  pthread_mutex_lock(&reactor->lock);
+  if (reactor->stopping) {
+    pthread_mutex_unlock(&reactor->lock);
+    enq_resp.resp_code = ENQUEUE_TASK_SHUTTING_DOWN;
+    return enq_resp;
+  }
+  // the reactor takes the whole list at once, so only the first request
+  // of a batch needs to wake it
+  bool_t first = reactor->incoming_head == NULL;
+  if (first) {
+    reactor->incoming_head = req;
+  } else {
+    reactor->incoming_tail->next = req;
+  }
+  reactor->incoming_tail = req;
+  pthread_mutex_unlock(&reactor->lock);
+
+  if (first) {
+    wake(reactor);
+  }
+  return enq_resp;
+}
+
+void io_reactor_destroy(IoReactor *reactor) {
+  pthread_mutex_lock(&reactor->lock);
+  reactor->stopping = TRUE;
+  pthread_mutex_unlock(&reactor->lock);
+  wake(reactor);
+  pthread_join(reactor->thread, NULL);
+  pthread_mutex_destroy(&reactor->lock);
+  teardown(reactor);
+}
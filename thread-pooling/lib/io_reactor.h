@@ -0,0 +1,129 @@
+#ifndef IO_REACTOR
+#define IO_REACTOR
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "threadpool.h"
+
+typedef enum {
+  IO_OP_READ = 0,
+  IO_OP_WRITE = 1,
+  IO_OP_FSYNC = 2,
+  IO_OP_ACCEPT = 3,
+} IoOp;
+
+// read or write at the file position and move it, the only choice for
+// pipes and sockets
+#define IO_OFFSET_CURRENT UINT64_MAX
+
+/*
+ * One I/O operation and what to run once it completed. Owned by the caller
+ * and left alone until its then task runs, which may read result.
+ */
+typedef struct __io_request {
+  IoOp op;
+  int fd;
+  void *buf;
+  size_t len;
+  uint64_t offset;
+  // what the system call returned, bytes moved or the accepted socket, or
+  // -errno. -ECANCELED if the reactor was destroyed first
+  long result;
+  Task then; // enqueued on the reactor's pool once result is set
+  // reactor's, links of the list the request waits in
+  struct __io_request *next;
+  struct __io_request *prev;
+} IoRequest;
+
+typedef enum {
+  IO_BACKEND_AUTO = 0,  // io_uring if the kernel has it, epoll otherwise
+  IO_BACKEND_URING = 1, // io_uring only
+  IO_BACKEND_EPOLL = 2, // epoll only
+} IoBackend;
+
+// epoll backend, the requests waiting for one fd and what it is armed for
+typedef struct {
+  IoRequest *waiting;
+  uint32_t armed; // EPOLLIN and EPOLLOUT, 0 if the fd is not registered
+} IoFdWaiters;
+
+/*
+ * Runs I/O for the tasks of a pool on one reactor thread, so workers never
+ * block in a system call. io_submit hands requests to the reactor, which
+ * starts them on an io_uring, or with epoll waits until their fd is ready
+ * and does the call itself, and enqueues each request's then task once it
+ * completed. Workers only ever run the continuations.
+ * Destroy the reactor before its pool, whatever is still in flight is
+ * cancelled and its continuation still runs, with -ECANCELED.
+ */
+typedef struct {
+  ThreadPool *pool;
+  IoBackend backend; // the one in use, never IO_BACKEND_AUTO
+  int wake_fd;       // eventfd, tells the reactor about new requests
+  pthread_t thread;
+
+  // handed over by io_submit, guarded by lock
+  pthread_mutex_t lock;
+  IoRequest *incoming_head;
+  IoRequest *incoming_tail;
+  bool_t stopping;
+
+  // started and not completed, reactor thread only
+  IoRequest *inflight;
+  size_t num_inflight;
+
+  // io_uring, one mapping for both rings and one for the submission
+  // entries. The head, tail and array pointers point into the rings
+  int ring_fd;
+  void *rings;
+  size_t rings_size;
+  void *sqes;
+  size_t sqes_size;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_array;
+  unsigned int sq_mask;
+  unsigned int sq_entries;
+  unsigned int sq_pending; // entries filled and not handed to the kernel
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int cq_mask;
+  void *cqes;
+
+  // epoll, fds index fd_waiters
+  int epoll_fd;
+  IoFdWaiters *fd_waiters;
+  size_t num_fds;
+} IoReactor;
+
+typedef enum {
+  IO_REACTOR_SUCCESS = 0,
+  IO_REACTOR_UNSUPPORTED = -1, // the backend asked for is not available
+  IO_REACTOR_SYS_ERR = -2,     // a system call failed, see errno
+  IO_REACTOR_THREAD_ERR = -3,
+} IoReactorResult;
+
+// starts the reactor thread, completions go to pool
+IoReactorResult io_reactor_init(IoReactor *reactor, ThreadPool *pool,
+                                IoBackend backend);
+
+// Cancels what is in flight, waits until every continuation was handed to
+// the pool and stops the reactor thread
+void io_reactor_destroy(IoReactor *reactor);
+
+// fill a request, then runs on the pool once it completed
+void io_request_read(IoRequest *req, int fd, void *buf, size_t len,
+                     uint64_t offset, Task then);
+void io_request_write(IoRequest *req, int fd, const void *buf, size_t len,
+                      uint64_t offset, Task then);
+void io_request_fsync(IoRequest *req, int fd, Task then);
+// the accepted socket is close on exec
+void io_request_accept(IoRequest *req, int fd, Task then);
+
+// Hands a filled request to the reactor, never blocks on the I/O itself.
+// Fails with ENQUEUE_TASK_SHUTTING_DOWN once the reactor is being destroyed
+EnqueueTaskResponse io_submit(IoReactor *reactor, IoRequest *req);
+
+#endif
@@ -0,0 +1,219 @@
+#include "mpmc_ring.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// every slot starts with its sequence number, the element follows it
+typedef struct {
+  atomic_size_t seq;
+  char data[];
+} RingSlot;
+
+static RingSlot *slot_at(MpmcRing *ring, size_t pos) {
+  return (RingSlot *)(ring->slots + (pos & ring->mask) * ring->slot_size);
+}
+
+// slots hold a power of two of positions, each padded to whole cache lines
+static size_t rounded_capacity(size_t capacity) {
+  size_t rounded = 1;
+  while (rounded < capacity) {
+    rounded <<= 1;
+  }
+  return rounded;
+}
+
+static size_t padded_slot_size(size_t elem_size) {
+  size_t slot_size = sizeof(RingSlot) + elem_size;
+  return (slot_size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+}
+
+size_t mpmc_ring_memory_size(size_t capacity, size_t elem_size) {
+  return padded_slot_size(elem_size) * rounded_capacity(capacity);
+}
+
+void mpmc_ring_init_at(MpmcRing *ring, void *memory, size_t capacity,
+                       size_t elem_size) {
+  size_t rounded = rounded_capacity(capacity);
+  ring->slots = (char *)memory;
+  ring->mask = rounded - 1;
+  ring->elem_size = elem_size;
+  ring->slot_size = padded_slot_size(elem_size);
+
+  // slot i is ready for the producer that claims position i
+  for (size_t i = 0; i < rounded; i++) {
+    atomic_init(&slot_at(ring, i)->seq, i);
+  }
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+}
+
+int mpmc_ring_init(MpmcRing *ring, size_t capacity, size_t elem_size) {
+  void *slots = aligned_alloc(CACHE_LINE_SIZE,
+                              mpmc_ring_memory_size(capacity, elem_size));
+  if (slots == NULL) {
+    return -1;
+  }
+  mpmc_ring_init_at(ring, slots, capacity, elem_size);
+  return 0;
+}
+
+void mpmc_ring_destroy(MpmcRing *ring) {
+  free(ring->slots);
+  ring->slots = NULL;
+}
+
+/*
+ * A producer reads tail and looks at the slot it maps to:
+ *  - seq == pos: the slot is free for this position, try to claim it by
+ *    moving tail forward. The winner owns the slot exclusively.
+ *  - seq < pos: the consumer from the previous lap has not released it yet,
+ *    so the ring is full.
+ *  - seq > pos: another producer already claimed this position, reload tail.
+ * After writing the element the producer publishes it with seq = pos + 1.
+ */
+int mpmc_ring_try_push(MpmcRing *ring, const void *elem) {
+  size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  RingSlot *slot;
+
+  while (1) {
+    slot = slot_at(ring, pos);
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+      // failed CAS reloaded pos for us
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    }
+  }
+
+  memcpy(slot->data, elem, ring->elem_size);
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  return 1;
+}
+
+/*
+ * Same protocol as push, but every slot in [pos, pos + n) must be free for
+ * its position before tail can jump over the whole range. Once the CAS wins
+ * the range is ours, the elements are copied in and then published in order
+ * so consumers can start on the front of the batch right away.
+ */
+int mpmc_ring_try_push_n(MpmcRing *ring, const void *elems, size_t n) {
+  if (n == 0) {
+    return 1;
+  }
+  if (n > ring->mask + 1) {
+    return 0;
+  }
+
+  size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  while (1) {
+    size_t i;
+    intptr_t diff = 0;
+    for (i = 0; i < n; i++) {
+      size_t seq = atomic_load_explicit(&slot_at(ring, pos + i)->seq,
+                                        memory_order_acquire);
+      diff = (intptr_t)seq - (intptr_t)(pos + i);
+      if (diff != 0) {
+        break;
+      }
+    }
+
+    if (i == n) {
+      if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + n,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    }
+  }
+
+  const char *src = (const char *)elems;
+  for (size_t i = 0; i < n; i++) {
+    memcpy(slot_at(ring, pos + i)->data, src + i * ring->elem_size,
+           ring->elem_size);
+  }
+  for (size_t i = 0; i < n; i++) {
+    atomic_store_explicit(&slot_at(ring, pos + i)->seq, pos + i + 1,
+                          memory_order_release);
+  }
+  return 1;
+}
+
+/*
+ * Mirror image of push: a slot holding the element for position pos has
+ * seq == pos + 1. After copying it out the consumer hands the slot to the
+ * producer of the next lap with seq = pos + capacity. With claim set every
+ * position is published there before the CAS that may take it
+ */
+static int pop(MpmcRing *ring, void *out, atomic_size_t *claim) {
+  memory_order order =
+      claim != NULL ? memory_order_seq_cst : memory_order_relaxed;
+  size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  RingSlot *slot;
+
+  while (1) {
+    slot = slot_at(ring, pos);
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+    if (diff == 0) {
+      if (claim != NULL) {
+        atomic_store(claim, pos);
+      }
+      if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                order,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    }
+  }
+
+  memcpy(out, slot->data, ring->elem_size);
+  atomic_store_explicit(&slot->seq, pos + ring->mask + 1, memory_order_release);
+  return 1;
+}
+
+int mpmc_ring_try_pop(MpmcRing *ring, void *out) {
+  return pop(ring, out, NULL);
+}
+
+int mpmc_ring_try_pop_claimed(MpmcRing *ring, void *out, atomic_size_t *claim) {
+  return pop(ring, out, claim);
+}
+
+int mpmc_ring_finish_pop(MpmcRing *ring, size_t pos, void *out) {
+  RingSlot *slot = slot_at(ring, pos);
+  size_t head = atomic_load(&ring->head);
+  size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+  if ((intptr_t)(head - pos) <= 0 || seq != pos + 1) {
+    return 0;
+  }
+  memcpy(out, slot->data, ring->elem_size);
+  atomic_store_explicit(&slot->seq, pos + ring->mask + 1, memory_order_release);
+  return 1;
+}
+
+size_t mpmc_ring_size(MpmcRing *ring) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  return tail > head ? tail - head : 0;
+}
@@ -0,0 +1,80 @@
+#ifndef MPMC_RING
+#define MPMC_RING
+
+#include <stddef.h>
+
+#include "atomics.h"
+
+// Size of a cache line on every target we care about, used to pad shared
+// atomics away from each other so producers and consumers do not false share
+#define CACHE_LINE_SIZE 64
+
+// Hint to the cpu that we are in a spin wait loop
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define CPU_RELAX() ;
+#endif
+
+/*
+ * Bounded multi producer multi consumer ring buffer.
+ *
+ * Every slot carries a sequence number that tells a producer or consumer
+ * whether the slot is ready for them at a given position, so claiming a
+ * position is a single CAS on head or tail and there is no lock anywhere.
+ * Elements are copied in and out by value, the element size is fixed at init.
+ * Capacity is rounded up to a power of two so positions map to slots with a
+ * mask.
+ */
+typedef struct {
+  TP_ALIGNAS(CACHE_LINE_SIZE) atomic_size_t head; // next position to dequeue
+  TP_ALIGNAS(CACHE_LINE_SIZE) atomic_size_t tail; // next position to enqueue
+  TP_ALIGNAS(CACHE_LINE_SIZE) char *slots;
+  size_t mask;
+  size_t elem_size;
+  size_t slot_size; // sequence + element, padded to a cache line multiple
+} MpmcRing;
+
+// returns 0 on success, -1 if the slots could not be allocated
+int mpmc_ring_init(MpmcRing *ring, size_t capacity, size_t elem_size);
+
+// bytes of slot memory a ring of capacity elements needs
+size_t mpmc_ring_memory_size(size_t capacity, size_t elem_size);
+
+// Same as mpmc_ring_init over memory the caller provides, mpmc_ring_memory_size
+// bytes aligned to a cache line, e.g. a mapping shared with other processes.
+// Such a ring is not destroyed, its memory stays the caller's
+void mpmc_ring_init_at(MpmcRing *ring, void *memory, size_t capacity,
+                       size_t elem_size);
+
+void mpmc_ring_destroy(MpmcRing *ring);
+
+// copy elem into the ring, returns 1 on success and 0 if the ring is full
+int mpmc_ring_try_push(MpmcRing *ring, const void *elem);
+
+// copy n contiguous elements into n consecutive positions claimed with a
+// single CAS, all or nothing. Returns 1 on success and 0 if the n slots are
+// not all free yet
+int mpmc_ring_try_push_n(MpmcRing *ring, const void *elems, size_t n);
+
+// copy the oldest element into out, returns 1 on success and 0 if the ring is
+// empty
+int mpmc_ring_try_pop(MpmcRing *ring, void *out);
+
+// same as mpmc_ring_try_pop, but stores each position it is about to claim
+// into claim first, for when the consumer may die halfway. Whoever sees it
+// die passes the last one stored to mpmc_ring_finish_pop
+int mpmc_ring_try_pop_claimed(MpmcRing *ring, void *out, atomic_size_t *claim);
+
+// Completes the pop of a consumer that died holding position pos: if pos was
+// claimed but its slot not handed back yet, copies the element into out,
+// hands the slot back and returns 1. Returns 0 if pos is not claimed yet or
+// was popped completely. Nobody alive may be popping pos meanwhile
+int mpmc_ring_finish_pop(MpmcRing *ring, size_t pos, void *out);
+
+// number of elements in the ring, only a snapshot while others push and pop
+size_t mpmc_ring_size(MpmcRing *ring);
+
+#endif
@@ -0,0 +1,223 @@
+#include "parallel.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "completion.h"
+
+// with an automatic grain every worker gets about this many pieces, enough
+// slack for stealing to even out pieces that run long
+#define PIECES_PER_WORKER 8
+// upper bound on the pieces of one call, the grain is raised to stay under it
+#define MAX_PIECES 4096
+// calls with at most this many pieces keep their bookkeeping on the stack
+#define STACK_PIECES 64
+
+typedef struct __range_job RangeJob;
+
+// a sub range some task is responsible for, once that task is done begin and
+// end describe the leaf it processed itself
+typedef struct {
+  RangeJob *job;
+  size_t begin;
+  size_t end;
+  char *acc; // parallel_reduce only
+} RangePiece;
+
+struct __range_job {
+  ThreadPool *pool;
+  RangeFunc_t for_body;
+  RangeReduceFunc_t reduce_body;
+  const void *identity;
+  size_t acc_size;
+  void *ctx;
+  size_t grain;
+
+  RangePiece *pieces;
+  size_t max_pieces;
+  atomic_size_t next_piece;
+  atomic_size_t outstanding; // pieces not finished yet
+  TaskCompletion *done;
+};
+
+static void run_leaf(RangeJob *job, RangePiece *piece) {
+  if (job->reduce_body != NULL) {
+    memcpy(piece->acc, job->identity, job->acc_size);
+    job->reduce_body(piece->begin, piece->end, job->ctx, piece->acc);
+  } else {
+    job->for_body(piece->begin, piece->end, job->ctx);
+  }
+}
+
+/*
+ * Task body for one piece: keep splitting the right half off as a new task
+ * until the piece is down to grain, then run what is left here. The right
+ * halves go onto this worker's deque, so the first thief takes the biggest
+ * one and splits it further on its own core.
+ */
+static void run_piece(RangePiece *piece, void *unused) {
+  RangeJob *job = piece->job;
+
+  while (piece->end - piece->begin > job->grain) {
+    size_t index = atomic_fetch_add(&job->next_piece, 1);
+    if (index >= job->max_pieces) {
+      break;
+    }
+
+    size_t mid = piece->begin + (piece->end - piece->begin) / 2;
+    RangePiece *right = &job->pieces[index];
+    right->job = job;
+    right->begin = mid;
+    right->end = piece->end;
+
+    atomic_fetch_add(&job->outstanding, 1);
+    Task task;
+    new_task(&task, (UserDefFunc_t)&run_piece, right, NULL, 0, TRUE);
+    if (enqueue_task(job->pool, task).resp_code != ENQUEUE_TASK_SUCCESS) {
+      // the pool would not take it, keep the whole range here and leave an
+      // empty piece behind so a reduce still sees identity for it
+      atomic_fetch_sub(&job->outstanding, 1);
+      right->begin = mid;
+      right->end = mid;
+      if (job->reduce_body != NULL) {
+        memcpy(right->acc, job->identity, job->acc_size);
+      }
+      break;
+    }
+    piece->end = mid;
+  }
+
+  run_leaf(job, piece);
+
+  // the caller may return and free the job as soon as outstanding hits zero
+  TaskCompletion *done = job->done;
+  if (atomic_fetch_sub(&job->outstanding, 1) == 1) {
+    completion_signal(done);
+  }
+}
+
+static int compare_pieces(const void *a, const void *b) {
+  const RangePiece *left = (const RangePiece *)a;
+  const RangePiece *right = (const RangePiece *)b;
+  return (left->begin > right->begin) - (left->begin < right->begin);
+}
+
+static ParallelResult run_job(RangeJob *job, size_t begin, size_t end,
+                              size_t grain, CombineFunc_t combine,
+                              void *result) {
+  size_t n = end - begin;
+  if (grain == 0) {
+    grain = n / ((size_t)job->pool->max_threads * PIECES_PER_WORKER);
+  }
+  if (grain == 0) {
+    grain = 1;
+  }
+  // halving stops at pieces longer than grain / 2, so there are at most
+  // 2 * n / grain of them
+  if (n / grain + 1 > MAX_PIECES / 2) {
+    grain = n / (MAX_PIECES / 2 - 1) + 1;
+  }
+  job->grain = grain;
+  job->max_pieces = 2 * (n / grain + 1);
+
+  RangePiece stack_pieces[STACK_PIECES];
+  job->pieces = stack_pieces;
+  if (job->max_pieces > STACK_PIECES) {
+    job->pieces = (RangePiece *)malloc(sizeof(RangePiece) * job->max_pieces);
+  }
+  char *accs = NULL;
+  if (job->reduce_body != NULL) {
+    accs = (char *)malloc(job->acc_size * job->max_pieces);
+  }
+  job->done = completion_acquire();
+  if (job->pieces == NULL || (job->reduce_body != NULL && accs == NULL) ||
+      job->done == NULL) {
+    if (job->pieces != stack_pieces) {
+      free(job->pieces);
+    }
+    free(accs);
+    if (job->done != NULL) {
+      completion_release(job->done);
+    }
+    return PARALLEL_MEMORY_ERR;
+  }
+  for (size_t i = 0; i < job->max_pieces && accs != NULL; i++) {
+    job->pieces[i].acc = accs + i * job->acc_size;
+  }
+
+  RangePiece *root = &job->pieces[0];
+  root->job = job;
+  root->begin = begin;
+  root->end = end;
+  atomic_init(&job->next_piece, 1);
+  atomic_init(&job->outstanding, 1);
+
+  // the caller takes the root piece itself
+  run_piece(root, NULL);
+
+  // a worker waiting here runs other queued work, which is what keeps
+  // nested calls from tying up every worker
+  bool_t is_worker = thread_pool_is_worker_thread(job->pool);
+  while (!completion_is_done(job->done)) {
+    if (is_worker && thread_pool_run_pending_task(job->pool)) {
+      continue;
+    }
+    completion_wait(job->done);
+  }
+  completion_release(job->done);
+
+  if (job->reduce_body != NULL) {
+    size_t used = atomic_load(&job->next_piece);
+    if (used > job->max_pieces) {
+      used = job->max_pieces;
+    }
+    qsort(job->pieces, used, sizeof(RangePiece), &compare_pieces);
+    memcpy(result, job->identity, job->acc_size);
+    for (size_t i = 0; i < used; i++) {
+      combine(result, job->pieces[i].acc, job->ctx);
+    }
+  }
+
+  if (job->pieces != stack_pieces) {
+    free(job->pieces);
+  }
+  free(accs);
+  return PARALLEL_SUCCESS;
+}
+
+ParallelResult parallel_for(ThreadPool *pool, size_t begin, size_t end,
+                            size_t grain, RangeFunc_t body, void *ctx) {
+  if (end <= begin) {
+    return PARALLEL_SUCCESS;
+  }
+
+  RangeJob job;
+  job.pool = pool;
+  job.for_body = body;
+  job.reduce_body = NULL;
+  job.identity = NULL;
+  job.acc_size = 0;
+  job.ctx = ctx;
+  return run_job(&job, begin, end, grain, NULL, NULL);
+}
+
+ParallelResult parallel_reduce(ThreadPool *pool, size_t begin, size_t end,
+                               size_t grain, RangeReduceFunc_t body,
+                               CombineFunc_t combine, const void *identity,
+                               size_t acc_size, void *result, void *ctx) {
+  if (end <= begin) {
+    memcpy(result, identity, acc_size);
+    return PARALLEL_SUCCESS;
+  }
+
+  RangeJob job;
+  job.pool = pool;
+  job.for_body = NULL;
+  job.reduce_body = body;
+  job.identity = identity;
+  job.acc_size = acc_size;
+  job.ctx = ctx;
+  return run_job(&job, begin, end, grain, combine, result);
+}
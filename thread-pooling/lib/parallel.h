@@ -0,0 +1,47 @@
+#ifndef PARALLEL
+#define PARALLEL
+
+#include <stddef.h>
+
+#include "threadpool.h"
+
+// body of a parallel_for, called with a sub range [begin, end) of the loop
+typedef void (*RangeFunc_t)(size_t begin, size_t end, void *ctx);
+
+// body of a parallel_reduce, folds the sub range [begin, end) into acc, which
+// starts out as a copy of the identity
+typedef void (*RangeReduceFunc_t)(size_t begin, size_t end, void *ctx,
+                                  void *acc);
+
+// combines other into acc, must be associative. Partial results are combined
+// in range order so it does not need to be commutative
+typedef void (*CombineFunc_t)(void *acc, const void *other, void *ctx);
+
+typedef enum {
+  PARALLEL_SUCCESS = 0,
+  PARALLEL_MEMORY_ERR = -1,
+} ParallelResult;
+
+/*
+ * Runs body over [begin, end) on the pool and returns once every index has
+ * been processed. The range is split by recursive halving down to pieces of
+ * at least grain indices, split off halves are pushed where idle workers
+ * steal them. grain 0 picks one based on the number of workers.
+ * The calling thread works on the range too, and when it is one of the
+ * pool's workers it runs other queued tasks while it waits, so nesting is
+ * safe.
+ */
+ParallelResult parallel_for(ThreadPool *pool, size_t begin, size_t end,
+                            size_t grain, RangeFunc_t body, void *ctx);
+
+/*
+ * Like parallel_for, but every piece of the range folds into its own
+ * accumulator of acc_size bytes, initialized from identity, and the pieces
+ * are combined into result in range order.
+ */
+ParallelResult parallel_reduce(ThreadPool *pool, size_t begin, size_t end,
+                               size_t grain, RangeReduceFunc_t body,
+                               CombineFunc_t combine, const void *identity,
+                               size_t acc_size, void *result, void *ctx);
+
+#endif
@@ -0,0 +1,587 @@
+#define _GNU_SOURCE
+#include "proc_pool.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "futex.h"
+
+// a result slot's state is its generation shifted past these bits, and one
+// of the PROC_STATUS_* in them
+#define STATUS_BITS 2
+#define STATUS_MASK ((1u << STATUS_BITS) - 1)
+#define PROC_STATUS_PENDING 0
+#define PROC_STATUS_DONE 1
+#define PROC_STATUS_CRASHED 2
+
+// a worker record's state is the tasks its slot finished shifted past these
+// bits, and one of the WORKER_* phases of its current task in them
+#define PHASE_BITS 2
+#define PHASE_MASK ((1u << PHASE_BITS) - 1)
+#define WORKER_IDLE 0     // no token, waiting for one
+#define WORKER_CLAIMING 1 // holds an added token, popping the entry
+#define WORKER_TAKEN 2    // has the entry, its ring slot not posted as empty
+#define WORKER_RUNNING 3
+
+#ifdef DEBUG
+#include <stdio.h>
+#define LOG(...) printf(__VA_ARGS__);
+#else
+#define LOG(...)
+#endif
+
+static size_t align_up(size_t size) {
+  return (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+}
+
+void proc_pool_default_options(ProcPoolOptions *opts, int num_workers) {
+  opts->num_workers = num_workers;
+  opts->queue_capacity = MAX_BUFFER;
+  opts->max_tasks = PROC_POOL_MAX_TASKS;
+}
+
+// Settles the task owning slot in generation gen. Only the first of the
+// worker finishing it and the supervisor failing it gets to, and a stale
+// generation matches nothing
+static void settle(ProcResultSlot *slot, uint32_t gen, unsigned int status) {
+  unsigned int expected = gen << STATUS_BITS | PROC_STATUS_PENDING;
+  if (atomic_compare_exchange_strong(&slot->state, &expected,
+                                     gen << STATUS_BITS | status) &&
+      atomic_load(&slot->waiters) > 0) {
+    futex_wake_shared(&slot->state, INT_MAX);
+  }
+}
+
+static void set_state(ProcWorkerRecord *record, uint64_t finished,
+                      unsigned int phase) {
+  atomic_store(&record->state, finished << PHASE_BITS | phase);
+}
+
+// tasks finished or crashed, wakes proc_pool_wait_idle callers to count
+// again what is left
+static void tasks_finished(ProcShared *shared) {
+  atomic_fetch_add(&shared->finish_seq, 1);
+  if (atomic_load(&shared->idle_waiters) > 0) {
+    futex_wake_shared(&shared->finish_seq, INT_MAX);
+  }
+}
+
+// enqueued tasks not finished or crashed yet. The finished counts are read
+// first, a task enqueued and finished meanwhile can only make it larger
+static uint64_t pending_tasks(ProcPool *pool) {
+  uint64_t finished = 0;
+  for (int i = 0; i < pool->num_workers; i++) {
+    finished += atomic_load(&pool->workers[i].state) >> PHASE_BITS;
+  }
+  return atomic_load(&pool->shared->enqueued) - finished;
+}
+
+/*
+ * Body of every worker process. It sees the parent's memory as it was at
+ * the fork, and only the shared mapping after that. Shutdown posts one
+ * added token per worker once the ring is drained and stopping is set.
+ * Every step is published in the record's state before the next one, see
+ * replace_worker for what each tells the supervisor.
+ */
+static void worker_main(ProcPool *pool, int index) {
+  ProcShared *shared = pool->shared;
+  ProcWorkerRecord *self = &pool->workers[index];
+  ProcTaskEntry *entry = &self->entry;
+  // a replacement goes on counting where the worker before it stopped
+  uint64_t finished = atomic_load(&self->state) >> PHASE_BITS;
+
+  while (1) {
+    fsem_wait(&shared->added);
+    if (atomic_load(&shared->stopping)) {
+      _exit(0);
+    }
+    entry->func = NULL;
+    set_state(self, finished, WORKER_CLAIMING);
+    // a token stands for an entry, a producer may still be copying it in.
+    // Only a spare one from the supervisor finds the ring empty
+    bool_t taken;
+    while (!(taken = mpmc_ring_try_pop_claimed(&shared->ring, entry,
+                                               &self->claim)) &&
+           mpmc_ring_size(&shared->ring) > 0) {
+      CPU_RELAX();
+    }
+    if (!taken) {
+      set_state(self, finished, WORKER_IDLE);
+      continue;
+    }
+    set_state(self, finished, WORKER_TAKEN);
+    fsem_post(&shared->empty);
+    set_state(self, finished, WORKER_RUNNING);
+
+    ProcResultSlot *slot =
+        entry->slot == PROC_NO_SLOT ? NULL : &pool->slots[entry->slot];
+    entry->func(entry->args, slot != NULL ? slot->result : NULL);
+    if (slot != NULL) {
+      settle(slot, entry->gen, PROC_STATUS_DONE);
+    }
+    atomic_store_explicit(
+        &self->tasks_executed,
+        atomic_load_explicit(&self->tasks_executed, memory_order_relaxed) + 1,
+        memory_order_relaxed);
+    // finishing the task and counting it is this one store
+    finished++;
+    set_state(self, finished, WORKER_IDLE);
+    tasks_finished(shared);
+  }
+}
+
+// Forks the worker for slot index and opens a pidfd on it. Called on the
+// supervisor with lock held, the worker dies with the supervisor thread.
+// Returns 0 on success
+static int spawn_worker(ProcPool *pool, int index) {
+  pid_t parent = getpid();
+  pid_t pid = fork();
+  if (pid < 0) {
+    return -1;
+  }
+  if (pid == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    // the parent may have gone before the line above
+    if (getppid() != parent) {
+      _exit(1);
+    }
+    worker_main(pool, index);
+  }
+
+  int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+  if (pidfd < 0) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+  }
+  atomic_store(&pool->workers[index].pid, pid);
+  pool->pidfds[index] = pidfd;
+  LOG("PROC POOL: Worker %d is process %d\n", index, pid)
+  return 0;
+}
+
+// whether another worker than index, still alive, is claiming ring
+// position pos. Called on the supervisor with lock held
+static bool_t claimed_by_other(ProcPool *pool, int index, size_t pos) {
+  for (int i = 0; i < pool->num_workers; i++) {
+    ProcWorkerRecord *record = &pool->workers[i];
+    if (i == index || pool->pidfds[i] < 0 ||
+        (atomic_load(&record->state) & PHASE_MASK) != WORKER_CLAIMING ||
+        atomic_load(&record->claim) != pos) {
+      continue;
+    }
+    // a pidfd turns readable once its process is gone
+    struct pollfd fd = {.fd = pool->pidfds[i], .events = POLLIN};
+    if (poll(&fd, 1, 0) == 0) {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+// Whether the worker at index, killed while claiming, had taken its entry
+// off the ring. If it died between taking the position and handing the
+// slot back the pop is finished here, into its record
+static bool_t claimed_entry(ProcPool *pool, int index) {
+  ProcShared *shared = pool->shared;
+  ProcWorkerRecord *record = &pool->workers[index];
+  size_t pos = atomic_load(&record->claim);
+  if ((intptr_t)(atomic_load(&shared->ring.head) - pos) > 0) {
+    // taken by it or by one that raced it for pos. A live one finishes or
+    // moves on to the next position shortly
+    while (claimed_by_other(pool, index, pos)) {
+      sched_yield();
+    }
+    if (mpmc_ring_finish_pop(&shared->ring, pos, &record->entry)) {
+      // dead ones that raced it for pos get their token back instead
+      for (int i = 0; i < pool->num_workers; i++) {
+        ProcWorkerRecord *other = &pool->workers[i];
+        if (i != index &&
+            (atomic_load(&other->state) & PHASE_MASK) == WORKER_CLAIMING &&
+            atomic_load(&other->claim) == pos) {
+          other->entry.func = NULL;
+        }
+      }
+      return TRUE;
+    }
+  }
+  // a worker that lost every race never copied anything
+  return record->entry.func != NULL;
+}
+
+// A worker died outside of shutdown. Its task, if it had one, is failed and
+// no longer pending, and a new worker takes its place
+static void replace_worker(ProcPool *pool, int index) {
+  ProcWorkerRecord *record = &pool->workers[index];
+  int status;
+  waitpid(atomic_load(&record->pid), &status, 0);
+  close(pool->pidfds[index]);
+  pool->pidfds[index] = -1;
+  atomic_store(&record->pid, -1);
+  atomic_fetch_add(&pool->shared->crashes, 1);
+  LOG("PROC POOL: Worker %d died with status %d\n", index, status)
+
+  // Tasks crash it, but plugins may also be killed from outside, by the OOM
+  // killer or a sibling, so the worker may have died at any step:
+  // - idle, or claiming without the entry, the entry is still queued and
+  //   the token goes back for another worker to take it. Killed halfway
+  //   through the pop, claimed_entry finishes it. It may have died just
+  //   after taking a token and before claiming, so an idle one gets its
+  //   token back too, a spare only wakes a worker that finds nothing;
+  // - past that the task is failed, and its ring slot given back if the
+  //   worker had not yet. One that settled it before dying already made it
+  //   done, settle ignores the second attempt.
+  ProcShared *shared = pool->shared;
+  uint64_t state = atomic_load(&record->state);
+  uint64_t finished = state >> PHASE_BITS;
+  unsigned int phase = (unsigned int)(state & PHASE_MASK);
+  if (phase == WORKER_IDLE ||
+      (phase == WORKER_CLAIMING && !claimed_entry(pool, index))) {
+    // the replacement starts out idle, the token is not its to give back
+    set_state(record, finished, WORKER_IDLE);
+    fsem_post(&shared->added);
+  } else {
+    if (phase != WORKER_RUNNING) {
+      fsem_post(&shared->empty);
+    }
+    if (record->entry.slot != PROC_NO_SLOT) {
+      settle(&pool->slots[record->entry.slot], record->entry.gen,
+             PROC_STATUS_CRASHED);
+    }
+    set_state(record, finished + 1, WORKER_IDLE);
+  }
+  // also for a worker that died between counting its task and telling
+  tasks_finished(shared);
+
+  if (spawn_worker(pool, index) != 0) {
+    LOG("PROC POOL: Worker %d could not be replaced\n", index)
+  }
+}
+
+// The supervisor forks the workers, so they die with it, and replaces the
+// ones that die until shutdown. wake_fd tells it to leave
+static void *supervise(ProcPool *pool) {
+  int n = pool->num_workers;
+  int started = 1;
+  pthread_mutex_lock(&pool->lock);
+  for (int i = 0; i < n && started == 1; i++) {
+    if (spawn_worker(pool, i) != 0) {
+      started = -1;
+    }
+  }
+  pool->started = started;
+  pthread_cond_broadcast(&pool->started_cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  struct pollfd fds[n + 1];
+  int nfds = n + 1;
+  while (1) {
+    fds[0].fd = pool->wake_fd;
+    fds[0].events = POLLIN;
+    for (int i = 0; i < nfds - 1; i++) {
+      // a worker that could not be replaced has -1 here, poll skips it
+      fds[i + 1].fd = pool->pidfds[i];
+      fds[i + 1].events = POLLIN;
+      fds[i + 1].revents = 0;
+    }
+    if (poll(fds, (nfds_t)nfds, -1) < 0) {
+      continue;
+    }
+    if (fds[0].revents != 0) {
+      break;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (atomic_load(&pool->shared->stopping)) {
+      // exits are shutdown's to reap, only wait for wake_fd from here on
+      nfds = 1;
+    } else {
+      for (int i = 0; i < nfds - 1; i++) {
+        if (fds[i + 1].revents != 0) {
+          replace_worker(pool, i);
+        }
+      }
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+  return NULL;
+}
+
+// what both a failed init and destroy tear down, once no process is left
+static void release_resources(ProcPool *pool) {
+  for (int i = 0; i < pool->num_workers; i++) {
+    if (pool->pidfds[i] >= 0) {
+      close(pool->pidfds[i]);
+    }
+  }
+  close(pool->wake_fd);
+  pthread_cond_destroy(&pool->started_cond);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_mutex_destroy(&pool->slots_lock);
+  free(pool->pidfds);
+  free(pool->free_slots);
+  munmap(pool->region, pool->region_size);
+}
+
+// stops the supervisor and every worker it started, without draining
+static void stop_workers(ProcPool *pool, int gently) {
+  pthread_mutex_lock(&pool->lock);
+  atomic_store(&pool->shared->stopping, 1);
+  pthread_mutex_unlock(&pool->lock);
+
+  fsem_post_n(&pool->shared->added, (unsigned int)pool->num_workers);
+  for (int i = 0; i < pool->num_workers; i++) {
+    pid_t pid = atomic_load(&pool->workers[i].pid);
+    if (pid > 0) {
+      if (!gently) {
+        kill(pid, SIGKILL);
+      }
+      waitpid(pid, NULL, 0);
+    }
+  }
+
+  uint64_t one = 1;
+  while (write(pool->wake_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+  }
+  pthread_join(pool->supervisor, NULL);
+}
+
+ProcPoolResult proc_pool_init(ProcPool *pool, const ProcPoolOptions *opts) {
+  if (opts->num_workers < 1 || opts->queue_capacity < 1 ||
+      opts->queue_capacity > INT_MAX || opts->max_tasks < 1 ||
+      opts->max_tasks >= PROC_NO_SLOT) {
+    return PROC_POOL_INVALID_OPTIONS;
+  }
+  int n = opts->num_workers;
+
+  // one mapping: the shared head, worker records, result slots, ring slots
+  size_t workers_at = align_up(sizeof(ProcShared));
+  size_t slots_at = workers_at + align_up(sizeof(ProcWorkerRecord) * n);
+  size_t ring_at = slots_at + align_up(sizeof(ProcResultSlot) * opts->max_tasks);
+  size_t size = ring_at + mpmc_ring_memory_size(opts->queue_capacity,
+                                                sizeof(ProcTaskEntry));
+
+  int memfd = memfd_create("proc_pool", MFD_CLOEXEC);
+  if (memfd < 0) {
+    return PROC_POOL_SHM_ERR;
+  }
+  if (ftruncate(memfd, (off_t)size) != 0) {
+    close(memfd);
+    return PROC_POOL_SHM_ERR;
+  }
+  // the mapping outlives the fd, workers inherit it at the same address
+  char *region =
+      (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  close(memfd);
+  if (region == MAP_FAILED) {
+    return PROC_POOL_SHM_ERR;
+  }
+
+  pool->num_workers = n;
+  pool->max_tasks = opts->max_tasks;
+  pool->region = region;
+  pool->region_size = size;
+  pool->shared = (ProcShared *)region;
+  pool->workers = (ProcWorkerRecord *)(region + workers_at);
+  pool->slots = (ProcResultSlot *)(region + slots_at);
+
+  ProcShared *shared = pool->shared;
+  mpmc_ring_init_at(&shared->ring, region + ring_at, opts->queue_capacity,
+                    sizeof(ProcTaskEntry));
+  fsem_init_shared(&shared->empty, (unsigned int)opts->queue_capacity);
+  fsem_init_shared(&shared->added, 0);
+  atomic_init(&shared->enqueued, 0);
+  atomic_init(&shared->finish_seq, 0);
+  atomic_init(&shared->idle_waiters, 0);
+  atomic_init(&shared->stopping, 0);
+  atomic_init(&shared->crashes, 0);
+  for (int i = 0; i < n; i++) {
+    atomic_init(&pool->workers[i].pid, -1);
+    atomic_init(&pool->workers[i].state, WORKER_IDLE);
+    atomic_init(&pool->workers[i].tasks_executed, 0);
+    atomic_init(&pool->workers[i].claim, 0);
+    pool->workers[i].entry.func = NULL;
+  }
+  for (size_t i = 0; i < opts->max_tasks; i++) {
+    atomic_init(&pool->slots[i].state, 0);
+    atomic_init(&pool->slots[i].waiters, 0);
+  }
+
+  pool->free_slots = (uint32_t *)malloc(sizeof(uint32_t) * opts->max_tasks);
+  pool->pidfds = (int *)malloc(sizeof(int) * n);
+  if (pool->free_slots == NULL || pool->pidfds == NULL) {
+    free(pool->free_slots);
+    free(pool->pidfds);
+    munmap(region, size);
+    return PROC_POOL_MEMORY_ERR;
+  }
+  // lowest slots on top, so a lightly used pool touches few pages
+  for (size_t i = 0; i < opts->max_tasks; i++) {
+    pool->free_slots[i] = (uint32_t)(opts->max_tasks - 1 - i);
+  }
+  pool->num_free = opts->max_tasks;
+  for (int i = 0; i < n; i++) {
+    pool->pidfds[i] = -1;
+  }
+  atomic_init(&pool->closing, 0);
+  pool->started = 0;
+
+  pool->wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (pool->wake_fd < 0) {
+    free(pool->free_slots);
+    free(pool->pidfds);
+    munmap(region, size);
+    return PROC_POOL_SHM_ERR;
+  }
+  pthread_mutex_init(&pool->slots_lock, NULL);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->started_cond, NULL);
+
+  if (pthread_create(&pool->supervisor, NULL,
+                     (void *(*)(void *)) & supervise, (void *)pool) != 0) {
+    release_resources(pool);
+    return PROC_POOL_THREAD_ERR;
+  }
+  pthread_mutex_lock(&pool->lock);
+  while (pool->started == 0) {
+    pthread_cond_wait(&pool->started_cond, &pool->lock);
+  }
+  int started = pool->started;
+  pthread_mutex_unlock(&pool->lock);
+  if (started < 0) {
+    stop_workers(pool, FALSE);
+    release_resources(pool);
+    return PROC_POOL_SPAWN_ERR;
+  }
+  return PROC_POOL_SUCCESS;
+}
+
+void proc_pool_wait_idle(ProcPool *pool) {
+  ProcShared *shared = pool->shared;
+  while (1) {
+    // read before counting, a task finishing after the count bumps it
+    unsigned int seq = atomic_load(&shared->finish_seq);
+    if (pending_tasks(pool) == 0) {
+      return;
+    }
+    atomic_fetch_add(&shared->idle_waiters, 1);
+    futex_wait_shared(&shared->finish_seq, seq, NULL);
+    atomic_fetch_sub(&shared->idle_waiters, 1);
+  }
+}
+
+void proc_pool_destroy(ProcPool *pool) {
+  atomic_store(&pool->closing, 1);
+  proc_pool_wait_idle(pool);
+  stop_workers(pool, TRUE);
+  release_resources(pool);
+}
+
+uint64_t proc_pool_crashes(ProcPool *pool) {
+  return atomic_load(&pool->shared->crashes);
+}
+
+void proc_new_task(ProcTask *task, ProcTaskFunc func, const void *args,
+                   size_t args_size, void *task_result, size_t result_size,
+                   bool_t is_fire_and_forget) {
+  task->func = func;
+  task->args_size = args_size;
+  if (args != NULL && args_size > 0) {
+    // a larger one is refused by proc_enqueue_task
+    memcpy(task->args, args,
+           args_size < PROC_POOL_ARGS_SIZE ? args_size : PROC_POOL_ARGS_SIZE);
+  }
+  task->is_fire_and_forget = is_fire_and_forget;
+  task->task_result = is_fire_and_forget ? NULL : task_result;
+  task->result_size = is_fire_and_forget ? 0 : result_size;
+  task->pool = NULL;
+  task->slot = PROC_NO_SLOT;
+  task->gen = 0;
+}
+
+ProcEnqueueResult proc_enqueue_task(ProcPool *pool, ProcTask *task) {
+  if (task->args_size > PROC_POOL_ARGS_SIZE ||
+      task->result_size > PROC_POOL_RESULT_SIZE) {
+    return PROC_ENQUEUE_TOO_LARGE;
+  }
+  if (atomic_load(&pool->closing)) {
+    return PROC_ENQUEUE_SHUTTING_DOWN;
+  }
+
+  ProcTaskEntry entry;
+  entry.func = task->func;
+  entry.args_size = (uint32_t)task->args_size;
+  memcpy(entry.args, task->args, task->args_size);
+  entry.slot = PROC_NO_SLOT;
+  entry.gen = 0;
+  if (!task->is_fire_and_forget) {
+    pthread_mutex_lock(&pool->slots_lock);
+    if (pool->num_free == 0) {
+      pthread_mutex_unlock(&pool->slots_lock);
+      return PROC_ENQUEUE_NO_SLOT;
+    }
+    entry.slot = pool->free_slots[--pool->num_free];
+    pthread_mutex_unlock(&pool->slots_lock);
+
+    // a new generation, whatever still refers to the last one is ignored
+    ProcResultSlot *slot = &pool->slots[entry.slot];
+    entry.gen = (atomic_load(&slot->state) >> STATUS_BITS) + 1;
+    atomic_store(&slot->state, entry.gen << STATUS_BITS | PROC_STATUS_PENDING);
+  }
+  task->pool = pool;
+  task->slot = entry.slot;
+  task->gen = entry.gen;
+
+  ProcShared *shared = pool->shared;
+  atomic_fetch_add(&shared->enqueued, 1);
+  fsem_wait(&shared->empty);
+  // the token guarantees a slot, its last consumer may still be copying out
+  while (!mpmc_ring_try_push(&shared->ring, &entry)) {
+    CPU_RELAX();
+  }
+  fsem_post(&shared->added);
+  return PROC_ENQUEUE_SUCCESS;
+}
+
+ProcAwaitResult proc_await_task(ProcTask *task) {
+  if (task->is_fire_and_forget || task->pool == NULL) {
+    return PROC_TASK_DONE;
+  }
+  ProcResultSlot *slot = &task->pool->slots[task->slot];
+  unsigned int pending = task->gen << STATUS_BITS | PROC_STATUS_PENDING;
+  unsigned int state;
+  while ((state = atomic_load(&slot->state)) == pending) {
+    atomic_fetch_add(&slot->waiters, 1);
+    futex_wait_shared(&slot->state, pending, NULL);
+    atomic_fetch_sub(&slot->waiters, 1);
+  }
+  if ((state & STATUS_MASK) == PROC_STATUS_CRASHED) {
+    return PROC_TASK_CRASHED;
+  }
+  if (task->task_result != NULL) {
+    memcpy(task->task_result, slot->result, task->result_size);
+  }
+  return PROC_TASK_DONE;
+}
+
+void proc_destroy_task(ProcTask *task) {
+  if (task->is_fire_and_forget || task->pool == NULL) {
+    return;
+  }
+  ProcPool *pool = task->pool;
+  pthread_mutex_lock(&pool->slots_lock);
+  pool->free_slots[pool->num_free++] = task->slot;
+  pthread_mutex_unlock(&pool->slots_lock);
+  task->pool = NULL;
+}
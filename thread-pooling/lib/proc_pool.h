@@ -0,0 +1,181 @@
+#ifndef PROC_POOL
+#define PROC_POOL
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "atomics.h"
+#include "fsem.h"
+#include "mpmc_ring.h"
+#include "threadpool.h"
+
+// task arguments and results are copied through shared memory, by value
+#define PROC_POOL_ARGS_SIZE 256
+#define PROC_POOL_RESULT_SIZE 256
+
+// default number of tasks that may be enqueued and not destroyed at once
+#define PROC_POOL_MAX_TASKS 1024
+
+// result slot of a fire and forget task
+#define PROC_NO_SLOT UINT32_MAX
+
+// Runs in a worker process. args is a copy of what was given to
+// proc_new_task, result is PROC_POOL_RESULT_SIZE bytes, NULL for fire and
+// forget tasks. Nothing else of the parent is shared, pointers into its
+// memory only show what it held when the worker was forked
+typedef void (*ProcTaskFunc)(void *args, void *result);
+
+// what travels through the task ring
+typedef struct {
+  ProcTaskFunc func;
+  uint32_t slot; // PROC_NO_SLOT for fire and forget tasks
+  uint32_t gen;  // generation of the slot this task owns
+  uint32_t args_size;
+  unsigned char args[PROC_POOL_ARGS_SIZE];
+} ProcTaskEntry;
+
+// where an awaitable task's worker leaves its result. state packs the slot's
+// generation above the task's status and is the futex word awaiters sleep
+// on, so a late signal for an earlier task in the same slot cannot match
+typedef struct {
+  TP_ALIGNAS(CACHE_LINE_SIZE) atomic_uint state;
+  atomic_uint waiters;
+  unsigned char result[PROC_POOL_RESULT_SIZE];
+} ProcResultSlot;
+
+// a worker process, as the parent's supervisor and the worker itself see it
+typedef struct {
+  TP_ALIGNAS(CACHE_LINE_SIZE) atomic_int pid;
+  // tasks the slot finished, crashed ones included, above the phase the
+  // current one is in. One word, so wherever a worker is killed the
+  // supervisor finds out what it held and settles it exactly once
+  atomic_uint_least64_t state;
+  atomic_uint_least64_t tasks_executed;
+  atomic_size_t claim; // ring position it is taking while claiming
+  ProcTaskEntry entry; // the task taken from the ring, func NULL before
+} ProcWorkerRecord;
+
+// the head of the shared mapping, worker records, result slots and the
+// ring's slots follow it
+typedef struct {
+  MpmcRing ring; // of ProcTaskEntry
+  FutexSem empty; // free ring slots
+  FutexSem added; // queued tasks, plus one per worker at shutdown
+  // tasks ever enqueued. Less what the workers finished, it is what is
+  // pending
+  TP_ALIGNAS(CACHE_LINE_SIZE) atomic_uint_least64_t enqueued;
+  // bumped whenever tasks finished, the futex word of proc_pool_wait_idle
+  atomic_uint finish_seq;
+  atomic_uint idle_waiters;
+  atomic_int stopping; // workers exit instead of taking another task
+  atomic_uint_least64_t crashes;
+} ProcShared;
+
+typedef struct {
+  int num_workers;
+  size_t queue_capacity; // slots in the task ring
+  size_t max_tasks;      // awaitable tasks enqueued and not destroyed
+} ProcPoolOptions;
+
+/*
+ * Prefork pool of worker processes with the thread pool's task API. The
+ * task ring, result slots and semaphores live in one memfd mapping that the
+ * workers inherit, and wakeups are process shared futexes, so a task costs
+ * no pipe or socket round trip. A worker that dies, say of a crashing
+ * plugin, takes only its task down: the supervisor thread sees it exit,
+ * fails that task with PROC_TASK_CRASHED and forks a replacement. One
+ * killed before it took its next task off the ring leaves it queued.
+ * Workers are forked by the supervisor, after anything their tasks need
+ * is loaded, and die with it if the parent goes away.
+ */
+typedef struct {
+  int num_workers;
+  size_t max_tasks;
+  void *region; // the shared mapping
+  size_t region_size;
+  ProcShared *shared;
+  ProcWorkerRecord *workers;
+  ProcResultSlot *slots;
+
+  // free result slots, parent only
+  pthread_mutex_t slots_lock;
+  uint32_t *free_slots;
+  size_t num_free;
+  atomic_int closing; // proc_enqueue_task fails from here on
+
+  // supervisor thread, polls a pidfd per worker and wake_fd. lock keeps
+  // respawns and shutdown apart
+  pthread_t supervisor;
+  pthread_mutex_t lock;
+  pthread_cond_t started_cond;
+  int started; // 1 once the first workers are up, -1 if that failed
+  int wake_fd;
+  int *pidfds;
+} ProcPool;
+
+typedef struct {
+  ProcTaskFunc func;
+  unsigned char args[PROC_POOL_ARGS_SIZE];
+  size_t args_size;
+  void *task_result; // the result is copied here by proc_await_task
+  size_t result_size;
+  bool_t is_fire_and_forget;
+  // set by proc_enqueue_task
+  ProcPool *pool;
+  uint32_t slot;
+  uint32_t gen;
+} ProcTask;
+
+typedef enum {
+  PROC_POOL_SUCCESS = 0,
+  PROC_POOL_INVALID_OPTIONS = -1,
+  PROC_POOL_SHM_ERR = -2,    // the shared mapping could not be made
+  PROC_POOL_SPAWN_ERR = -3,  // fork or pidfd_open failed
+  PROC_POOL_THREAD_ERR = -4, // the supervisor could not start
+  PROC_POOL_MEMORY_ERR = -5,
+} ProcPoolResult;
+
+typedef enum {
+  PROC_ENQUEUE_SUCCESS = 0,
+  PROC_ENQUEUE_TOO_LARGE = -1, // args or result beyond PROC_POOL_*_SIZE
+  PROC_ENQUEUE_NO_SLOT = -2,   // max_tasks awaitable tasks not destroyed
+  PROC_ENQUEUE_SHUTTING_DOWN = -3,
+} ProcEnqueueResult;
+
+typedef enum {
+  PROC_TASK_DONE = 0,
+  PROC_TASK_CRASHED = -1, // its worker died running it, no result
+} ProcAwaitResult;
+
+void proc_pool_default_options(ProcPoolOptions *opts, int num_workers);
+
+ProcPoolResult proc_pool_init(ProcPool *pool, const ProcPoolOptions *opts);
+
+// runs every queued task, then stops the workers and the supervisor
+void proc_pool_destroy(ProcPool *pool);
+
+// blocks until every enqueued task finished or crashed
+void proc_pool_wait_idle(ProcPool *pool);
+
+// worker processes that died so far, each replaced by a new one
+uint64_t proc_pool_crashes(ProcPool *pool);
+
+// copies args_size bytes of args into the task
+void proc_new_task(ProcTask *task, ProcTaskFunc func, const void *args,
+                   size_t args_size, void *task_result, size_t result_size,
+                   bool_t is_fire_and_forget);
+
+// Blocks while the ring is full. An awaitable task takes a result slot
+// until proc_destroy_task
+ProcEnqueueResult proc_enqueue_task(ProcPool *pool, ProcTask *task);
+
+// blocks till the task finished and copies its result out, or till its
+// worker died
+ProcAwaitResult proc_await_task(ProcTask *task);
+
+// gives an awaited task's result slot back
+void proc_destroy_task(ProcTask *task);
+
+#endif
@@ -0,0 +1,249 @@
+#include "task_graph.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// nodes are allocated this many at a time so their addresses never move
+#define GRAPH_CHUNK_SIZE 64
+
+typedef struct __graph_chunk {
+  struct __graph_chunk *next;
+  size_t used;
+  GraphTask nodes[GRAPH_CHUNK_SIZE];
+} GraphChunk;
+
+static void run_graph_task(GraphTask *node, void *unused);
+
+void task_graph_init(TaskGraph *graph) {
+  graph->pool = NULL;
+  graph->chunks = NULL;
+  graph->num_tasks = 0;
+  atomic_init(&graph->remaining, 0);
+  graph->done = NULL;
+}
+
+GraphTask *task_graph_add(TaskGraph *graph, Task task) {
+  GraphChunk *chunk = graph->chunks;
+  if (chunk == NULL || chunk->used == GRAPH_CHUNK_SIZE) {
+    chunk = (GraphChunk *)malloc(sizeof(GraphChunk));
+    if (chunk == NULL) {
+      return NULL;
+    }
+    chunk->used = 0;
+    chunk->next = graph->chunks;
+    graph->chunks = chunk;
+  }
+
+  GraphTask *node = &chunk->nodes[chunk->used++];
+  node->task = task;
+  node->graph = graph;
+  node->num_predecessors = 0;
+  atomic_init(&node->waiting_for, 0);
+  node->successors = NULL;
+  node->num_successors = 0;
+  node->successors_capacity = 0;
+  graph->num_tasks++;
+  return node;
+}
+
+TaskGraphResult task_then(GraphTask *before, GraphTask *after) {
+  if (before->num_successors == before->successors_capacity) {
+    size_t capacity =
+        before->successors_capacity == 0 ? 4 : before->successors_capacity * 2;
+    GraphTask **successors = (GraphTask **)realloc(
+        before->successors, sizeof(GraphTask *) * capacity);
+    if (successors == NULL) {
+      return TASK_GRAPH_MEMORY_ERR;
+    }
+    before->successors = successors;
+    before->successors_capacity = capacity;
+  }
+  before->successors[before->num_successors++] = after;
+  after->num_predecessors++;
+  return TASK_GRAPH_SUCCESS;
+}
+
+// the pool side Task that runs a node
+static Task node_task(GraphTask *node) {
+  Task task;
+  new_task(&task, (UserDefFunc_t)&run_graph_task, node, NULL, 0, TRUE);
+  task.priority = node->task.priority;
+  return task;
+}
+
+/*
+ * Runs a node, then releases its successors. The first successor this made
+ * ready runs right here, on data the node just left in cache, the others
+ * are enqueued, which from a worker means its own deque where idle workers
+ * can steal them.
+ * A node whose token was cancelled is skipped like any cancelled task, it
+ * still counts as finished for its successors.
+ */
+static void run_graph_task(GraphTask *node, void *unused) {
+  while (node != NULL) {
+    TaskGraph *graph = node->graph;
+    Task *task = &node->task;
+    if (task->cancel != NULL && cancel_token_is_cancelled(task->cancel)) {
+      if (task->on_drop != NULL) {
+        task->on_drop(task->args);
+      }
+      if (task->task_awaiter != NULL) {
+        completion_cancel(task->task_awaiter);
+      }
+    } else {
+      // each node gives its scratch memory back, not just the last one run
+      // inline here. Found before running, the node may resume elsewhere
+      Arena *scratch = thread_pool_scratch();
+      ArenaMark mark;
+      if (scratch != NULL) {
+        mark = arena_mark(scratch);
+      }
+      task->func(task->args, task->task_result);
+      if (scratch != NULL) {
+        arena_rewind(scratch, mark);
+      }
+      if (task->task_awaiter != NULL) {
+        completion_signal(task->task_awaiter);
+      }
+    }
+
+    GraphTask *next = NULL;
+    for (size_t i = 0; i < node->num_successors; i++) {
+      GraphTask *successor = node->successors[i];
+      if (atomic_fetch_sub(&successor->waiting_for, 1) != 1) {
+        continue;
+      }
+      if (next == NULL) {
+        next = successor;
+        continue;
+      }
+      if (enqueue_task(graph->pool, node_task(successor)).resp_code !=
+          ENQUEUE_TASK_SUCCESS) {
+        // the pool would not take it, run it here rather than lose it
+        run_graph_task(successor, NULL);
+      }
+    }
+
+    // next, if any, is not finished, so the graph stays alive past this
+    TaskCompletion *done = graph->done;
+    if (atomic_fetch_sub(&graph->remaining, 1) == 1) {
+      completion_signal(done);
+    }
+    node = next;
+  }
+}
+
+// Kahn's algorithm over the graph. Fills order with every node, the ones
+// without predecessors first, and returns how many of those there are, or
+// -1 if some nodes sit on a cycle
+static long topological_order(TaskGraph *graph, GraphTask **order) {
+  size_t tail = 0;
+  for (GraphChunk *chunk = graph->chunks; chunk != NULL; chunk = chunk->next) {
+    for (size_t i = 0; i < chunk->used; i++) {
+      GraphTask *node = &chunk->nodes[i];
+      atomic_store_explicit(&node->waiting_for, node->num_predecessors,
+                            memory_order_relaxed);
+      if (node->num_predecessors == 0) {
+        order[tail++] = node;
+      }
+    }
+  }
+
+  long roots = (long)tail;
+  for (size_t head = 0; head < tail; head++) {
+    GraphTask *node = order[head];
+    for (size_t i = 0; i < node->num_successors; i++) {
+      GraphTask *successor = node->successors[i];
+      if (atomic_fetch_sub_explicit(&successor->waiting_for, 1,
+                                    memory_order_relaxed) == 1) {
+        order[tail++] = successor;
+      }
+    }
+  }
+  return tail == graph->num_tasks ? roots : -1;
+}
+
+TaskGraphResult task_graph_submit(ThreadPool *pool, TaskGraph *graph) {
+  if (graph->num_tasks == 0) {
+    return TASK_GRAPH_SUCCESS;
+  }
+
+  GraphTask **order =
+      (GraphTask **)malloc(sizeof(GraphTask *) * graph->num_tasks);
+  if (order == NULL) {
+    return TASK_GRAPH_MEMORY_ERR;
+  }
+  long roots = topological_order(graph, order);
+  if (roots < 0) {
+    free(order);
+    return TASK_GRAPH_CYCLE;
+  }
+
+  Task *tasks = (Task *)malloc(sizeof(Task) * (size_t)roots);
+  graph->done = completion_acquire();
+  if (tasks == NULL || graph->done == NULL) {
+    free(order);
+    free(tasks);
+    if (graph->done != NULL) {
+      completion_release(graph->done);
+      graph->done = NULL;
+    }
+    return TASK_GRAPH_MEMORY_ERR;
+  }
+
+  // the ordering pass used up the counts, arm them for the real run
+  for (size_t i = 0; i < graph->num_tasks; i++) {
+    atomic_store_explicit(&order[i]->waiting_for, order[i]->num_predecessors,
+                          memory_order_relaxed);
+  }
+  for (long i = 0; i < roots; i++) {
+    tasks[i] = node_task(order[i]);
+  }
+  graph->pool = pool;
+  atomic_store(&graph->remaining, graph->num_tasks);
+
+  // all the roots go in as one batch, the release ordering of the enqueue
+  // publishes the counts set above to whichever worker runs them
+  TaskGraphResult res = TASK_GRAPH_SUCCESS;
+  if (enqueue_tasks(pool, tasks, (size_t)roots).resp_code !=
+      ENQUEUE_TASK_SUCCESS) {
+    completion_release(graph->done);
+    graph->done = NULL;
+    res = TASK_GRAPH_REJECTED;
+  }
+  free(tasks);
+  free(order);
+  return res;
+}
+
+void task_graph_wait(TaskGraph *graph) {
+  if (graph->done == NULL) {
+    return;
+  }
+  // same as parallel_for, a worker waiting here helps instead of parking
+  bool_t is_worker = thread_pool_is_worker_thread(graph->pool);
+  while (!completion_is_done(graph->done)) {
+    if (is_worker && thread_pool_run_pending_task(graph->pool)) {
+      continue;
+    }
+    completion_wait(graph->done);
+  }
+  completion_release(graph->done);
+  graph->done = NULL;
+}
+
+void task_graph_destroy(TaskGraph *graph) {
+  GraphChunk *chunk = graph->chunks;
+  while (chunk != NULL) {
+    GraphChunk *next = chunk->next;
+    for (size_t i = 0; i < chunk->used; i++) {
+      free(chunk->nodes[i].successors);
+    }
+    free(chunk);
+    chunk = next;
+  }
+  graph->chunks = NULL;
+  graph->num_tasks = 0;
+}
@@ -0,0 +1,70 @@
+#ifndef TASK_GRAPH
+#define TASK_GRAPH
+
+#include <stddef.h>
+
+#include "atomics.h"
+#include "completion.h"
+#include "threadpool.h"
+
+struct __task_graph;
+struct __graph_chunk;
+
+// A task inside a graph. Nodes are owned by their graph and keep their
+// address until it is destroyed
+typedef struct __graph_task {
+  Task task;
+  struct __task_graph *graph;
+  unsigned int num_predecessors;  // edges into this node
+  atomic_uint waiting_for;        // predecessors not finished yet, per run
+  struct __graph_task **successors;
+  size_t num_successors;
+  size_t successors_capacity;
+} GraphTask;
+
+/*
+ * Builder for a set of tasks with dependencies between them. Add tasks with
+ * task_graph_add, order them with task_then and submit the whole graph at
+ * once. Only the tasks without predecessors are enqueued up front, every
+ * other one is released by the last of its predecessors to finish, and the
+ * worker that releases it runs the first one inline, no thread ever blocks
+ * between stages.
+ * A graph can be submitted again once task_graph_wait returned.
+ */
+typedef struct __task_graph {
+  ThreadPool *pool;
+  struct __graph_chunk *chunks; // arena the nodes live in, newest first
+  size_t num_tasks;
+  atomic_size_t remaining; // tasks of the current run not finished yet
+  TaskCompletion *done;
+} TaskGraph;
+
+typedef enum {
+  TASK_GRAPH_SUCCESS = 0,
+  TASK_GRAPH_MEMORY_ERR = -1,
+  TASK_GRAPH_CYCLE = -2,    // the dependencies loop, nothing was submitted
+  TASK_GRAPH_REJECTED = -3, // the pool would not take the first tasks
+} TaskGraphResult;
+
+void task_graph_init(TaskGraph *graph);
+
+// copies task into the graph, returns its node or NULL if out of memory.
+// The task keeps its awaiter, so await_task on the caller's copy works too,
+// and its cancel token, a cancelled node is skipped but still releases its
+// successors
+GraphTask *task_graph_add(TaskGraph *graph, Task task);
+
+// after may only start once before has finished, both from the same graph
+TaskGraphResult task_then(GraphTask *before, GraphTask *after);
+
+// checks the graph has no cycle and enqueues the tasks nothing depends on
+TaskGraphResult task_graph_submit(ThreadPool *pool, TaskGraph *graph);
+
+// blocks until every task of a submitted graph has finished. On one of the
+// pool's workers it runs other queued work meanwhile
+void task_graph_wait(TaskGraph *graph);
+
+// frees the nodes, the graph must not be running
+void task_graph_destroy(TaskGraph *graph);
+
+#endif
@@ -1,12 +1,20 @@
+#define _GNU_SOURCE
 #include "threadpool.h"
+#include "fiber.h"
+#include "futex.h"
+#include "topology.h"
 
+#include <inttypes.h>
+#include <limits.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <uuid/uuid.h>
 #include <string.h>
 
 #define RET_ON_FAIL(expr, resp)                                                \
@@ -31,18 +39,323 @@ pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
   pthread_mutex_unlock(&log_mutex);
 #endif
 
-static void *worker_runner(ThreadPool *thread_pool);
+// how many task searches a worker does between forced looks at the shared
+// channel, so external producers are not starved by recursive local work
+#define GLOBAL_QUEUE_INTERVAL 61
+
+// idle worker parking and elastic sizing, see ThreadPoolOptions
+#define DEFAULT_SPIN_COUNT 256
+#define DEFAULT_YIELD_COUNT 2
+#define DEFAULT_IDLE_TIMEOUT_MS 1000
+#define DEFAULT_GROW_DELAY_US 1000
+
+// who owns a worker slot
+#define WORKER_SLOT_IDLE 0    // nobody, never started or joined after retiring
+#define WORKER_SLOT_RUNNING 1 // a live worker thread
+#define WORKER_SLOT_EXITED 2  // retired, its thread still has to be joined
+
+// length of a timer wheel tick
+#define TIMER_TICK_NS 1000000L
+
+// what the timer wheel holds for every delayed or periodic task
+typedef struct {
+  Task task;
+  uint64_t period; // ticks, 0 for enqueue_task_after
+} ScheduledTask;
+
+// fiber mode, see ThreadPoolOptions
+#define DEFAULT_FIBER_STACK_SIZE (256 * 1024)
+#define FIBER_CACHE_SIZE 16 // finished fibers a worker keeps
+
+// chunk size of the scratch arenas, see ThreadPoolOptions
+#define DEFAULT_SCRATCH_SIZE (64 * 1024)
+
+// events each thread keeps when tracing, see ThreadPoolOptions
+#define DEFAULT_TRACE_BUFFER_SIZE 16384
+
+// a fiber of the pool and the task it runs, the fiber's data points here.
+// The task's scratch memory lives with the fiber, it outlives an await
+// while the worker runs other tasks on its own
+typedef struct {
+  Fiber fiber;
+  ThreadPool *pool;
+  Task task;
+  Arena scratch;
+} TaskFiber;
+
+// default lane scheduling, see ThreadPoolOptions
+#define DEFAULT_STARVATION_LIMIT 32
+#define DEFAULT_HIGH_WEIGHT 8
+#define DEFAULT_NORMAL_WEIGHT 4
+#define DEFAULT_LOW_WEIGHT 1
+
+static void *worker_runner(Worker *worker);
+static void destroy_timers(ThreadPool *thread_pool);
+static void drop_task(Task *task);
+static void maybe_grow(ThreadPool *pool);
+
+// set on worker threads so enqueue_task can tell a task spawned from inside a
+// running task apart from an external submission
+static __thread Worker *current_worker = NULL;
+
+static uint64_t monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+// clock for latency stats, the cycle counter where there is one since it
+// costs a few ns to read against tens for clock_gettime. thread_pool_stats
+// works out how long a tick is
+static inline uint64_t stats_now() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return monotonic_ns();
+#endif
+}
+
+// Tracing, see ThreadPoolOptions. Events go to the calling thread's own
+// buffer, worker threads are named by their slot in the trace
+static inline uint64_t trace_clock(ThreadPool *pool) {
+  return pool->trace ? trace_now(&pool->tracer) : 0;
+}
+
+static TraceBuffer *trace_buffer(ThreadPool *pool) {
+  int worker = current_worker != NULL && current_worker->pool == pool
+                   ? current_worker->index
+                   : -1;
+  return tracer_buffer(&pool->tracer, worker);
+}
+
+static void trace_event(ThreadPool *pool, TraceEventType type,
+                        uint64_t task_id) {
+  if (!pool->trace) {
+    return;
+  }
+  TraceBuffer *buffer = trace_buffer(pool);
+  if (buffer != NULL) {
+    trace_record(buffer, trace_now(&pool->tracer), type, task_id);
+  }
+}
+
+// the same event for n tasks at once, at is a trace_clock reading
+static void trace_tasks(ThreadPool *pool, TraceEventType type, Task *tasks,
+                        size_t n, uint64_t at) {
+  if (!pool->trace || n == 0) {
+    return;
+  }
+  TraceBuffer *buffer = trace_buffer(pool);
+  if (buffer == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < n; i++) {
+    trace_record(buffer, at, type, tasks[i].id);
+  }
+}
+
+// one more on a counter only the calling worker writes
+static inline void counter_inc(atomic_uint_least64_t *counter) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+}
+
+void thread_pool_default_options(ThreadPoolOptions *opts, int num_threads) {
+  opts->num_threads = num_threads;
+  opts->max_threads = num_threads;
+  opts->idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS;
+  opts->grow_delay_us = DEFAULT_GROW_DELAY_US;
+  opts->max_blocking_threads = 0;
+  // polling only pays off when another cpu can post while we poll
+  opts->spin_count = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? DEFAULT_SPIN_COUNT : 0;
+  opts->yield_count = DEFAULT_YIELD_COUNT;
+  opts->queue_capacity = MAX_BUFFER;
+  opts->overflow_policy = OVERFLOW_POLICY_BLOCK;
+  opts->lane_policy = LANE_POLICY_STRICT;
+  opts->lane_weights[TASK_PRIORITY_HIGH] = DEFAULT_HIGH_WEIGHT;
+  opts->lane_weights[TASK_PRIORITY_NORMAL] = DEFAULT_NORMAL_WEIGHT;
+  opts->lane_weights[TASK_PRIORITY_LOW] = DEFAULT_LOW_WEIGHT;
+  opts->starvation_limit = DEFAULT_STARVATION_LIMIT;
+  opts->affinity = AFFINITY_NONE;
+  opts->cpus = NULL;
+  opts->num_cpus = 0;
+  opts->latency_stats = FALSE;
+  opts->trace = FALSE;
+  opts->trace_buffer_size = DEFAULT_TRACE_BUFFER_SIZE;
+  opts->fibers = FALSE;
+  opts->fiber_stack_size = DEFAULT_FIBER_STACK_SIZE;
+  opts->scratch_size = DEFAULT_SCRATCH_SIZE;
+  opts->worker_init = NULL;
+  opts->worker_exit = NULL;
+  opts->worker_arg = NULL;
+}
+
+// the cpus workers are pinned to, worker i gets cpus[i % count]. Returns
+// count, 0 if workers are not pinned, -1 if the options name no usable cpu
+static int worker_placement(const ThreadPoolOptions *opts, int *cpus,
+                            int max) {
+  if (opts->affinity == AFFINITY_PHYSICAL_CORES) {
+    int count = topology_physical_cores(cpus, max);
+    return count > 0 ? (count < max ? count : max) : -1;
+  }
+  if (opts->affinity != AFFINITY_CPU_LIST) {
+    return 0;
+  }
+
+  if (opts->cpus == NULL || opts->num_cpus == 0 ||
+      opts->num_cpus > (size_t)max) {
+    return -1;
+  }
+  for (size_t i = 0; i < opts->num_cpus; i++) {
+    CpuInfo info;
+    if (topology_cpu_info(opts->cpus[i], &info) != 0) {
+      return -1;
+    }
+    cpus[i] = opts->cpus[i];
+  }
+  return (int)opts->num_cpus;
+}
+
+// victims for every worker, the ones behind the same last level cache first
+// since what they queued was most likely produced by a cache we share
+static void build_steal_orders(ThreadPool *thread_pool) {
+  int n = thread_pool->num_threads;
+  for (int i = 0; i < n; i++) {
+    Worker *self = &thread_pool->worker_states[i];
+    int count = 0;
+    for (int j = 0; j < n; j++) {
+      if (j != i && thread_pool->worker_states[j].llc == self->llc) {
+        self->victims[count++] = j;
+      }
+    }
+    self->num_near = count;
+    for (int j = 0; j < n; j++) {
+      if (thread_pool->worker_states[j].llc != self->llc) {
+        self->victims[count++] = j;
+      }
+    }
+  }
+}
+
+static void destroy_lanes(ThreadPool *thread_pool, int num_lanes) {
+  for (int i = 0; i < num_lanes; i++) {
+    mpmc_ring_destroy(&thread_pool->lanes[i]);
+  }
+}
+
+// start a thread for worker slot index, pinned to the slot's cpu if it has
+// one so it never runs anywhere else. Returns 0 on success
+static int start_worker(ThreadPool *thread_pool, int index) {
+  Worker *worker = &thread_pool->worker_states[index];
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (worker->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+  }
+
+  atomic_store(&worker->state, WORKER_SLOT_RUNNING);
+  atomic_fetch_add(&thread_pool->active_threads, 1);
+  int created = pthread_create(&thread_pool->workers[index], &attr,
+                               (void *(*)(void *)) & worker_runner,
+                               (void *)worker);
+  pthread_attr_destroy(&attr);
+  if (created != 0) {
+    atomic_fetch_sub(&thread_pool->active_threads, 1);
+    atomic_store(&worker->state, WORKER_SLOT_IDLE);
+  }
+  return created;
+}
 
 // given a thread pool data obj pointer and num of threads
 // intiailize a set of worker threads and store their metadata in
 // obj pointer fields. Return 0 if successful else an Error Code enum
 InitThreadPoolResult init_thread_pool(ThreadPool *thread_pool,
                                       int num_threads) {
-  if (num_threads < 1) {
+  ThreadPoolOptions opts;
+  thread_pool_default_options(&opts, num_threads);
+  return init_thread_pool_with_options(thread_pool, &opts);
+}
+
+// same as init_thread_pool, but with the channel capacity and overflow
+// behaviour chosen by the caller
+InitThreadPoolResult
+init_thread_pool_with_options(ThreadPool *thread_pool,
+                              const ThreadPoolOptions *opts) {
+  int min_threads = opts->num_threads;
+  // every slot a worker may ever use is set up front, only the first
+  // min_threads get a thread right away. 0 means a fixed size pool
+  int max_threads = opts->max_threads == 0 ? min_threads : opts->max_threads;
+  if (min_threads < 1 || max_threads < min_threads ||
+      opts->max_blocking_threads < 0) {
     return INIT_THREAD_POOL_INVALID_NUM_THREADS;
   }
+  // compensating workers get slots of their own, past the elastic ones
+  int num_threads = max_threads + opts->max_blocking_threads;
+  // semaphore counts are unsigned ints
+  if (opts->queue_capacity < 1 || opts->queue_capacity > INT_MAX) {
+    return INIT_THREAD_POOL_INVALID_CAPACITY;
+  }
+
+  unsigned int weight_total = 0;
+  for (int i = 0; i < NUM_TASK_PRIORITIES; i++) {
+    weight_total += opts->lane_weights[i];
+  }
+  if (opts->lane_policy == LANE_POLICY_WEIGHTED && weight_total == 0) {
+    return INIT_THREAD_POOL_INVALID_OPTIONS;
+  }
+  if (opts->trace && opts->trace_buffer_size == 0) {
+    return INIT_THREAD_POOL_INVALID_OPTIONS;
+  }
+
+  int placement[CPU_SETSIZE];
+  int num_placed = worker_placement(opts, placement, CPU_SETSIZE);
+  if (num_placed < 0) {
+    return INIT_THREAD_POOL_INVALID_OPTIONS;
+  }
+
+  // warm the completion slab so a full channel worth of awaitable tasks can
+  // be created without allocating
+  completion_reserve(opts->queue_capacity);
 
   thread_pool->num_threads = num_threads;
+  thread_pool->min_threads = min_threads;
+  thread_pool->max_threads = max_threads;
+  thread_pool->spin_count = opts->spin_count;
+  thread_pool->yield_count = opts->yield_count;
+  thread_pool->idle_timeout_ns = (uint64_t)opts->idle_timeout_ms * 1000000;
+  thread_pool->grow_delay_ns = (uint64_t)opts->grow_delay_us * 1000;
+  atomic_init(&thread_pool->active_threads, 0);
+  atomic_init(&thread_pool->blocked_threads, 0);
+  atomic_init(&thread_pool->backlog_since, 0);
+  thread_pool->latency_stats = opts->latency_stats;
+  thread_pool->stats_epoch_ticks = stats_now();
+  thread_pool->stats_epoch_ns = monotonic_ns();
+  atomic_init(&thread_pool->queue_full_stalls, 0);
+  thread_pool->trace = opts->trace;
+  thread_pool->queue_capacity = opts->queue_capacity;
+  thread_pool->overflow_policy = opts->overflow_policy;
+  thread_pool->lane_policy = opts->lane_policy;
+  for (int i = 0; i < NUM_TASK_PRIORITIES; i++) {
+    thread_pool->lane_weights[i] = opts->lane_weights[i];
+  }
+  thread_pool->lane_weight_total = weight_total;
+  thread_pool->starvation_limit = opts->starvation_limit;
+  thread_pool->fibers = opts->fibers;
+  thread_pool->fiber_stack_size = opts->fiber_stack_size > 0
+                                      ? opts->fiber_stack_size
+                                      : DEFAULT_FIBER_STACK_SIZE;
+  thread_pool->ready_head = NULL;
+  thread_pool->ready_tail = NULL;
+  atomic_init(&thread_pool->num_ready, 0);
+  thread_pool->scratch_size =
+      opts->scratch_size > 0 ? opts->scratch_size : DEFAULT_SCRATCH_SIZE;
+  thread_pool->worker_init = opts->worker_init;
+  thread_pool->worker_exit = opts->worker_exit;
+  thread_pool->worker_arg = opts->worker_arg;
 
   /*
    * This sempahore is used by producer to check if the buffer
@@ -52,10 +365,11 @@ InitThreadPoolResult init_thread_pool(ThreadPool *thread_pool,
    * If at 0 this call will be blocked.
    * Our producer will make a call to wait on this buffer to make
    * sure that if the buffer is full and no consumer has picked up
-   * the task, the producer call will sit blocked, till a consumer picks it up
+   * the task, the producer call will sit blocked, till a consumer picks it up.
+   * Every priority lane has its own.
    */
-  if (sem_init(&thread_pool->empty, 0, MAX_BUFFER) != 0) {
-    return INIT_THREAD_POOL_SEM_ERR;
+  for (int i = 0; i < NUM_TASK_PRIORITIES; i++) {
+    fsem_init(&thread_pool->empty[i], (unsigned int)opts->queue_capacity);
   }
 
   /*
@@ -63,43 +377,174 @@ InitThreadPoolResult init_thread_pool(ThreadPool *thread_pool,
    * to be picked up. It starts at 0, and is incrmented by the producer,
    * and waited on by the consumer.
    * */
-  if (sem_init(&thread_pool->added, 0, 0) != 0) {
-    sem_destroy(&thread_pool->empty);
-    return INIT_THREAD_POOL_SEM_ERR;
-  }
+  fsem_init(&thread_pool->added, 0);
+
+  atomic_init(&thread_pool->pending, 0);
+  atomic_init(&thread_pool->idle_seq, 0);
+  atomic_init(&thread_pool->idle_waiters, 0);
+  atomic_init(&thread_pool->closing, 0);
+  atomic_init(&thread_pool->stopping, 0);
 
   /*
-   * This sempahore is a binary lock used to wrap the critical section
-   * of interacting with buffer channel data by producer and consumer
+   * The channel itself is one lock free ring per lane, the semaphores above
+   * only gate how many producers and consumers may be inside at once
    * */
-  if (sem_init(&thread_pool->mutex, 0, 1) != 0) {
-    sem_destroy(&thread_pool->empty);
-    sem_destroy(&thread_pool->added);
-    return INIT_THREAD_POOL_SEM_ERR;
+  // on failure whatever was set up so far is torn down in reverse, from the
+  // label matching the step that failed
+  InitThreadPoolResult result = INIT_THREAD_POOL_MEMORY_ERR;
+  int num_lanes = 0;
+  int num_deques = 0;
+  int num_started = 0;
+  for (; num_lanes < NUM_TASK_PRIORITIES; num_lanes++) {
+    if (mpmc_ring_init(&thread_pool->lanes[num_lanes], opts->queue_capacity,
+                       sizeof(Task)) != 0) {
+      goto free_lanes;
+    }
   }
 
-  thread_pool->buffer_fill = 0;
-  thread_pool->buffer_use = 0;
-
   thread_pool->workers = (pthread_t *)malloc(sizeof(pthread_t) * num_threads);
   if (thread_pool->workers == NULL) {
-    return INIT_THREAD_POOL_MEMORY_ERR;
+    goto free_lanes;
   }
 
+  // the victim lists live in the same block, right after the workers
+  thread_pool->worker_states = (Worker *)malloc(
+      (sizeof(Worker) + sizeof(int) * num_threads) * num_threads);
+  if (thread_pool->worker_states == NULL) {
+    goto free_workers;
+  }
+
+  // every deque must exist before any worker starts, since thieves look at
+  // all of them
   for (int i = 0; i < num_threads; i++) {
-    if (pthread_create(&thread_pool->workers[i], NULL,
-                       (void *(*)(void *)) & worker_runner,
-                       (void *)thread_pool) != 0) {
-      free(thread_pool->workers);
-      return INIT_THREAD_POOL_THREAD_CREATE_FAILED;
+    Worker *worker = &thread_pool->worker_states[i];
+    worker->pool = thread_pool;
+    worker->index = i;
+    worker->steal_seed = (unsigned int)i * 2654435761u + 1;
+    worker->tick = 0;
+    worker->lane_tick = 0;
+    worker->strict_streak = 0;
+    worker->cpu = num_placed > 0 ? placement[i % num_placed] : -1;
+    worker->llc = 0;
+    CpuInfo info;
+    if (worker->cpu >= 0 && topology_cpu_info(worker->cpu, &info) == 0) {
+      worker->llc = info.llc;
+    }
+    worker->victims =
+        (int *)(thread_pool->worker_states + num_threads) + i * num_threads;
+    atomic_init(&worker->state, WORKER_SLOT_IDLE);
+    atomic_init(&worker->counters.tasks_executed, 0);
+    atomic_init(&worker->counters.steals, 0);
+    atomic_init(&worker->counters.parks, 0);
+    atomic_init(&worker->counters.tasks_cancelled, 0);
+    histogram_init(&worker->counters.queue_wait);
+    histogram_init(&worker->counters.execution);
+    worker->free_fibers = NULL;
+    worker->num_free_fibers = 0;
+    arena_init(&worker->scratch, thread_pool->scratch_size);
+    worker->context = NULL;
+    if (ws_deque_init(&worker->deque, WORKER_DEQUE_SIZE, sizeof(Task)) != 0) {
+      goto free_deques;
+    }
+    num_deques++;
+  }
+
+  build_steal_orders(thread_pool);
+
+  // the timer thread itself only starts with the first timer
+  timer_wheel_init(&thread_pool->timers, sizeof(ScheduledTask));
+  thread_pool->timer_wake = UINT64_MAX;
+  thread_pool->timer_started = FALSE;
+  thread_pool->timer_stop = FALSE;
+  clock_gettime(CLOCK_MONOTONIC, &thread_pool->timer_epoch);
+  result = INIT_THREAD_POOL_RW_LOCK_ERR;
+  pthread_condattr_t cond_attr;
+  if (pthread_mutex_init(&thread_pool->timer_lock, NULL) != 0) {
+    goto free_wheel;
+  }
+  if (pthread_condattr_init(&cond_attr) != 0) {
+    goto free_timer_lock;
+  }
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  int cond_err = pthread_cond_init(&thread_pool->timer_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+  if (cond_err != 0) {
+    goto free_timer_lock;
+  }
+
+  if (pthread_mutex_init(&thread_pool->elastic_lock, NULL) != 0) {
+    goto free_timer_cond;
+  }
+  if (pthread_mutex_init(&thread_pool->ready_lock, NULL) != 0) {
+    goto free_elastic_lock;
+  }
+  // before the workers, they record from the start. Only fails for a size
+  // of 0, checked above
+  if (thread_pool->trace) {
+    tracer_init(&thread_pool->tracer, opts->trace_buffer_size);
+  }
+
+  for (; num_started < min_threads; num_started++) {
+    if (start_worker(thread_pool, num_started) != 0) {
+      result = INIT_THREAD_POOL_THREAD_CREATE_FAILED;
+      goto stop_workers;
     }
   }
 
   return INIT_THREAD_POOL_SUCCESS;
-};
+
+stop_workers:
+  // the workers already started are parked on added and use everything
+  // below, they have to be gone before any of it is freed. Nothing is
+  // queued, so the token each gets only tells it to leave
+  atomic_store(&thread_pool->stopping, 1);
+  fsem_post_n(&thread_pool->added, (unsigned int)num_started);
+  for (int i = 0; i < num_started; i++) {
+    pthread_join(thread_pool->workers[i], NULL);
+  }
+  if (thread_pool->trace) {
+    tracer_destroy(&thread_pool->tracer);
+  }
+  pthread_mutex_destroy(&thread_pool->ready_lock);
+free_elastic_lock:
+  pthread_mutex_destroy(&thread_pool->elastic_lock);
+free_timer_cond:
+  pthread_cond_destroy(&thread_pool->timer_cond);
+free_timer_lock:
+  pthread_mutex_destroy(&thread_pool->timer_lock);
+free_wheel:
+  timer_wheel_destroy(&thread_pool->timers);
+free_deques:
+  for (int i = 0; i < num_deques; i++) {
+    ws_deque_destroy(&thread_pool->worker_states[i].deque);
+  }
+  free(thread_pool->worker_states);
+free_workers:
+  free(thread_pool->workers);
+free_lanes:
+  destroy_lanes(thread_pool, num_lanes);
+  return result;
+}
+
+// Task ids are handed out in blocks so creating a task does not bounce a
+// shared counter between threads, ids are unique but only increase per thread
+#define TASK_ID_BLOCK 1024
+
+static atomic_uint_least64_t next_id_block = 1;
+static __thread uint64_t next_task_id = 0;
+static __thread uint64_t task_id_block_end = 0;
+
+static uint64_t take_task_id() {
+  if (next_task_id == task_id_block_end) {
+    next_task_id = atomic_fetch_add_explicit(&next_id_block, TASK_ID_BLOCK,
+                                             memory_order_relaxed);
+    task_id_block_end = next_task_id + TASK_ID_BLOCK;
+  }
+  return next_task_id++;
+}
 
 // ctor/initializer for new task
-void new_task(Task *task, UserDefFunc_t func, void *args, void *task_result, size_t result_size, bool_t is_fire_and_forget) {
+bool_t new_task(Task *task, UserDefFunc_t func, void *args, void *task_result, size_t result_size, bool_t is_fire_and_forget) {
   task->func = func;
   task->args = args;
   if (is_fire_and_forget) {
@@ -110,17 +555,20 @@ void new_task(Task *task, UserDefFunc_t func, void *args, void *task_result, siz
       task->result_size = result_size;
   }
 
-  uuid_t uuid;
-  uuid_generate(uuid);
-  uuid_unparse_lower(uuid, task->uuid_str);
+  task->id = take_task_id();
+  task->priority = TASK_PRIORITY_NORMAL;
+  task->submitted_at = 0;
+  task->cancel = NULL;
+  task->on_drop = NULL;
 
   if (is_fire_and_forget) {
       task->task_awaiter = NULL;
-  } else {
-  // start off awaiter semaphore with 0 so any calls to wait block the calling thread
-      task->task_awaiter = (sem_t *)malloc(sizeof(sem_t));
-      sem_init(task->task_awaiter, 0, 0);
+      return TRUE;
   }
+  // start off awaiter pending so any calls to wait block the calling thread,
+  // the slot comes pooled from the completion slab
+  task->task_awaiter = completion_acquire();
+  return task->task_awaiter != NULL;
 }
 
 // dtor
@@ -129,8 +577,36 @@ void destroy_task(Task *task) {
   if (task->task_awaiter == NULL) {
       return;
   }
-  sem_destroy(task->task_awaiter);
-  free(task->task_awaiter);
+  completion_release(task->task_awaiter);
+  task->task_awaiter = NULL;
+}
+
+void task_set_priority(Task *task, TaskPriority priority) {
+  task->priority = priority;
+}
+
+void task_set_cancel_token(Task *task, CancelToken *token) {
+  task->cancel = token;
+}
+
+void task_set_drop_hook(Task *task, TaskDropFunc_t on_drop) {
+  task->on_drop = on_drop;
+}
+
+bool_t task_set_completion_queue(Task *task, CompletionQueue *queue,
+                                 uint64_t tag) {
+  if (task->task_awaiter == NULL) {
+    return FALSE;
+  }
+  return completion_queue_bind(queue, task->task_awaiter, tag) == 0;
+}
+
+void cancel_token_init(CancelToken *token) {
+  atomic_init(&token->cancelled, 0);
+}
+
+void cancel_token_cancel(CancelToken *token) {
+  atomic_store_explicit(&token->cancelled, 1, memory_order_relaxed);
 }
 
 // blocks till the task is completed and result is
@@ -140,90 +616,1323 @@ void await_task(Task *task) {
   if (task->task_awaiter == NULL) {
       return;
   }
-  sem_wait(task->task_awaiter);
-  LOG("PRODUCER: Task %s completed \n", task->uuid_str)
+  completion_wait(task->task_awaiter);
+  LOG("PRODUCER: Task %" PRIu64 " completed \n", task->id)
+}
+
+// blocks till every task of a batch is completed
+void await_tasks(Task *tasks, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    await_task(&tasks[i]);
+  }
+}
+
+AwaitTaskResult await_task_timed(Task *task, const struct timespec *deadline) {
+  if (task->task_awaiter == NULL) {
+    return AWAIT_TASK_DONE;
+  }
+  if (completion_wait_until(task->task_awaiter, deadline) != 0) {
+    return AWAIT_TASK_TIMED_OUT;
+  }
+  if (atomic_load(&task->task_awaiter->state) == COMPLETION_CANCELLED) {
+    return AWAIT_TASK_CANCELLED;
+  }
+  return AWAIT_TASK_DONE;
 }
 
 // NOTE: For the utilities below I am completely okay with returning
 // the object by value since the object solely holds pointers, so the copy
 // on return is cheap.
 
-// utitlity to add task to buffer channel
-static void put(ThreadPool *pool, Task task) {
-  pool->buffer[pool->buffer_fill] = task;
-  pool->buffer_fill = (pool->buffer_fill + 1) % MAX_BUFFER;
+// utitlity to add tasks to a lane of the buffer channel, the caller must hold
+// n tokens from the lane's empty semaphore. Holding them means the slots are
+// free or about to be released by consumers that are mid pop, so spinning
+// here is short.
+static void put(ThreadPool *pool, int lane, Task *tasks, size_t n) {
+  while (!mpmc_ring_try_push_n(&pool->lanes[lane], tasks, n)) {
+    CPU_RELAX();
+  }
+}
+
+// utitlity to take a task from one lane of the shared channel without
+// waiting, frees up a slot for producers on success
+static bool_t take_lane(ThreadPool *pool, int lane, Task *out) {
+  if (!mpmc_ring_try_pop(&pool->lanes[lane], out)) {
+    return FALSE;
+  }
+  fsem_post(&pool->empty[lane]);
+  return TRUE;
+}
+
+// the order a worker should look at the lanes in this time round
+static void lane_order(ThreadPool *pool, Worker *self, bool_t full_look,
+                       int order[NUM_TASK_PRIORITIES]) {
+  for (int i = 0; i < NUM_TASK_PRIORITIES; i++) {
+    order[i] = i;
+  }
+  if (self == NULL) {
+    return;
+  }
+
+  if (pool->lane_policy == LANE_POLICY_WEIGHTED) {
+    // walk the weight schedule, its lane goes first and the rest follow by
+    // priority
+    unsigned int tick = self->lane_tick++ % pool->lane_weight_total;
+    int preferred = 0;
+    while (tick >= pool->lane_weights[preferred]) {
+      tick -= pool->lane_weights[preferred];
+      preferred++;
+    }
+    for (int i = preferred; i > 0; i--) {
+      order[i] = order[i - 1];
+    }
+    order[0] = preferred;
+    return;
+  }
+
+  // strict: lower lanes were passed over too often, give the lowest one
+  // waiting a turn
+  if (full_look && pool->starvation_limit > 0 &&
+      self->strict_streak >= pool->starvation_limit) {
+    for (int i = 0; i < NUM_TASK_PRIORITIES; i++) {
+      order[i] = NUM_TASK_PRIORITIES - 1 - i;
+    }
+    self->strict_streak = 0;
+  }
+}
+
+// utitlity to take a task from the shared channel following the pool's lane
+// policy, only lanes up to last_lane are considered
+static bool_t take_shared(ThreadPool *pool, Worker *self, int last_lane,
+                          Task *out) {
+  int order[NUM_TASK_PRIORITIES];
+  lane_order(pool, self, last_lane == NUM_TASK_PRIORITIES - 1, order);
+
+  for (int i = 0; i < NUM_TASK_PRIORITIES; i++) {
+    int lane = order[i];
+    if (lane > last_lane || !take_lane(pool, lane, out)) {
+      continue;
+    }
+
+    if (self != NULL && pool->lane_policy == LANE_POLICY_STRICT) {
+      bool_t skipped_lower = FALSE;
+      for (int lower = lane + 1; lower < NUM_TASK_PRIORITIES; lower++) {
+        skipped_lower |= mpmc_ring_size(&pool->lanes[lower]) > 0;
+      }
+      self->strict_streak = skipped_lower ? self->strict_streak + 1 : 0;
+    }
+    return TRUE;
+  }
+  return FALSE;
+}
+
+// try to steal from count victims, walking them from start round
+static bool_t steal_from(ThreadPool *pool, const int *victims, int count,
+                         int start, Task *out) {
+  for (int i = 0; i < count; i++) {
+    Worker *victim = &pool->worker_states[victims[(start + i) % count]];
+    WsDequeStealResult res;
+    while ((res = ws_deque_steal(&victim->deque, out)) == WS_DEQUE_ABORT) {
+      CPU_RELAX();
+    }
+    if (res == WS_DEQUE_SUCCESS) {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+// utility to steal the oldest task of some other worker. Workers sharing
+// our last level cache go first, then the rest, each group visited starting
+// from a pseudo random one so idle thieves spread out. self is NULL when
+// the thief is not one of the pool's workers, it tries everyone in order
+static bool_t steal_task(ThreadPool *pool, Worker *self, Task *out) {
+  int n = pool->num_threads;
+
+  if (self == NULL) {
+    for (int i = 0; i < n; i++) {
+      if (steal_from(pool, &i, 1, 0, out)) {
+        return TRUE;
+      }
+    }
+    return FALSE;
+  }
+
+  self->steal_seed ^= self->steal_seed << 13;
+  self->steal_seed ^= self->steal_seed >> 17;
+  self->steal_seed ^= self->steal_seed << 5;
+  unsigned int seed = self->steal_seed;
+
+  int num_far = n - 1 - self->num_near;
+  if (self->num_near > 0 &&
+      steal_from(pool, self->victims, self->num_near,
+                 (int)(seed % (unsigned int)self->num_near), out)) {
+    return TRUE;
+  }
+  return num_far > 0 &&
+         steal_from(pool, self->victims + self->num_near, num_far,
+                    (int)(seed % (unsigned int)num_far), out);
+}
+
+// stands in for the function of a task that resumes a parked fiber, the
+// fiber is its args. Never called, execute switches to the fiber instead
+static void resume_fiber(void *fiber, void *out) {}
+
+// a fiber's awaited task finished, queue it to be resumed by whoever takes
+// the added token. Runs on the thread that signalled the completion
+static void fiber_ready(Fiber *fiber) {
+  ThreadPool *pool = ((TaskFiber *)fiber->data)->pool;
+  fiber->next = NULL;
+  pthread_mutex_lock(&pool->ready_lock);
+  if (pool->ready_tail == NULL) {
+    pool->ready_head = fiber;
+  } else {
+    pool->ready_tail->next = fiber;
+  }
+  pool->ready_tail = fiber;
+  atomic_fetch_add(&pool->num_ready, 1);
+  pthread_mutex_unlock(&pool->ready_lock);
+  fsem_post(&pool->added);
+}
+
+// takes the oldest fiber that is ready to resume, as a task for execute
+static bool_t take_ready(ThreadPool *pool, Task *out) {
+  if (atomic_load_explicit(&pool->num_ready, memory_order_relaxed) == 0) {
+    return FALSE;
+  }
+  pthread_mutex_lock(&pool->ready_lock);
+  Fiber *fiber = pool->ready_head;
+  if (fiber != NULL) {
+    pool->ready_head = fiber->next;
+    if (pool->ready_head == NULL) {
+      pool->ready_tail = NULL;
+    }
+    atomic_fetch_sub(&pool->num_ready, 1);
+  }
+  pthread_mutex_unlock(&pool->ready_lock);
+  if (fiber == NULL) {
+    return FALSE;
+  }
+  out->func = &resume_fiber;
+  out->args = fiber;
+  out->task_awaiter = NULL;
+  return TRUE;
+}
+
+// look for work in order of locality: fibers ready to resume, which already
+// hold a stack, own deque (newest first), shared
+// channel, then other workers' deques (oldest first). With strict lanes the
+// high priority lane comes before even the own deque, which only ever holds
+// normal priority work. self is NULL for threads outside the pool, which
+// have no deque of their own
+static bool_t find_task(ThreadPool *pool, Worker *self, Task *out) {
+  int last_lane = NUM_TASK_PRIORITIES - 1;
+  if (take_ready(pool, out)) {
+    return TRUE;
+  }
+  if (self != NULL) {
+    if (++self->tick % GLOBAL_QUEUE_INTERVAL == 0 &&
+        take_shared(pool, self, last_lane, out)) {
+      return TRUE;
+    }
+    if (pool->lane_policy == LANE_POLICY_STRICT &&
+        take_shared(pool, self, TASK_PRIORITY_HIGH, out)) {
+      return TRUE;
+    }
+    if (ws_deque_pop(&self->deque, out)) {
+      return TRUE;
+    }
+  }
+  if (take_shared(pool, self, last_lane, out)) {
+    return TRUE;
+  }
+  if (!steal_task(pool, self, out)) {
+    return FALSE;
+  }
+  if (self != NULL) {
+    counter_inc(&self->counters.steals);
+  }
+  return TRUE;
+}
+
+// n submitted tasks are done (or were never queued), wakes
+// thread_pool_wait_idle callers if that left the pool idle
+static void finish_tasks(ThreadPool *pool, size_t n) {
+  if (n == 0) {
+    return;
+  }
+  if (atomic_fetch_sub(&pool->pending, (unsigned int)n) == n) {
+    atomic_fetch_add(&pool->idle_seq, 1);
+    if (atomic_load(&pool->idle_waiters) > 0) {
+      futex_wake_all(&pool->idle_seq);
+    }
+  }
+}
+
+static bool_t task_cancelled(Task *task) {
+  return task->cancel != NULL && cancel_token_is_cancelled(task->cancel);
+}
+
+// where thread_pool_scratch_alloc takes memory from on the calling thread:
+// the running task fiber's arena, else the worker's, NULL off the workers
+static Arena *current_scratch() {
+  Fiber *fiber = fiber_current();
+  if (fiber != NULL) {
+    return &((TaskFiber *)fiber->data)->scratch;
+  }
+  return current_worker != NULL ? &current_worker->scratch : NULL;
+}
+
+void *thread_pool_scratch_alloc(size_t size) {
+  Arena *scratch = current_scratch();
+  return scratch != NULL ? arena_alloc(scratch, size) : NULL;
+}
+
+Arena *thread_pool_scratch(void) { return current_scratch(); }
+
+void *thread_pool_worker_context(void) {
+  return current_worker != NULL ? current_worker->context : NULL;
+}
+
+// runs a task on the calling thread and wakes up anyone awaiting it. A task
+// whose token was cancelled is dropped, its awaiter learns it did not run.
+// Its scratch memory goes back when it returns, rewinding rather than
+// resetting since a task that runs others inline while it waits shares its
+// arena with them
+static void run_task(Task *task) {
+  if (task_cancelled(task)) {
+    LOG("WORKER: Task %" PRIu64 " cancelled, skipped\n", task->id)
+    drop_task(task);
+    return;
+  }
+  // found before running, the task may resume on another thread
+  Arena *scratch = current_scratch();
+  ArenaMark mark;
+  if (scratch != NULL) {
+    mark = arena_mark(scratch);
+  }
+  // Execute task, and transfer result
+  task->func(task->args, task->task_result);
+  if (scratch != NULL) {
+    arena_rewind(scratch, mark);
+  }
+  if (task->task_awaiter != NULL) {
+    completion_signal(task->task_awaiter);
+  }
+}
+
+// bottom of every task fiber
+static void fiber_entry(Fiber *fiber) {
+  run_task(&((TaskFiber *)fiber->data)->task);
+}
+
+// a fiber to run a new task on, from the worker's cache if it has one.
+// NULL if a new one could not be made
+static TaskFiber *take_fiber(ThreadPool *pool, Worker *self) {
+  if (self != NULL && self->free_fibers != NULL) {
+    Fiber *fiber = self->free_fibers;
+    self->free_fibers = fiber->next;
+    self->num_free_fibers--;
+    return (TaskFiber *)fiber->data;
+  }
+  TaskFiber *task_fiber = (TaskFiber *)malloc(sizeof(TaskFiber));
+  if (task_fiber == NULL) {
+    return NULL;
+  }
+  if (fiber_init(&task_fiber->fiber, pool->fiber_stack_size) != 0) {
+    free(task_fiber);
+    return NULL;
+  }
+  task_fiber->fiber.on_wake = &fiber_ready;
+  task_fiber->fiber.data = task_fiber;
+  task_fiber->pool = pool;
+  arena_init(&task_fiber->scratch, pool->scratch_size);
+  return task_fiber;
+}
+
+static void free_fiber(Fiber *fiber) {
+  TaskFiber *task_fiber = (TaskFiber *)fiber->data;
+  arena_destroy(&task_fiber->scratch);
+  fiber_destroy(fiber);
+  free(task_fiber);
+}
+
+// back into the worker's cache, or gone if it is full or there is no worker
+static void put_fiber(Worker *self, TaskFiber *task_fiber) {
+  if (self == NULL || self->num_free_fibers == FIBER_CACHE_SIZE) {
+    free_fiber(&task_fiber->fiber);
+    return;
+  }
+  task_fiber->fiber.next = self->free_fibers;
+  self->free_fibers = &task_fiber->fiber;
+  self->num_free_fibers++;
+}
+
+/*
+ * Runs a task taken from the queues on the calling thread, on a fiber in
+ * fiber mode. Returns TRUE once the task is done, FALSE if its fiber parked
+ * waiting for another task, it is then resumed from the ready list and
+ * reports done from there. self is NULL on threads outside the pool, which
+ * only run new tasks without a fiber but do resume parked ones.
+ * */
+static bool_t dispatch(ThreadPool *pool, Worker *self, Task *task) {
+  if (!pool->fibers) {
+    run_task(task);
+    return TRUE;
+  }
+
+  TaskFiber *task_fiber;
+  if (task->func == &resume_fiber) {
+    task_fiber = (TaskFiber *)((Fiber *)task->args)->data;
+  } else {
+    task_fiber = self != NULL ? take_fiber(pool, self) : NULL;
+    if (task_fiber == NULL) {
+      run_task(task);
+      return TRUE;
+    }
+    task_fiber->task = *task;
+    fiber_start(&task_fiber->fiber, &fiber_entry);
+  }
+
+  if (fiber_switch_to(&task_fiber->fiber) == FIBER_PARKED) {
+    return FALSE;
+  }
+  put_fiber(self, task_fiber);
+  return TRUE;
+}
+
+// dispatch, between the task's trace events if the pool traces. Every
+// stretch a fiber runs between awaits is a span of its own
+static bool_t execute(ThreadPool *pool, Worker *self, Task *task) {
+  if (!pool->trace) {
+    return dispatch(pool, self, task);
+  }
+  uint64_t id;
+  if (task->func == &resume_fiber) {
+    // a resumed fiber was never queued, it goes on with its own task
+    id = ((TaskFiber *)((Fiber *)task->args)->data)->task.id;
+  } else {
+    id = task->id;
+    trace_event(pool, TRACE_DEQUEUE, id);
+  }
+  trace_event(pool, TRACE_START, id);
+  bool_t finished = dispatch(pool, self, task);
+  trace_event(pool, finished ? TRACE_FINISH : TRACE_PARK, id);
+  return finished;
+}
+
+// runs a task a worker took from the queues and keeps that worker's books,
+// returns what execute does
+static bool_t run_counted(ThreadPool *pool, Worker *self, Task *task) {
+  WorkerCounters *counters = &self->counters;
+  // skipped before it could take a fiber or a clock reading
+  if (task->func != &resume_fiber && task_cancelled(task)) {
+    trace_event(pool, TRACE_DEQUEUE, task->id);
+    run_task(task);
+    counter_inc(&counters->tasks_cancelled);
+    return TRUE;
+  }
+  bool_t finished;
+  if (pool->latency_stats) {
+    uint64_t start = stats_now();
+    // a resumed fiber waited for its task, not in a queue
+    if (task->func != &resume_fiber) {
+      // cycle counters of different cores can be a little apart
+      uint64_t waited =
+          start > task->submitted_at ? start - task->submitted_at : 0;
+      histogram_record(&counters->queue_wait, waited);
+    }
+    finished = execute(pool, self, task);
+    // on fibers every stretch between awaits counts on its own
+    histogram_record(&counters->execution, stats_now() - start);
+  } else {
+    finished = execute(pool, self, task);
+  }
+  if (finished) {
+    counter_inc(&counters->tasks_executed);
+  }
+  return finished;
 }
 
-// utitlity to get a task from buffer channel
-static Task get(ThreadPool *pool) {
-  Task tmp = pool->buffer[pool->buffer_use];
-  pool->buffer_use = (pool->buffer_use + 1) % MAX_BUFFER;
-  return tmp;
+// a submission found its lane full
+static void note_stall(ThreadPool *pool) {
+  atomic_fetch_add_explicit(&pool->queue_full_stalls, 1, memory_order_relaxed);
+}
+
+// note when tasks went in, for the queue wait histogram
+static void stamp_tasks(ThreadPool *pool, Task *tasks, size_t n) {
+  if (!pool->latency_stats) {
+    return;
+  }
+  uint64_t now = stats_now();
+  for (size_t i = 0; i < n; i++) {
+    tasks[i].submitted_at = now;
+  }
+}
+
+static bool_t on_own_worker(ThreadPool *pool) {
+  return current_worker != NULL && current_worker->pool == pool;
+}
+
+_Static_assert(_Alignof(ThreadPool) == CACHE_LINE_SIZE,
+               "threadpool.hpp expects ThreadPool aligned to a cache line");
+
+size_t thread_pool_sizeof(void) { return sizeof(ThreadPool); }
+
+bool_t thread_pool_is_worker_thread(ThreadPool *pool) {
+  return on_own_worker(pool);
+}
+
+// account for n tasks about to be submitted. Fails once the pool is closing,
+// unless the submitter is one of the pool's own tasks, since those are part
+// of what a drain has to finish.
+// pending goes up before closing is checked, so a shutdown that sets closing
+// and then waits for idle either sees these tasks or they get rejected here
+static bool_t begin_submit(ThreadPool *pool, size_t n) {
+  atomic_fetch_add(&pool->pending, (unsigned int)n);
+  if (atomic_load(&pool->closing) && !on_own_worker(pool)) {
+    finish_tasks(pool, n);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+// When called from inside a task running on one of this pool's workers,
+// tasks go onto that worker's own deque. This never blocks, returns how many
+// of the n tasks were pushed before the deque filled up
+static size_t push_local(ThreadPool *pool, Task *tasks, size_t n) {
+  Worker *self = current_worker;
+  if (self == NULL || self->pool != pool) {
+    return 0;
+  }
+
+  // stamped before the push, a thief may take a task right after it
+  uint64_t at = trace_clock(pool);
+  size_t pushed = 0;
+  while (pushed < n && ws_deque_push(&self->deque, &tasks[pushed])) {
+    LOG("WORKER: Task %" PRIu64 " pushed to local deque %d\n",
+        tasks[pushed].id, self->index)
+    pushed++;
+  }
+  trace_tasks(pool, TRACE_ENQUEUE, tasks, pushed, at);
+  // the added tokens let parked workers wake up and steal them
+  fsem_post_n(&pool->added, (unsigned int)pushed);
+  return pushed;
+}
+
+// room left in the calling worker's deque, exact lower bound for the owner
+// since thieves only ever make more room
+static size_t local_room(ThreadPool *pool) {
+  Worker *self = current_worker;
+  if (self == NULL || self->pool != pool) {
+    return 0;
+  }
+  return (size_t)(self->deque.mask + 1 - ws_deque_size(&self->deque));
+}
+
+// copy tasks the caller holds empty tokens for into a lane and wake at most
+// that many workers
+static void publish(ThreadPool *pool, int lane, Task *tasks, size_t n) {
+  if (n == 0) {
+    return;
+  }
+  trace_tasks(pool, TRACE_ENQUEUE, tasks, n, trace_clock(pool));
+  put(pool, lane, tasks, n);
+  fsem_post_n(&pool->added, (unsigned int)n);
+  maybe_grow(pool);
+  LOG("PRODUCER: %zu tasks enqueued in lane %d starting at %" PRIu64 "\n", n,
+      lane, tasks[0].id)
+}
+
+typedef enum {
+  SLOT_WAIT_BLOCK,
+  SLOT_WAIT_NONE,
+  SLOT_WAIT_DEADLINE,
+} SlotWaitMode;
+
+// shared body of the single task enqueue variants
+static EnqueueTaskResponse submit(ThreadPool *pool, Task *task,
+                                  SlotWaitMode mode,
+                                  const struct timespec *deadline,
+                                  bool_t caller_runs) {
+  EnqueueTaskResponse enq_resp;
+  enq_resp.resp_code = ENQUEUE_TASK_SUCCESS;
+  enq_resp.task_awaiter = NULL;
+
+  if (!begin_submit(pool, 1)) {
+    enq_resp.resp_code = ENQUEUE_TASK_SHUTTING_DOWN;
+    return enq_resp;
+  }
+  stamp_tasks(pool, task, 1);
+
+  // worker deques are for normal priority only, other priorities need their
+  // lane to be ordered against everyone else's work
+  if (task->priority == TASK_PRIORITY_NORMAL && push_local(pool, task, 1)) {
+    return enq_resp;
+  }
+
+  // take a token from the lane's empty semaphore, i.e. reserve a slot in the
+  // shared channel, waiting as the caller asked
+  int lane = task->priority;
+  bool_t reserved = fsem_try_wait(&pool->empty[lane]);
+  if (!reserved) {
+    note_stall(pool);
+  }
+  switch (mode) {
+  case SLOT_WAIT_NONE:
+    enq_resp.resp_code = ENQUEUE_TASK_QUEUE_FULL;
+    break;
+  case SLOT_WAIT_DEADLINE:
+    reserved = reserved || fsem_wait_upto(&pool->empty[lane], 1, deadline) == 1;
+    enq_resp.resp_code = ENQUEUE_TASK_TIMED_OUT;
+    break;
+  default:
+    if (!reserved) {
+      fsem_wait(&pool->empty[lane]);
+    }
+    reserved = TRUE;
+    break;
+  }
+
+  if (!reserved) {
+    if (caller_runs) {
+      LOG("PRODUCER: Channel full, running task %lu in caller\n", task->id)
+      run_task(task);
+      enq_resp.resp_code = ENQUEUE_TASK_SUCCESS;
+    }
+    finish_tasks(pool, 1);
+    return enq_resp;
+  }
+
+  publish(pool, lane, task, 1);
+  enq_resp.resp_code = ENQUEUE_TASK_SUCCESS;
+  return enq_resp;
 }
 
 /*
- * Used to enqueue an async task, this may block if the buffered channel
- * is full.
+ * Used to enqueue an async task. If the buffered channel is full this
+ * blocks, fails or runs the task inline depending on the pool's overflow
+ * policy.
  * */
 EnqueueTaskResponse enqueue_task(ThreadPool *pool, Task task) {
+  switch (pool->overflow_policy) {
+  case OVERFLOW_POLICY_REJECT:
+    return submit(pool, &task, SLOT_WAIT_NONE, NULL, FALSE);
+  case OVERFLOW_POLICY_CALLER_RUNS:
+    return submit(pool, &task, SLOT_WAIT_NONE, NULL, TRUE);
+  default:
+    return submit(pool, &task, SLOT_WAIT_BLOCK, NULL, FALSE);
+  }
+}
+
+EnqueueTaskResponse enqueue_task_priority(ThreadPool *pool, Task task,
+                                          TaskPriority priority) {
+  task.priority = priority;
+  return enqueue_task(pool, task);
+}
+
+// Fail fast variant of enqueue_task, regardless of the pool's policy
+EnqueueTaskResponse try_enqueue_task(ThreadPool *pool, Task task) {
+  return submit(pool, &task, SLOT_WAIT_NONE, NULL, FALSE);
+}
+
+// Blocks at most until deadline waiting for room in the channel
+EnqueueTaskResponse enqueue_task_timed(ThreadPool *pool, Task task,
+                                       const struct timespec *deadline) {
+  return submit(pool, &task, SLOT_WAIT_DEADLINE, deadline, FALSE);
+}
+
+// batch tasks headed for the calling worker's deque rather than a lane
+#define DESTINATION_LOCAL -1
+
+// where a task of a batch goes, normal priority tasks take the room left in
+// the caller's deque first
+static int destination(Task *task, size_t *local_left) {
+  if (task->priority == TASK_PRIORITY_NORMAL && *local_left > 0) {
+    (*local_left)--;
+    return DESTINATION_LOCAL;
+  }
+  return task->priority;
+}
+
+// reserve and publish a run of tasks for one lane, blocking or running the
+// overflow inline as the pool's policy says
+static void submit_run(ThreadPool *pool, int lane, Task *tasks, size_t n) {
+  while (n > 0) {
+    unsigned int want = n > INT_MAX ? INT_MAX : (unsigned int)n;
+    unsigned int got;
+    got = fsem_try_wait_upto(&pool->empty[lane], want);
+    if (got == 0) {
+      note_stall(pool);
+    }
+    if (pool->overflow_policy == OVERFLOW_POLICY_CALLER_RUNS) {
+      if (got == 0) {
+        // lane is full, run the rest here
+        for (size_t i = 0; i < n; i++) {
+          run_task(&tasks[i]);
+        }
+        finish_tasks(pool, n);
+        return;
+      }
+    } else if (got == 0) {
+      got = fsem_wait_upto(&pool->empty[lane], want, NULL);
+    }
+    publish(pool, lane, tasks, got);
+    tasks += got;
+    n -= got;
+  }
+}
+
+/*
+ * Batched enqueue. Whatever fits in the calling worker's deque goes there,
+ * the rest is cut into runs of equal priority. Each run takes as many slots
+ * of its lane as are free in one go, is copied in with one claim on the ring
+ * and is announced with one post, which wakes at most one worker per task and
+ * never more than are asleep.
+ * */
+EnqueueTaskResponse enqueue_tasks(ThreadPool *pool, Task *tasks, size_t n) {
   EnqueueTaskResponse enq_resp;
-  enq_resp.resp_code = ENQUEUE_TASK_SEM_ERR;
+  enq_resp.resp_code = ENQUEUE_TASK_SUCCESS;
   enq_resp.task_awaiter = NULL;
 
-  RET_ON_FAIL(sem_wait(&pool->empty), enq_resp)
-  RET_ON_FAIL(sem_wait(&pool->mutex), enq_resp)
-  put(pool, task);
-  RET_ON_FAIL(sem_post(&pool->mutex), enq_resp)
-  RET_ON_FAIL(sem_post(&pool->added), enq_resp)
+  if (!begin_submit(pool, n)) {
+    enq_resp.resp_code = ENQUEUE_TASK_SHUTTING_DOWN;
+    return enq_resp;
+  }
+  stamp_tasks(pool, tasks, n);
+
+  size_t local_left = local_room(pool);
+  bool_t reserved = FALSE;
+
+  // all or nothing, so reserve every lane before anything becomes visible
+  // to workers
+  if (pool->overflow_policy == OVERFLOW_POLICY_REJECT) {
+    size_t needed[NUM_TASK_PRIORITIES] = {0};
+    size_t probe = local_left;
+    for (size_t i = 0; i < n; i++) {
+      int dest = destination(&tasks[i], &probe);
+      if (dest != DESTINATION_LOCAL) {
+        needed[dest]++;
+      }
+    }
+    for (int lane = 0; lane < NUM_TASK_PRIORITIES; lane++) {
+      if (needed[lane] > 0 &&
+          (needed[lane] > INT_MAX ||
+           !fsem_try_wait_n(&pool->empty[lane], (unsigned int)needed[lane]))) {
+        for (int prev = 0; prev < lane; prev++) {
+          fsem_post_n(&pool->empty[prev], (unsigned int)needed[prev]);
+        }
+        finish_tasks(pool, n);
+        note_stall(pool);
+        enq_resp.resp_code = ENQUEUE_TASK_QUEUE_FULL;
+        return enq_resp;
+      }
+    }
+    reserved = TRUE;
+  }
+
+  size_t i = 0;
+  while (i < n) {
+    int dest = destination(&tasks[i], &local_left);
+    size_t len = 1;
+    while (i + len < n) {
+      size_t probe = local_left;
+      if (destination(&tasks[i + len], &probe) != dest) {
+        break;
+      }
+      local_left = probe;
+      len++;
+    }
+
+    if (dest == DESTINATION_LOCAL) {
+      // the room was measured by the owner, so all of them fit
+      push_local(pool, tasks + i, len);
+    } else if (reserved) {
+      publish(pool, dest, tasks + i, len);
+    } else {
+      submit_run(pool, dest, tasks + i, len);
+    }
+    i += len;
+  }
+  return enq_resp;
+}
+
+// current timer wheel tick, time since the pool was created
+static uint64_t timer_now(ThreadPool *pool) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t elapsed = (int64_t)(now.tv_sec - pool->timer_epoch.tv_sec) *
+                        1000000000L +
+                    (now.tv_nsec - pool->timer_epoch.tv_nsec);
+  return (uint64_t)(elapsed / TIMER_TICK_NS);
+}
 
-  LOG("PRODUCER: Task %s enqueued\n", task.uuid_str)
+// absolute CLOCK_MONOTONIC time a tick starts at
+static void tick_time(ThreadPool *pool, uint64_t tick, struct timespec *out) {
+  uint64_t nsec = (uint64_t)pool->timer_epoch.tv_nsec + tick * TIMER_TICK_NS;
+  out->tv_sec = pool->timer_epoch.tv_sec + (time_t)(nsec / 1000000000L);
+  out->tv_nsec = (long)(nsec % 1000000000L);
+}
+
+// hand a timer that came due to the channel
+static void fire_timer(ThreadPool *pool, ScheduledTask *entry) {
+  Task task = entry->task;
+  if (entry->period != 0) {
+    // every firing is its own fire and forget task, the awaiter and the
+    // drop hook stay with the timer
+    task.task_awaiter = NULL;
+    task.on_drop = NULL;
+    task.id = take_task_id();
+  }
+  if (task_cancelled(&task)) {
+    // not worth a trip through the channel, a delayed task's awaiter hears
+    // about it right here. A periodic timer keeps firing, and skipping,
+    // until cancel_timer
+    run_task(&task);
+    return;
+  }
+  LOG("TIMER: Task %" PRIu64 " due\n", task.id)
+  // blocking even under other overflow policies, a full channel delays the
+  // timers behind this one instead of losing or inlining this one
+  submit(pool, &task, SLOT_WAIT_BLOCK, NULL, FALSE);
+}
+
+// The timer thread, sleeps until the earliest tick with anything to do and
+// fires whatever is due by then. New timers that are due sooner wake it up
+static void *timer_runner(ThreadPool *pool) {
+  pthread_mutex_lock(&pool->timer_lock);
+  while (!pool->timer_stop) {
+    ScheduledTask entry;
+    if (timer_wheel_expire(&pool->timers, timer_now(pool), &entry)) {
+      // submitting can block on a full channel, not while holding the lock
+      pthread_mutex_unlock(&pool->timer_lock);
+      fire_timer(pool, &entry);
+      pthread_mutex_lock(&pool->timer_lock);
+      continue;
+    }
+
+    pool->timer_wake = timer_wheel_next_event(&pool->timers);
+    if (pool->timer_wake == UINT64_MAX) {
+      pthread_cond_wait(&pool->timer_cond, &pool->timer_lock);
+    } else {
+      struct timespec wake;
+      tick_time(pool, pool->timer_wake, &wake);
+      pthread_cond_timedwait(&pool->timer_cond, &pool->timer_lock, &wake);
+    }
+  }
+  pthread_mutex_unlock(&pool->timer_lock);
+  return NULL;
+}
+
+// shared body of enqueue_task_after and enqueue_task_every
+static EnqueueTaskResponse schedule(ThreadPool *pool, Task *task,
+                                    uint64_t delay, uint64_t period,
+                                    TimerHandle *timer) {
+  EnqueueTaskResponse enq_resp;
   enq_resp.resp_code = ENQUEUE_TASK_SUCCESS;
+  enq_resp.task_awaiter = NULL;
+  if (timer != NULL) {
+    *timer = 0;
+  }
+
+  ScheduledTask entry;
+  entry.task = *task;
+  entry.period = period;
+
+  pthread_mutex_lock(&pool->timer_lock);
+  if (pool->timer_stop) {
+    pthread_mutex_unlock(&pool->timer_lock);
+    enq_resp.resp_code = ENQUEUE_TASK_SHUTTING_DOWN;
+    return enq_resp;
+  }
+  if (!pool->timer_started) {
+    if (pthread_create(&pool->timer_thread, NULL,
+                       (void *(*)(void *)) & timer_runner, (void *)pool) != 0) {
+      pthread_mutex_unlock(&pool->timer_lock);
+      enq_resp.resp_code = ENQUEUE_TASK_TIMER_ERR;
+      return enq_resp;
+    }
+    pool->timer_started = TRUE;
+  }
+
+  // the current tick is partly over already, one more makes the delay a
+  // lower bound
+  uint64_t due = timer_now(pool) + delay + 1;
+  TimerHandle handle = timer_wheel_add(&pool->timers, due, period, &entry);
+  if (handle == 0) {
+    pthread_mutex_unlock(&pool->timer_lock);
+    enq_resp.resp_code = ENQUEUE_TASK_TIMER_ERR;
+    return enq_resp;
+  }
+  if (due < pool->timer_wake) {
+    pool->timer_wake = due;
+    pthread_cond_signal(&pool->timer_cond);
+  }
+  pthread_mutex_unlock(&pool->timer_lock);
+
+  LOG("PRODUCER: Task %" PRIu64 " scheduled for tick %" PRIu64 "\n", task->id,
+      due)
+  if (timer != NULL) {
+    *timer = handle;
+  }
   return enq_resp;
 }
 
+EnqueueTaskResponse enqueue_task_after(ThreadPool *pool, Task task,
+                                       uint64_t delay_ms, TimerHandle *timer) {
+  return schedule(pool, &task, delay_ms, 0, timer);
+}
+
+EnqueueTaskResponse enqueue_task_every(ThreadPool *pool, Task task,
+                                       uint64_t period_ms, TimerHandle *timer) {
+  // a period below the tick would mean firing every tick anyway
+  if (period_ms == 0) {
+    period_ms = 1;
+  }
+  return schedule(pool, &task, period_ms - 1, period_ms, timer);
+}
+
+bool_t cancel_timer(ThreadPool *pool, TimerHandle timer) {
+  ScheduledTask entry;
+  pthread_mutex_lock(&pool->timer_lock);
+  int removed = timer_wheel_cancel(&pool->timers, timer, &entry);
+  pthread_mutex_unlock(&pool->timer_lock);
+  if (!removed) {
+    return FALSE;
+  }
+  // it will not run again, wake its awaiter like a discarded task
+  drop_task(&entry.task);
+  return TRUE;
+}
+
+// stop the timer thread and drop the timers that are left, new timers are
+// refused from here on
+static void stop_timers(ThreadPool *thread_pool) {
+  pthread_mutex_lock(&thread_pool->timer_lock);
+  thread_pool->timer_stop = TRUE;
+  pthread_cond_signal(&thread_pool->timer_cond);
+  bool_t started = thread_pool->timer_started;
+  pthread_mutex_unlock(&thread_pool->timer_lock);
+  if (started) {
+    pthread_join(thread_pool->timer_thread, NULL);
+  }
+
+  ScheduledTask entry;
+  while (timer_wheel_drain(&thread_pool->timers, &entry)) {
+    drop_task(&entry.task);
+  }
+}
+
+static void destroy_timers(ThreadPool *thread_pool) {
+  timer_wheel_destroy(&thread_pool->timers);
+  pthread_cond_destroy(&thread_pool->timer_cond);
+  pthread_mutex_destroy(&thread_pool->timer_lock);
+}
+
+/*
+ * Takes an added token without waiting, which guarantees some queue holds a
+ * task for us, then runs that task here. This is how a task that waits on
+ * other tasks of its own pool keeps its worker busy instead of parking it.
+ * */
+bool_t thread_pool_run_pending_task(ThreadPool *pool) {
+  if (!fsem_try_wait(&pool->added)) {
+    return FALSE;
+  }
+  // the token may be one of the wake ups a shutdown hands out to workers
+  if (atomic_load(&pool->stopping)) {
+    fsem_post(&pool->added);
+    return FALSE;
+  }
+
+  Worker *self = on_own_worker(pool) ? current_worker : NULL;
+  Task task;
+  while (!find_task(pool, self, &task)) {
+    CPU_RELAX();
+  }
+  bool_t finished;
+  if (self != NULL) {
+    finished = run_counted(pool, self, &task);
+  } else {
+    finished = execute(pool, NULL, &task);
+  }
+  if (finished) {
+    finish_tasks(pool, 1);
+  }
+  return TRUE;
+}
+
+void thread_pool_worker_stats(ThreadPool *pool, int worker,
+                              WorkerStats *stats) {
+  Worker *slot = &pool->worker_states[worker];
+  WorkerCounters *counters = &slot->counters;
+  stats->tasks_executed = atomic_load_explicit(&counters->tasks_executed,
+                                               memory_order_relaxed);
+  stats->steals = atomic_load_explicit(&counters->steals, memory_order_relaxed);
+  stats->parks = atomic_load_explicit(&counters->parks, memory_order_relaxed);
+  stats->tasks_cancelled = atomic_load_explicit(&counters->tasks_cancelled,
+                                                memory_order_relaxed);
+  // owner and thieves move the ends while we look, never report below zero
+  long long depth = ws_deque_size(&slot->deque);
+  stats->deque_depth = depth > 0 ? (size_t)depth : 0;
+  stats->running = atomic_load(&slot->state) == WORKER_SLOT_RUNNING;
+}
+
+void thread_pool_stats(ThreadPool *pool, ThreadPoolStats *stats) {
+  // length of a stats clock tick, measured over the life of the pool
+  double unit_ns = 1;
+#if defined(__x86_64__) || defined(__i386__)
+  uint64_t ticks = stats_now() - pool->stats_epoch_ticks;
+  uint64_t ns = monotonic_ns() - pool->stats_epoch_ns;
+  if (ticks > 0) {
+    unit_ns = (double)ns / (double)ticks;
+  }
+#endif
+  histogram_snapshot_init(&stats->queue_wait, unit_ns);
+  histogram_snapshot_init(&stats->execution, unit_ns);
+
+  stats->tasks_executed = 0;
+  stats->steals = 0;
+  stats->parks = 0;
+  stats->tasks_cancelled = 0;
+  stats->queue_depth = 0;
+  for (int i = 0; i < pool->num_threads; i++) {
+    WorkerStats worker;
+    thread_pool_worker_stats(pool, i, &worker);
+    stats->tasks_executed += worker.tasks_executed;
+    stats->steals += worker.steals;
+    stats->parks += worker.parks;
+    stats->tasks_cancelled += worker.tasks_cancelled;
+    stats->queue_depth += worker.deque_depth;
+    histogram_add_to(&pool->worker_states[i].counters.queue_wait,
+                     &stats->queue_wait);
+    histogram_add_to(&pool->worker_states[i].counters.execution,
+                     &stats->execution);
+  }
+  for (int lane = 0; lane < NUM_TASK_PRIORITIES; lane++) {
+    stats->lane_depth[lane] = mpmc_ring_size(&pool->lanes[lane]);
+    stats->queue_depth += stats->lane_depth[lane];
+  }
+  stats->queue_full_stalls =
+      atomic_load_explicit(&pool->queue_full_stalls, memory_order_relaxed);
+  stats->active_workers = atomic_load(&pool->active_threads);
+  stats->blocked_workers = atomic_load(&pool->blocked_threads);
+}
+
+bool_t thread_pool_trace_write(ThreadPool *pool, FILE *out) {
+  if (!pool->trace) {
+    return FALSE;
+  }
+  return tracer_write_json(&pool->tracer, out) == 0;
+}
+
+void thread_pool_wait_idle(ThreadPool *thread_pool) {
+  while (1) {
+    unsigned int seq = atomic_load(&thread_pool->idle_seq);
+    if (atomic_load(&thread_pool->pending) == 0) {
+      return;
+    }
+    atomic_fetch_add(&thread_pool->idle_waiters, 1);
+    futex_wait(&thread_pool->idle_seq, seq, NULL);
+    atomic_fetch_sub(&thread_pool->idle_waiters, 1);
+  }
+}
+
+// start one more worker in a free slot, if the pool may still grow. A slot
+// whose worker retired is joined first, which also hands its deque over to
+// the new owner
+static void grow_workers(ThreadPool *pool) {
+  if (pthread_mutex_trylock(&pool->elastic_lock) != 0) {
+    return; // somebody else is already growing or shutting down
+  }
+  if (!atomic_load(&pool->stopping) &&
+      atomic_load(&pool->active_threads) < pool->num_threads) {
+    for (int i = 0; i < pool->num_threads; i++) {
+      Worker *slot = &pool->worker_states[i];
+      int state = atomic_load(&slot->state);
+      if (state == WORKER_SLOT_RUNNING) {
+        continue;
+      }
+      if (state == WORKER_SLOT_EXITED) {
+        pthread_join(pool->workers[i], NULL);
+        atomic_store(&slot->state, WORKER_SLOT_IDLE);
+      }
+      if (start_worker(pool, i) == 0) {
+        LOG("POOL: Grew to %d workers\n", atomic_load(&pool->active_threads))
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool->elastic_lock);
+}
+
+// In elastic mode, or while workers are blocked, called by submitters and
+// workers to notice a backlog: at least one queued task per worker and none
+// of them parked. Once that has lasted grow_delay_ns a worker is added, as
+// long as that leaves at most max_threads workers that are not blocked
+static void maybe_grow(ThreadPool *pool) {
+  int blocked =
+      atomic_load_explicit(&pool->blocked_threads, memory_order_relaxed);
+  if (pool->min_threads == pool->max_threads && blocked == 0) {
+    return;
+  }
+  int active = atomic_load_explicit(&pool->active_threads, memory_order_relaxed);
+  if (active >= pool->num_threads || active - blocked >= pool->max_threads) {
+    return;
+  }
+
+  uint64_t since =
+      atomic_load_explicit(&pool->backlog_since, memory_order_relaxed);
+  if (atomic_load_explicit(&pool->added.sleepers, memory_order_relaxed) > 0 ||
+      atomic_load_explicit(&pool->added.value, memory_order_relaxed) <
+          (unsigned int)active) {
+    if (since != 0) {
+      atomic_store_explicit(&pool->backlog_since, 0, memory_order_relaxed);
+    }
+    return;
+  }
+
+  uint64_t now = monotonic_ns();
+  if (since == 0) {
+    atomic_compare_exchange_strong(&pool->backlog_since, &since, now);
+    return;
+  }
+  if (now - since >= pool->grow_delay_ns &&
+      atomic_compare_exchange_strong(&pool->backlog_since, &since, 0)) {
+    grow_workers(pool);
+  }
+}
+
+/*
+ * A worker about to block leaves the pool one short. If nobody is parked
+ * waiting for work, and the workers that are not blocked fell below the
+ * minimum, a compensating worker starts right away. It is an ordinary
+ * extra worker and retires once idle for idle_timeout_ns after the block
+ * ended. Growing is best effort, a start that loses the race for the lock
+ * is made up by maybe_grow once a backlog builds.
+ */
+void thread_pool_begin_blocking(ThreadPool *pool) {
+  if (!on_own_worker(pool)) {
+    return;
+  }
+  int blocked = atomic_fetch_add(&pool->blocked_threads, 1) + 1;
+  if (pool->num_threads == pool->max_threads ||
+      atomic_load_explicit(&pool->added.sleepers, memory_order_relaxed) > 0) {
+    return;
+  }
+  if (atomic_load(&pool->active_threads) - blocked < pool->min_threads) {
+    grow_workers(pool);
+  }
+}
+
+void thread_pool_end_blocking(ThreadPool *pool) {
+  if (on_own_worker(pool)) {
+    atomic_fetch_sub(&pool->blocked_threads, 1);
+  }
+}
+
+// An extra worker that timed out waiting for work leaves, as long as that
+// keeps the workers that are not blocked at the pool's minimum. Its deque
+// stays where thieves look, so anything still in it gets run. Returns TRUE
+// if the worker should exit
+static bool_t retire_worker(ThreadPool *pool, Worker *worker) {
+  // never wait for the lock, shutdown holds it while joining us
+  if (pthread_mutex_trylock(&pool->elastic_lock) != 0) {
+    return FALSE;
+  }
+  bool_t retire = !atomic_load(&pool->stopping) &&
+                  atomic_load(&pool->active_threads) -
+                          atomic_load(&pool->blocked_threads) >
+                      pool->min_threads;
+  if (retire) {
+    atomic_fetch_sub(&pool->active_threads, 1);
+    atomic_store(&worker->state, WORKER_SLOT_EXITED);
+    LOG("WORKER: Worker %d retired\n", worker->index)
+  }
+  pthread_mutex_unlock(&pool->elastic_lock);
+  return retire;
+}
+
+// take an added token, polling a little before parking in the kernel.
+// Returns FALSE if an elastic pool's idle timeout passed without one
+static bool_t wait_for_work(ThreadPool *pool, Worker *self) {
+  for (unsigned int i = 0; i < pool->spin_count; i++) {
+    if (fsem_try_wait(&pool->added)) {
+      return TRUE;
+    }
+    CPU_RELAX();
+  }
+  for (unsigned int i = 0; i < pool->yield_count; i++) {
+    if (fsem_try_wait(&pool->added)) {
+      return TRUE;
+    }
+    sched_yield();
+  }
+  if (fsem_try_wait(&pool->added)) {
+    return TRUE;
+  }
+  counter_inc(&self->counters.parks);
+  trace_event(pool, TRACE_IDLE_BEGIN, 0);
+
+  // only workers above the minimum ever retire, the rest need no timeout
+  bool_t got;
+  if (atomic_load(&pool->active_threads) <= pool->min_threads) {
+    fsem_wait(&pool->added);
+    got = TRUE;
+  } else {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    uint64_t nsec = (uint64_t)deadline.tv_nsec + pool->idle_timeout_ns;
+    deadline.tv_sec += (time_t)(nsec / 1000000000);
+    deadline.tv_nsec = (long)(nsec % 1000000000);
+    got = fsem_wait_upto(&pool->added, 1, &deadline) == 1;
+  }
+  trace_event(pool, TRACE_IDLE_END, 0);
+  return got;
+}
+
 // Every worker thread will run this function
 // This function will run till it is signaled
 // to be shutdown
-static void *worker_runner(ThreadPool *thread_pool) {
+static void *worker_runner(Worker *worker) {
+  ThreadPool *thread_pool = worker->pool;
+  current_worker = worker;
+  if (thread_pool->worker_init != NULL) {
+    worker->context =
+        thread_pool->worker_init(worker->index, thread_pool->worker_arg);
+  }
 
   LOG("WORKER: Running thread with ID -> %lu \n", pthread_self())
 
   // while not signal to exit has been set off
-  // block on MPSC channel
+  // block till some queue in the pool has work.
+  // Every queued task, wherever it lives, posts exactly one added token and
+  // every task taken consumes one, so a worker holding a token is guaranteed
+  // to find a task and only retries while it races other workers for it.
+  // Posting n tokens wakes at most n parked workers, one per task.
+  // Shutdown posts one extra token per worker after setting stopping, so
+  // parked workers wake up and leave without any polling
   while (1) {
-    sem_wait(&thread_pool->added);
-    sem_wait(&thread_pool->mutex);
-    Task task = get(thread_pool);
-    sem_post(&thread_pool->mutex);
-    sem_post(&thread_pool->empty);
+    if (!wait_for_work(thread_pool, worker)) {
+      if (retire_worker(thread_pool, worker)) {
+        break;
+      }
+      continue;
+    }
+    if (atomic_load(&thread_pool->stopping)) {
+      break;
+    }
+    Task task;
+    while (!find_task(thread_pool, worker, &task)) {
+      CPU_RELAX();
+    }
+    maybe_grow(thread_pool);
 
-    // Execute task, and transfer result
-	task.func(task.args, task.task_result);
-    if (task.task_awaiter != NULL) {
-      sem_post(task.task_awaiter);
+    if (run_counted(thread_pool, worker, &task)) {
+      finish_tasks(thread_pool, 1);
     }
-    // ------------------
   }
+
+  while (worker->free_fibers != NULL) {
+    Fiber *fiber = worker->free_fibers;
+    worker->free_fibers = fiber->next;
+    free_fiber(fiber);
+  }
+  worker->num_free_fibers = 0;
+  // a thread started in this slot later begins with a fresh arena
+  arena_destroy(&worker->scratch);
+  if (thread_pool->worker_exit != NULL) {
+    thread_pool->worker_exit(worker->context, thread_pool->worker_arg);
+  }
+  worker->context = NULL;
+
+  LOG("WORKER: Exiting thread with ID -> %lu \n", pthread_self())
   return NULL;
 }
 
-DestroyThreadPoolResult destroy_thread_pool(ThreadPool *thread_pool) {
-  // would be nice to be able to wait for all tasks to finish but the 
-  // destructor should only be called if the invoker is done awaiting
-  // all tasks
+// a task that will never run, e.g. one a discarding shutdown left in the
+// queues. Its drop hook cleans up after it, then its awaiter is woken
+static void drop_task(Task *task) {
+  LOG("PRODUCER: Task %" PRIu64 " dropped\n", task->id)
+  if (task->on_drop != NULL) {
+    task->on_drop(task->args);
+  }
+  if (task->task_awaiter != NULL) {
+    completion_cancel(task->task_awaiter);
+  }
+}
+
+static void drop_queued(ThreadPool *thread_pool) {
+  Task task;
+  for (int lane = 0; lane < NUM_TASK_PRIORITIES; lane++) {
+    while (mpmc_ring_try_pop(&thread_pool->lanes[lane], &task)) {
+      drop_task(&task);
+    }
+  }
+  for (int i = 0; i < thread_pool->num_threads; i++) {
+    while (ws_deque_pop(&thread_pool->worker_states[i].deque, &task)) {
+      drop_task(&task);
+    }
+  }
+}
+
+DestroyThreadPoolResult shutdown_thread_pool(ThreadPool *thread_pool,
+                                             ShutdownMode mode) {
+  // timers first, the ones that already fired are part of what a drain runs
+  stop_timers(thread_pool);
+  atomic_store(&thread_pool->closing, 1);
+  if (mode == SHUTDOWN_DRAIN) {
+    // workers keep running everything that is queued, in parallel
+    thread_pool_wait_idle(thread_pool);
+  }
+
+  atomic_store(&thread_pool->stopping, 1);
+  // no worker starts or retires while the lock is held, and one token per
+  // slot is enough for every running worker to see stopping
+  pthread_mutex_lock(&thread_pool->elastic_lock);
+  fsem_post_n(&thread_pool->added, (unsigned int)thread_pool->num_threads);
   for (int i = 0; i < thread_pool->num_threads; i++) {
-    pthread_cancel(thread_pool->workers[i]);
+    if (atomic_load(&thread_pool->worker_states[i].state) ==
+        WORKER_SLOT_IDLE) {
+      continue;
+    }
+    if (pthread_join(thread_pool->workers[i], NULL) != 0) {
+      pthread_mutex_unlock(&thread_pool->elastic_lock);
+      return DESTROY_THREAD_POOL_JOIN_FAIL;
+    }
+  }
+  pthread_mutex_unlock(&thread_pool->elastic_lock);
+  pthread_mutex_destroy(&thread_pool->elastic_lock);
+
+  // only a discarding shutdown can leave tasks behind. Fibers parked on
+  // them are running tasks, dropping wakes them and they finish here
+  drop_queued(thread_pool);
+  Task task;
+  while (take_ready(thread_pool, &task)) {
+    execute(thread_pool, NULL, &task);
+    drop_queued(thread_pool);
   }
+  pthread_mutex_destroy(&thread_pool->ready_lock);
 
   // free array of pthread_t
   free(thread_pool->workers);
 
-  sem_destroy(&thread_pool->empty);
-  sem_destroy(&thread_pool->added);
-  sem_destroy(&thread_pool->mutex);
+  for (int i = 0; i < thread_pool->num_threads; i++) {
+    ws_deque_destroy(&thread_pool->worker_states[i].deque);
+  }
+  free(thread_pool->worker_states);
+
+  destroy_lanes(thread_pool, NUM_TASK_PRIORITIES);
+  destroy_timers(thread_pool);
+  if (thread_pool->trace) {
+    tracer_destroy(&thread_pool->tracer);
+  }
 
 #ifdef DEBUG
   pthread_mutex_destroy(&log_mutex);
 #endif
   return DESTROY_THREAD_POOL_SUCCESS;
 }
+
+DestroyThreadPoolResult destroy_thread_pool(ThreadPool *thread_pool) {
+  return shutdown_thread_pool(thread_pool, SHUTDOWN_DRAIN);
+}
@@ -2,46 +2,368 @@
 #define THREADPOOL
 
 #include <pthread.h>
-#include <semaphore.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "arena.h"
+#include "completion.h"
+#include "fsem.h"
+#include "histogram.h"
+#include "mpmc_ring.h"
+#include "timer_wheel.h"
+#include "trace.h"
+#include "ws_deque.h"
 
 typedef int bool_t;
 #define TRUE 1
 #define FALSE 0
 
+// default capacity of the shared channel, see ThreadPoolOptions
 #define MAX_BUFFER 10
+// capacity of each worker's local deque, tasks spawned by a worker beyond this
+// spill over into the shared channel
+#define WORKER_DEQUE_SIZE 256
 
 typedef void (*UserDefFunc_t)(void * in, void* out);
 
+// called with a task's args when the task is dropped without running
+typedef void (*TaskDropFunc_t)(void *in);
+
+// Every priority has its own lane in the shared channel
+typedef enum {
+  TASK_PRIORITY_HIGH = 0,   // latency sensitive, interactive work
+  TASK_PRIORITY_NORMAL = 1, // default
+  TASK_PRIORITY_LOW = 2,    // bulk and background work
+} TaskPriority;
+
+#define NUM_TASK_PRIORITIES 3
+
+// Set once to ask the tasks carrying it to stop. A queued task whose token
+// is cancelled is skipped when a worker takes it, without running, and a
+// long running one may poll its token and return early. Owned by the
+// caller, it must outlive every task carrying it
+typedef struct {
+  atomic_uint cancelled;
+} CancelToken;
+
+void cancel_token_init(CancelToken *token);
+
+void cancel_token_cancel(CancelToken *token);
+
+static inline bool_t cancel_token_is_cancelled(CancelToken *token) {
+  return atomic_load_explicit(&token->cancelled, memory_order_relaxed) != 0;
+}
+
 typedef struct __task {
   UserDefFunc_t func;
   void *args;
-  char uuid_str[37];
-  sem_t *task_awaiter;
+  uint64_t id; // unique per process, increasing per submitting thread
+  TaskCompletion *task_awaiter; // NULL for fire and forget tasks
   void *task_result;
   size_t result_size;
+  TaskPriority priority; // TASK_PRIORITY_NORMAL unless set otherwise
+  uint64_t submitted_at; // stats clock reading at submission, latency_stats only
+  CancelToken *cancel;   // NULL unless task_set_cancel_token was called
+  TaskDropFunc_t on_drop; // NULL unless task_set_drop_hook was called
 } Task;
 
-void new_task(Task *task, UserDefFunc_t func, void *args, void *task_result, size_t result_size, bool_t is_fire_and_forget);
+// Returns FALSE if the task is not fire and forget but no completion slot
+// could be allocated for it. Its task_awaiter is NULL then and it must not be
+// enqueued, it would run with nothing to await it by
+bool_t new_task(Task *task, UserDefFunc_t func, void *args, void *task_result, size_t result_size, bool_t is_fire_and_forget);
 
 void destroy_task(Task *task);
 
+void task_set_priority(Task *task, TaskPriority priority);
+
+// the task is skipped instead of run if token is cancelled by the time a
+// worker takes it. Tokens may be shared by any number of tasks
+void task_set_cancel_token(Task *task, CancelToken *token);
+
+// on_drop(args) runs in place of the task if it never runs: its token was
+// cancelled, a discarding shutdown dropped it or its timer was cancelled or
+// stopped. For tasks whose args own what only the task would free, fire and
+// forget ones in particular since no awaiter hears they did not run. It runs
+// before the awaiter, if any, is woken
+void task_set_drop_hook(Task *task, TaskDropFunc_t on_drop);
+
+// Pushes tag, e.g. the task's id or its index in the caller's array, to
+// queue once the task finished, ran or not. Only for awaitable tasks that
+// were not enqueued yet, returns FALSE for fire and forget ones or if queue
+// has as many tasks bound as it has room for, a tag keeps its room until it
+// is harvested. The task may still be awaited on its own as well
+bool_t task_set_completion_queue(Task *task, CompletionQueue *queue,
+                                 uint64_t tag);
+
+// blocks till the task is completed. Inside a task of a pool in fiber mode
+// it parks the task's fiber instead and its worker carries on with others
 void await_task(Task *task);
 
+// blocks till every task in the array is completed
+void await_tasks(Task *tasks, size_t n);
+
+typedef enum {
+  AWAIT_TASK_DONE = 0,
+  AWAIT_TASK_TIMED_OUT = -1,
+  // the task did not run, its token was cancelled or a discarding shutdown
+  // dropped it
+  AWAIT_TASK_CANCELLED = -2,
+} AwaitTaskResult;
+
+// Waits until the task is completed or the absolute CLOCK_MONOTONIC deadline
+// passes, NULL waits without a deadline. A timed out task is still queued or
+// running and must be awaited again before destroy_task. On a fiber a wait
+// with a deadline blocks the worker like outside of fiber mode
+AwaitTaskResult await_task_timed(Task *task, const struct timespec *deadline);
+
+struct __thread_pool;
+struct __fiber;
+
+// Counters a worker keeps about itself. Each has a single writer, the
+// worker, so bumping one is a plain load and store, and thread_pool_stats
+// reads them from any thread without stopping anybody
+typedef struct {
+  TP_ALIGNAS(CACHE_LINE_SIZE) atomic_uint_least64_t tasks_executed;
+  atomic_uint_least64_t steals; // tasks taken from another worker's deque
+  atomic_uint_least64_t parks;  // times it went to sleep waiting for work
+  atomic_uint_least64_t tasks_cancelled; // skipped for a cancelled token
+  // stats clock ticks from submission to start and from start to end,
+  // latency_stats only
+  Histogram queue_wait;
+  Histogram execution;
+} WorkerCounters;
+
+// Per worker state, each worker owns a deque that tasks submitted from inside
+// a running task are pushed onto, idle workers steal from each other's deques
+typedef struct {
+  struct __thread_pool *pool;
+  int index;
+  unsigned int steal_seed; // picks where a thief starts looking for victims
+  unsigned int tick;       // counts searches, used to poll the shared channel
+  unsigned int lane_tick;  // position in the weighted lane schedule
+  unsigned int strict_streak; // lower lanes skipped in a row, strict policy
+  int cpu; // the cpu the worker is pinned to, -1 if it is not pinned
+  int llc; // last level cache of that cpu, the same for all unpinned workers
+  // the other workers in the order this one tries to steal from them, the
+  // first num_near share its last level cache
+  int *victims;
+  int num_near;
+  atomic_int state; // WORKER_SLOT_*, whether a thread owns this slot
+  WsDeque deque;
+  WorkerCounters counters;
+  // finished task fibers kept for reuse, fiber mode only
+  struct __fiber *free_fibers;
+  unsigned int num_free_fibers;
+  // thread_pool_scratch_alloc memory of tasks that run on the worker's own
+  // stack, rewound after each of them
+  Arena scratch;
+  void *context; // what worker_init returned for the running thread
+} Worker;
+
+// Called on every worker thread as it starts, elastic ones included, its
+// result is what thread_pool_worker_context returns on that thread.
+// index is the worker's slot
+typedef void *(*WorkerInitFunc)(int index, void *arg);
+// called on the worker thread as it exits, with what worker_init returned
+typedef void (*WorkerExitFunc)(void *context, void *arg);
+
+// What enqueue_task does when the shared channel is full
+typedef enum {
+  OVERFLOW_POLICY_BLOCK = 0,       // wait for a worker to free a slot
+  OVERFLOW_POLICY_REJECT = 1,      // fail with ENQUEUE_TASK_QUEUE_FULL
+  OVERFLOW_POLICY_CALLER_RUNS = 2, // run the task on the calling thread
+} OverflowPolicy;
+
+// How workers pick between the priority lanes of the shared channel
+typedef enum {
+  // always the highest non empty lane, but after starvation_limit picks in a
+  // row that passed over waiting lower lanes the lowest waiting lane goes once
+  LANE_POLICY_STRICT = 0,
+  // lanes are served in proportion to lane_weights
+  LANE_POLICY_WEIGHTED = 1,
+} LanePolicy;
+
+// Where worker threads run
+typedef enum {
+  AFFINITY_NONE = 0,     // anywhere, the kernel moves them around freely
+  AFFINITY_CPU_LIST = 1, // worker i is pinned to cpus[i % num_cpus]
+  // one worker pinned to each physical core, leaving hyper thread siblings
+  // alone, wrapping around if there are more workers than cores
+  AFFINITY_PHYSICAL_CORES = 2,
+} AffinityPolicy;
+
 typedef struct {
+  int num_threads; // workers started at init, the minimum in elastic mode
+  // elastic mode when above num_threads: the pool starts extra workers up to
+  // this many while tasks keep queueing up faster than they are taken, and
+  // extra workers that found nothing to do for idle_timeout_ms exit again.
+  // 0 is the same as num_threads
+  int max_threads;
+  unsigned int idle_timeout_ms;
+  unsigned int grow_delay_us; // how long a backlog must last to add a worker
+  // workers the pool may start on top of max_threads while tasks sit in
+  // thread_pool_begin_blocking regions, so tasks that could run are not
+  // stuck behind ones that sleep. They leave like elastic ones once idle.
+  // 0, the default, turns compensation off
+  int max_blocking_threads;
+  // an idle worker polls this many times, then yields this many times, before
+  // it parks in the kernel, so work arriving in bursts does not pay a wakeup
+  unsigned int spin_count;
+  unsigned int yield_count;
+  size_t queue_capacity; // slots in each lane of the shared channel
+  OverflowPolicy overflow_policy;
+  LanePolicy lane_policy;
+  unsigned int lane_weights[NUM_TASK_PRIORITIES]; // LANE_POLICY_WEIGHTED only
+  unsigned int starvation_limit;                  // LANE_POLICY_STRICT only
+  AffinityPolicy affinity;
+  const int *cpus; // AFFINITY_CPU_LIST only
+  size_t num_cpus;
+  // time every task's queue wait and execution for thread_pool_stats, which
+  // costs a cycle counter read at submission and two around execution
+  bool_t latency_stats;
+  // record when every task is queued, taken, started and finished, and when
+  // workers go idle, for thread_pool_trace_write. Each thread keeps the last
+  // trace_buffer_size events in a ring of its own, so recording costs a
+  // clock read and never waits on another thread
+  bool_t trace;
+  size_t trace_buffer_size;
+  // run every task on a pooled fiber with its own stack. A task that awaits
+  // another task then parks its fiber instead of blocking the worker, which
+  // runs other work meanwhile, so nested fork and join cannot run out of
+  // workers. Costs two context switches per task
+  bool_t fibers;
+  size_t fiber_stack_size; // usable bytes per fiber stack
+  // chunk size of the scratch arenas, see thread_pool_scratch_alloc. The
+  // first chunk is only allocated once a task asks for scratch memory
+  size_t scratch_size;
+  // per thread state, set up once per worker thread, NULL for none
+  WorkerInitFunc worker_init;
+  WorkerExitFunc worker_exit;
+  void *worker_arg; // passed to both
+} ThreadPoolOptions;
+
+// fills opts with the defaults init_thread_pool uses
+void thread_pool_default_options(ThreadPoolOptions *opts, int num_threads);
+
+typedef struct __thread_pool {
+  // worker slots, max_threads plus max_blocking_threads of the options
   int num_threads;
+  int min_threads;
+  int max_threads; // workers that are not blocked, at most
+  size_t queue_capacity;
+  OverflowPolicy overflow_policy;
+  LanePolicy lane_policy;
+  unsigned int lane_weights[NUM_TASK_PRIORITIES];
+  unsigned int lane_weight_total;
+  unsigned int starvation_limit;
   pthread_t *workers;
+  Worker *worker_states;
+  unsigned int spin_count;
+  unsigned int yield_count;
+
+  // elastic mode, slots with a running thread and the grow and retire
+  // bookkeeping. elastic_lock serializes starting, retiring and joining
+  TP_ALIGNAS(CACHE_LINE_SIZE) atomic_int active_threads;
+  atomic_int blocked_threads; // inside thread_pool_begin_blocking regions
+  atomic_uint_least64_t backlog_since; // ns, 0 while there is no backlog
+  uint64_t idle_timeout_ns;
+  uint64_t grow_delay_ns;
+  pthread_mutex_t elastic_lock;
 
-  // Buffered Channel For workers and enqueuer func to use
-  Task buffer[MAX_BUFFER];
-  int buffer_fill;
-  int buffer_use;
-  sem_t empty;
-  sem_t added;
-  sem_t mutex; // semaphore mutex used to wrap the critical sections of put and
-               // get calls to buffer
+  // instrumentation, see thread_pool_stats. The stats clock is converted to
+  // ns by comparing it to CLOCK_MONOTONIC since these readings
+  bool_t latency_stats;
+  uint64_t stats_epoch_ticks;
+  uint64_t stats_epoch_ns;
+  TP_ALIGNAS(CACHE_LINE_SIZE) atomic_uint_least64_t queue_full_stalls;
+  bool_t trace;
+  Tracer tracer; // trace only
+
+  // Buffered Channel For workers and enqueuer func to use, one lock free lane
+  // per priority so producers and workers never serialize on a shared lock
+  MpmcRing lanes[NUM_TASK_PRIORITIES];
+  // counting gates around the rings, these only put a thread to sleep when a
+  // lane is actually full (empty) or every queue is actually empty (added).
+  // Each one sits on its own cache line so producers and consumers do not
+  // false share, and all of them can move many tokens at once for batches.
+  FutexSem empty[NUM_TASK_PRIORITIES];
+  FutexSem added;
+
+  // tasks submitted and not finished yet, wherever they are queued.
+  // thread_pool_wait_idle sleeps on idle_seq, which moves every time pending
+  // drops to zero
+  TP_ALIGNAS(CACHE_LINE_SIZE) atomic_uint pending;
+  atomic_uint idle_seq;
+  atomic_uint idle_waiters;
+
+  // shutdown flags: closing rejects new external submissions, stopping tells
+  // workers to exit instead of looking for more work
+  TP_ALIGNAS(CACHE_LINE_SIZE) atomic_int closing;
+  atomic_int stopping;
+
+  // delayed and periodic tasks wait in a timer wheel. One timer thread,
+  // started by the first timer, sleeps until the next one is due and hands
+  // it to the channel like any other submission. Everything below is
+  // guarded by timer_lock
+  pthread_mutex_t timer_lock;
+  pthread_cond_t timer_cond; // CLOCK_MONOTONIC
+  TimerWheel timers;         // ticks are milliseconds since timer_epoch
+  struct timespec timer_epoch;
+  uint64_t timer_wake; // tick the timer thread sleeps until
+  pthread_t timer_thread;
+  bool_t timer_started;
+  bool_t timer_stop;
+
+  // fiber mode. Fibers whose awaited task finished queue up in the ready
+  // list, each with an added token like a queued task, and workers resume
+  // them before looking for new work
+  bool_t fibers;
+  size_t fiber_stack_size;
+  pthread_mutex_t ready_lock;
+  struct __fiber *ready_head;
+  struct __fiber *ready_tail;
+  atomic_uint num_ready;
+
+  size_t scratch_size;
+  WorkerInitFunc worker_init;
+  WorkerExitFunc worker_exit;
+  void *worker_arg;
 } ThreadPool;
 
+// sizeof(ThreadPool) as the library was compiled. threadpool.hpp checks the
+// C++ view of the struct against it, both are aligned to CACHE_LINE_SIZE
+size_t thread_pool_sizeof(void);
+
+// TRUE when called from a task running on one of the pool's workers
+bool_t thread_pool_is_worker_thread(ThreadPool *pool);
+
+// Memory for the running task that is freed when the task returns, from a
+// bump arena of its worker, or of its fiber in fiber mode, so it costs a
+// pointer increment and never contends in malloc. Aligned like malloc's,
+// NULL outside of tasks run by a pool's workers or if memory ran out.
+// Scratch memory of a task stays valid across its awaits
+void *thread_pool_scratch_alloc(size_t size);
+
+// the arena thread_pool_scratch_alloc takes from on the calling thread, NULL
+// outside of workers. For code that runs several tasks inline itself, to
+// give each its memory back with arena_mark and arena_rewind
+Arena *thread_pool_scratch(void);
+
+// what the pool's worker_init returned on the calling worker thread, NULL
+// outside of workers. A fiber may resume on another worker after an await,
+// so look it up again rather than keep it across one
+void *thread_pool_worker_context(void);
+
+// Called by a task about to block, on I/O or a sleep, and once it is done.
+// In between its worker does not count against the pool's size, and if no
+// other worker is idle a compensating one is started, up to
+// max_blocking_threads of them. Regions do not nest, and calls from
+// threads outside the pool do nothing
+void thread_pool_begin_blocking(ThreadPool *pool);
+void thread_pool_end_blocking(ThreadPool *pool);
+
 typedef enum {
   INIT_THREAD_POOL_SUCCESS = 0,
   INIT_THREAD_POOL_INVALID_NUM_THREADS = -1,
@@ -49,28 +371,151 @@ typedef enum {
   INIT_THREAD_POOL_THREAD_CREATE_FAILED = -3,
   INIT_THREAD_POOL_RW_LOCK_ERR = -4,
   INIT_THREAD_POOL_SEM_ERR = -5,
+  INIT_THREAD_POOL_INVALID_CAPACITY = -6,
+  INIT_THREAD_POOL_INVALID_OPTIONS = -7,
 } InitThreadPoolResult;
 
 InitThreadPoolResult init_thread_pool(ThreadPool *thread_pool, int num_threads);
 
+InitThreadPoolResult
+init_thread_pool_with_options(ThreadPool *thread_pool,
+                              const ThreadPoolOptions *opts);
+
 typedef enum {
   ENQUEUE_TASK_SUCCESS = 0,
   ENQUEUE_TASK_SEM_ERR = -1,
+  ENQUEUE_TASK_QUEUE_FULL = -2,
+  ENQUEUE_TASK_TIMED_OUT = -3,
+  ENQUEUE_TASK_SHUTTING_DOWN = -4,
+  ENQUEUE_TASK_TIMER_ERR = -5, // timer thread or timer storage unavailable
 } EnqueueTaskResponseCode;
 
 typedef struct {
   EnqueueTaskResponseCode resp_code;
-  sem_t *task_awaiter;
+  TaskCompletion *task_awaiter;
 } EnqueueTaskResponse;
 
+// Enqueue following the pool's overflow policy
 EnqueueTaskResponse enqueue_task(ThreadPool *pool, Task task);
 
+// Sets the task's priority and enqueues it like enqueue_task
+EnqueueTaskResponse enqueue_task_priority(ThreadPool *pool, Task task,
+                                          TaskPriority priority);
+
+// Never waits, fails with ENQUEUE_TASK_QUEUE_FULL if the channel is full
+EnqueueTaskResponse try_enqueue_task(ThreadPool *pool, Task task);
+
+// Enqueue n tasks with one reservation and one publish per run of equal
+// priority where they fit, and wake at most min(n, idle workers) workers.
+// With OVERFLOW_POLICY_REJECT the batch is all or nothing, with OVERFLOW_POLICY_CALLER_RUNS whatever does not
+// fit right now runs on the calling thread.
+EnqueueTaskResponse enqueue_tasks(ThreadPool *pool, Task *tasks, size_t n);
+
+// Waits for room until the absolute CLOCK_MONOTONIC deadline, then fails
+// with ENQUEUE_TASK_TIMED_OUT. A NULL deadline waits as long as it takes,
+// whatever the pool's overflow policy
+EnqueueTaskResponse enqueue_task_timed(ThreadPool *pool, Task task,
+                                       const struct timespec *deadline);
+
+/*
+ * Hands the task to the channel once delay_ms milliseconds have passed,
+ * with blocking backpressure if it is full at that point. The delay is a
+ * lower bound, timers have millisecond resolution. If timer is not NULL it
+ * receives a handle for cancel_timer.
+ * Timers do not count as queued work for thread_pool_wait_idle until they
+ * fire, and ones still waiting at shutdown are dropped with their awaiters
+ * woken like discarded tasks.
+ * */
+EnqueueTaskResponse enqueue_task_after(ThreadPool *pool, Task task,
+                                       uint64_t delay_ms, TimerHandle *timer);
+
+// Hands a copy of the task to the channel every period_ms milliseconds,
+// starting one period from now, until the timer is cancelled. Firings that
+// are missed because the channel was full are skipped, not bunched up.
+// Every firing is fire and forget, an awaitable task's awaiter is woken
+// when the timer is cancelled or dropped at shutdown
+EnqueueTaskResponse enqueue_task_every(ThreadPool *pool, Task task,
+                                       uint64_t period_ms, TimerHandle *timer);
+
+// Stops a timer. Returns TRUE if that prevented a firing, FALSE if the
+// handle is stale, e.g. a delayed task that already went to the channel
+bool_t cancel_timer(ThreadPool *pool, TimerHandle timer);
+
+// Runs one queued task of the pool on the calling thread if any is ready,
+// returns TRUE if it did. Lets code that waits on other tasks of its own pool
+// help with them instead of blocking a worker
+bool_t thread_pool_run_pending_task(ThreadPool *pool);
+
+typedef struct {
+  uint64_t tasks_executed;
+  uint64_t steals;
+  uint64_t parks;
+  uint64_t tasks_cancelled;
+  size_t deque_depth; // tasks in its deque right now
+  bool_t running;     // FALSE for elastic slots without a thread
+} WorkerStats;
+
+typedef struct {
+  // sums over every worker
+  uint64_t tasks_executed;
+  uint64_t steals;
+  uint64_t parks;
+  uint64_t tasks_cancelled; // taken from the queues and skipped, not run
+  // submissions that found their lane full and had to wait, fail or run
+  // the task themselves
+  uint64_t queue_full_stalls;
+  // tasks queued anywhere right now, and the part of them in each lane
+  size_t queue_depth;
+  size_t lane_depth[NUM_TASK_PRIORITIES];
+  int active_workers;
+  int blocked_workers; // inside blocking regions, part of active_workers
+  // ns from submission until a worker started the task, and ns the task
+  // ran for, over all tasks run by workers so far. Empty unless the pool
+  // was created with latency_stats
+  HistogramSnapshot queue_wait;
+  HistogramSnapshot execution;
+} ThreadPoolStats;
+
+// Snapshot of the pool's counters. Reading them never blocks the pool, so
+// the numbers are each exact but not all from the same instant
+void thread_pool_stats(ThreadPool *pool, ThreadPoolStats *stats);
+
+// Snapshot of one worker slot's counters, worker is in [0, num_threads)
+void thread_pool_worker_stats(ThreadPool *pool, int worker, WorkerStats *stats);
+
+// Writes the trace of a pool created with trace as Chrome trace event JSON,
+// which chrome://tracing and ui.perfetto.dev open. Every worker is a track
+// with its tasks and idle stretches, and every task's wait in a queue is an
+// async span from its enqueue to the worker taking it. May be called while
+// the pool runs, before destroy_thread_pool. Returns FALSE if the pool does
+// not trace or writing to out failed
+bool_t thread_pool_trace_write(ThreadPool *pool, FILE *out);
+
+// Blocks until no task is queued or running anywhere in the pool. Must not
+// be called from inside a task of the same pool, it would wait on itself
+void thread_pool_wait_idle(ThreadPool *thread_pool);
+
 typedef enum {
   DESTROY_THREAD_POOL_SUCCESS = 0,
   DESTROY_THREAD_POOL_JOIN_FAIL = -1,
   DESTROY_THREAD_POOL_RW_LOCK_ERR = -2,
 } DestroyThreadPoolResult;
 
+typedef enum {
+  // run every queued task, including ones spawned while draining, on all
+  // workers in parallel, then stop the workers
+  SHUTDOWN_DRAIN = 0,
+  // let running tasks finish but drop queued ones, their awaiters are woken
+  // without a result
+  SHUTDOWN_DISCARD = 1,
+} ShutdownMode;
+
+// Stops accepting external submissions, shuts the workers down as mode says,
+// joins them and frees the pool. Running tasks are never interrupted
+DestroyThreadPoolResult shutdown_thread_pool(ThreadPool *thread_pool,
+                                             ShutdownMode mode);
+
+// shutdown_thread_pool with SHUTDOWN_DRAIN
 DestroyThreadPoolResult destroy_thread_pool(ThreadPool *thread_pool);
 
 #endif
@@ -0,0 +1,421 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+// C++17 front end over the C thread pool, header only.
+//
+//   threadpool::Pool pool(4);
+//   threadpool::Future<int> answer = pool.submit([] { return 42; });
+//   int value = answer.get();
+//
+// Callables may be move only. Ones that fit in CALLABLE_INLINE_SIZE bytes
+// are stored inline in the task's shared state, results are moved into that
+// state and moved out by get(), never copied byte wise. Shared states are
+// recycled through a per thread cache, so a thread that submits tasks and
+// consumes their futures does not allocate once it is warmed up. Waiting is
+// the pool's futex based completion slot, there is no semaphore per task.
+
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+// must come before the extern "C" block, it pulls in <atomic>
+#include "atomics.h"
+
+extern "C" {
+#include "threadpool.h"
+}
+
+// The pool is a C struct owned by C++ code, both have to lay it out the same.
+// threadpool.c asserts the same alignment, the size is checked against
+// thread_pool_sizeof when a Pool is created
+static_assert(alignof(ThreadPool) == CACHE_LINE_SIZE,
+              "ThreadPool is aligned differently than in C");
+
+namespace threadpool {
+
+// callables up to this size, and no more aligned than max_align_t, do not
+// need a heap allocation of their own
+constexpr std::size_t CALLABLE_INLINE_SIZE = 64;
+
+// shared states a thread keeps around for reuse, per result type
+constexpr std::size_t STATE_CACHE_SIZE = 64;
+
+// a pool could not be created or refused a task, code is the C result code,
+// an InitThreadPoolResult or an EnqueueTaskResponseCode
+class PoolError : public std::runtime_error {
+public:
+  PoolError(const std::string &what, int code)
+      : std::runtime_error(what + " (" + std::to_string(code) + ")"),
+        code_(code) {}
+
+  int code() const noexcept { return code_; }
+
+private:
+  int code_;
+};
+
+namespace detail {
+
+// Type erased, move only callable with small buffer storage. Lives inside a
+// shared state and is invoked and destroyed exactly once, or only destroyed
+// if its task is dropped
+class Callable {
+public:
+  Callable() = default;
+  Callable(const Callable &) = delete;
+  Callable &operator=(const Callable &) = delete;
+  ~Callable() { reset(); }
+
+  template <class F> void emplace(F &&f) {
+    using Fn = std::decay_t<F>;
+    if constexpr (fits_inline<Fn>()) {
+      ::new (static_cast<void *>(buffer_)) Fn(std::forward<F>(f));
+      target_ = buffer_;
+      destroy_ = [](void *target) { static_cast<Fn *>(target)->~Fn(); };
+    } else {
+      target_ = new Fn(std::forward<F>(f));
+      destroy_ = [](void *target) { delete static_cast<Fn *>(target); };
+    }
+  }
+
+  template <class Fn> Fn &get() { return *static_cast<Fn *>(target_); }
+
+  void reset() {
+    if (target_ != nullptr) {
+      destroy_(target_);
+      target_ = nullptr;
+    }
+  }
+
+private:
+  template <class Fn> static constexpr bool fits_inline() {
+    return sizeof(Fn) <= CALLABLE_INLINE_SIZE &&
+           alignof(Fn) <= alignof(std::max_align_t);
+  }
+
+  alignas(std::max_align_t) unsigned char buffer_[CALLABLE_INLINE_SIZE];
+  void *target_ = nullptr;
+  void (*destroy_)(void *) = nullptr;
+};
+
+// where the result of a task goes, T is what its callable returns
+template <class T> struct ResultSlot {
+  std::optional<T> value;
+
+  template <class Fn> void run(Fn &fn) { value.emplace(std::invoke(fn)); }
+  T take() { return std::move(*value); }
+};
+
+template <> struct ResultSlot<void> {
+  template <class Fn> void run(Fn &fn) { std::invoke(fn); }
+  void take() {}
+};
+
+template <class T> struct SharedState {
+  Callable callable;
+  ResultSlot<T> result;
+  std::exception_ptr error;
+  bool ran = false; // false if a discarding shutdown dropped the task
+};
+
+// Freed states are kept per thread and handed out again, the thread that
+// destroys a future is usually the one that submitted it
+template <class State> class StateCache {
+public:
+  ~StateCache() {
+    while (head_ != nullptr) {
+      Node *next = head_->next;
+      ::operator delete(head_);
+      head_ = next;
+    }
+  }
+
+  static State *acquire() {
+    StateCache &cache = local();
+    void *memory;
+    if (cache.head_ != nullptr) {
+      memory = cache.head_;
+      cache.head_ = cache.head_->next;
+      cache.size_--;
+    } else {
+      memory = ::operator new(sizeof(Block));
+    }
+    return ::new (memory) State();
+  }
+
+  static void release(State *state) {
+    state->~State();
+    StateCache &cache = local();
+    if (cache.size_ == STATE_CACHE_SIZE) {
+      ::operator delete(static_cast<void *>(state));
+      return;
+    }
+    Node *node = ::new (static_cast<void *>(state)) Node{cache.head_};
+    cache.head_ = node;
+    cache.size_++;
+  }
+
+private:
+  struct Node {
+    Node *next;
+  };
+  union Block {
+    Node node;
+    alignas(State) unsigned char state[sizeof(State)];
+  };
+  static_assert(alignof(Block) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__,
+                "result type is over aligned");
+
+  static StateCache &local() {
+    thread_local StateCache cache;
+    return cache;
+  }
+
+  Node *head_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+template <class T, class Fn> void run_state(void *in, void *out) {
+  auto *state = static_cast<SharedState<T> *>(in);
+  try {
+    state->result.run(state->callable.template get<Fn>());
+  } catch (...) {
+    state->error = std::current_exception();
+  }
+  state->ran = true;
+  // captures go now, not whenever the future is destroyed
+  state->callable.reset();
+}
+
+template <class Fn> void run_posted(void *in, void *out) {
+  auto *state = static_cast<SharedState<void> *>(in);
+  // an exception escaping a posted task has nowhere to go, like one escaping
+  // a std::thread it ends the process
+  [&]() noexcept { std::invoke(state->callable.template get<Fn>()); }();
+  StateCache<SharedState<void>>::release(state);
+}
+
+// a posted task that never runs, e.g. dropped by a discarding shutdown,
+// still gives back its state and destroys its captures
+inline void drop_posted(void *in) {
+  StateCache<SharedState<void>>::release(static_cast<SharedState<void> *>(in));
+}
+
+// Blocks until a completion is signalled. Called from a task of the same
+// pool it runs other queued tasks meanwhile instead of blocking a worker
+inline void wait_helping(ThreadPool *pool, TaskCompletion *done) {
+  if (completion_is_done(done)) {
+    return;
+  }
+  if (thread_pool_is_worker_thread(pool)) {
+    while (!completion_is_done(done)) {
+      if (!thread_pool_run_pending_task(pool)) {
+        completion_wait(done);
+      }
+    }
+    return;
+  }
+  completion_wait(done);
+}
+
+} // namespace detail
+
+/*
+ * Result of a submitted task. Move only and consumed by get(), like
+ * std::future. A future that is destroyed without get() waits for its task
+ * first, the task still refers to the shared state.
+ */
+template <class T> class Future {
+public:
+  Future() = default;
+  Future(Future &&other) noexcept { steal(other); }
+  Future &operator=(Future &&other) noexcept {
+    if (this != &other) {
+      discard();
+      steal(other);
+    }
+    return *this;
+  }
+  Future(const Future &) = delete;
+  Future &operator=(const Future &) = delete;
+  ~Future() { discard(); }
+
+  // false once get() was called or for a default constructed future
+  bool valid() const noexcept { return state_ != nullptr; }
+
+  // true once the task finished, never blocks
+  bool ready() const noexcept {
+    return valid() && completion_is_done(done_);
+  }
+
+  void wait() const { detail::wait_helping(pool_, done_); }
+
+  // Waits for the task and moves its result out, rethrowing whatever it
+  // threw. Throws std::future_error with broken_promise if the task was
+  // dropped by a discarding shutdown
+  T get() {
+    if (!valid()) {
+      throw std::future_error(std::future_errc::no_state);
+    }
+    wait();
+    Owned owned(this);
+    if (!owned.state->ran) {
+      throw std::future_error(std::future_errc::broken_promise);
+    }
+    if (owned.state->error) {
+      std::rethrow_exception(owned.state->error);
+    }
+    return owned.state->result.take();
+  }
+
+private:
+  friend class Pool;
+
+  using State = detail::SharedState<T>;
+
+  Future(ThreadPool *pool, TaskCompletion *done, State *state)
+      : pool_(pool), done_(done), state_(state) {}
+
+  // gives the state and completion back when get() returns or throws, the
+  // result is moved out before that
+  struct Owned {
+    explicit Owned(Future *future)
+        : state(future->state_), done(future->done_) {
+      future->state_ = nullptr;
+      future->done_ = nullptr;
+    }
+    ~Owned() {
+      completion_release(done);
+      detail::StateCache<State>::release(state);
+    }
+    State *state;
+    TaskCompletion *done;
+  };
+
+  void steal(Future &other) {
+    pool_ = other.pool_;
+    done_ = other.done_;
+    state_ = other.state_;
+    other.state_ = nullptr;
+    other.done_ = nullptr;
+  }
+
+  void discard() {
+    if (valid()) {
+      wait();
+      Owned owned(this);
+    }
+  }
+
+  ThreadPool *pool_ = nullptr;
+  TaskCompletion *done_ = nullptr;
+  State *state_ = nullptr;
+};
+
+/*
+ * Owns a ThreadPool. The destructor drains it, every submitted task runs
+ * before it returns. Not movable, the workers point at the pool.
+ */
+class Pool {
+public:
+  explicit Pool(int num_threads) {
+    ThreadPoolOptions opts;
+    thread_pool_default_options(&opts, num_threads);
+    init(opts);
+  }
+
+  explicit Pool(const ThreadPoolOptions &opts) { init(opts); }
+
+  Pool(const Pool &) = delete;
+  Pool &operator=(const Pool &) = delete;
+
+  ~Pool() { destroy_thread_pool(&pool_); }
+
+  // Runs f() on the pool and returns a future for its result
+  template <class F, class T = std::invoke_result_t<std::decay_t<F> &>>
+  Future<T> submit(F &&f, TaskPriority priority = TASK_PRIORITY_NORMAL) {
+    using Fn = std::decay_t<F>;
+    using State = detail::SharedState<T>;
+
+    State *state = detail::StateCache<State>::acquire();
+    try {
+      state->callable.emplace(std::forward<F>(f));
+    } catch (...) {
+      detail::StateCache<State>::release(state);
+      throw;
+    }
+
+    Task task;
+    if (!new_task(&task, &detail::run_state<T, Fn>, state, NULL, 0, FALSE)) {
+      detail::StateCache<State>::release(state);
+      throw std::bad_alloc();
+    }
+    EnqueueTaskResponse resp = enqueue_task_priority(&pool_, task, priority);
+    if (resp.resp_code != ENQUEUE_TASK_SUCCESS) {
+      destroy_task(&task);
+      detail::StateCache<State>::release(state);
+      throw PoolError("threadpool: enqueue failed", resp.resp_code);
+    }
+    return Future<T>(&pool_, task.task_awaiter, state);
+  }
+
+  // Runs f() on the pool without a way to wait for it. f must not throw
+  template <class F>
+  void post(F &&f, TaskPriority priority = TASK_PRIORITY_NORMAL) {
+    using Fn = std::decay_t<F>;
+    using State = detail::SharedState<void>;
+
+    State *state = detail::StateCache<State>::acquire();
+    try {
+      state->callable.emplace(std::forward<F>(f));
+    } catch (...) {
+      detail::StateCache<State>::release(state);
+      throw;
+    }
+
+    Task task;
+    new_task(&task, &detail::run_posted<Fn>, state, NULL, 0, TRUE);
+    task_set_drop_hook(&task, &detail::drop_posted);
+    EnqueueTaskResponse resp = enqueue_task_priority(&pool_, task, priority);
+    if (resp.resp_code != ENQUEUE_TASK_SUCCESS) {
+      detail::StateCache<State>::release(state);
+      throw PoolError("threadpool: enqueue failed", resp.resp_code);
+    }
+  }
+
+  // Blocks until nothing is queued or running, see thread_pool_wait_idle
+  void wait_idle() { thread_pool_wait_idle(&pool_); }
+
+  ThreadPoolStats stats() {
+    ThreadPoolStats stats;
+    thread_pool_stats(&pool_, &stats);
+    return stats;
+  }
+
+  // the C pool, for what the wrapper does not cover
+  ThreadPool *native() noexcept { return &pool_; }
+
+private:
+  void init(const ThreadPoolOptions &opts) {
+    if (thread_pool_sizeof() != sizeof(ThreadPool)) {
+      throw std::logic_error("threadpool: ThreadPool layout differs from C");
+    }
+    InitThreadPoolResult res = init_thread_pool_with_options(&pool_, &opts);
+    if (res != INIT_THREAD_POOL_SUCCESS) {
+      throw PoolError("threadpool: init failed", res);
+    }
+  }
+
+  ThreadPool pool_;
+};
+
+} // namespace threadpool
+
+#endif
@@ -0,0 +1,240 @@
+#include "timer_wheel.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define INITIAL_TIMERS 64
+
+void timer_wheel_init(TimerWheel *wheel, size_t elem_size) {
+  memset(wheel, 0, sizeof(TimerWheel));
+  wheel->elem_size = elem_size;
+}
+
+void timer_wheel_destroy(TimerWheel *wheel) {
+  free(wheel->entries);
+  free(wheel->payloads);
+  wheel->entries = NULL;
+  wheel->payloads = NULL;
+}
+
+static char *payload_of(TimerWheel *wheel, uint32_t index) {
+  return wheel->payloads + (size_t)index * wheel->elem_size;
+}
+
+static int grow(TimerWheel *wheel) {
+  uint32_t capacity = wheel->capacity == 0 ? INITIAL_TIMERS
+                                           : wheel->capacity * 2;
+  if (capacity <= wheel->capacity) {
+    return -1;
+  }
+
+  // links are indices, so moving the arrays does not break any list
+  TimerEntry *entries = (TimerEntry *)realloc(
+      wheel->entries, sizeof(TimerEntry) * capacity);
+  if (entries == NULL) {
+    return -1;
+  }
+  wheel->entries = entries;
+  char *payloads =
+      (char *)realloc(wheel->payloads, wheel->elem_size * capacity);
+  if (payloads == NULL) {
+    return -1;
+  }
+  wheel->payloads = payloads;
+
+  for (uint32_t i = wheel->capacity; i < capacity; i++) {
+    entries[i].generation = 0;
+    entries[i].in_use = 0;
+    entries[i].next = i + 1 < capacity ? i + 2 : wheel->free_head;
+  }
+  wheel->free_head = wheel->capacity + 1;
+  wheel->capacity = capacity;
+  return 0;
+}
+
+// put a timer in the slot its due tick maps to, seen from now
+static void place(TimerWheel *wheel, uint32_t index) {
+  TimerEntry *entry = &wheel->entries[index];
+  uint64_t due = entry->due;
+  uint64_t delta = due - wheel->now;
+
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         delta >= (uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1))) {
+    level++;
+  }
+  if (delta >= (uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) {
+    // beyond the top level, park it in its furthest slot
+    due = wheel->now +
+          ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+  }
+
+  int slot = (int)((due >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK);
+  entry->level = (uint8_t)level;
+  entry->slot = (uint8_t)slot;
+  entry->prev = 0;
+  entry->next = wheel->heads[level][slot];
+  if (entry->next != 0) {
+    wheel->entries[entry->next - 1].prev = index + 1;
+  }
+  wheel->heads[level][slot] = index + 1;
+  wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+static void unlink_entry(TimerWheel *wheel, uint32_t index) {
+  TimerEntry *entry = &wheel->entries[index];
+  if (entry->prev != 0) {
+    wheel->entries[entry->prev - 1].next = entry->next;
+  } else {
+    wheel->heads[entry->level][entry->slot] = entry->next;
+  }
+  if (entry->next != 0) {
+    wheel->entries[entry->next - 1].prev = entry->prev;
+  }
+  if (wheel->heads[entry->level][entry->slot] == 0) {
+    wheel->occupied[entry->level] &= ~((uint64_t)1 << entry->slot);
+  }
+}
+
+static void release(TimerWheel *wheel, uint32_t index) {
+  TimerEntry *entry = &wheel->entries[index];
+  entry->in_use = 0;
+  entry->generation++;
+  entry->next = wheel->free_head;
+  wheel->free_head = index + 1;
+  wheel->count--;
+}
+
+static TimerHandle handle_of(TimerWheel *wheel, uint32_t index) {
+  return ((uint64_t)wheel->entries[index].generation << 32) | (index + 1);
+}
+
+TimerHandle timer_wheel_add(TimerWheel *wheel, uint64_t due, uint64_t period,
+                            const void *elem) {
+  if (wheel->free_head == 0 && grow(wheel) != 0) {
+    return 0;
+  }
+
+  uint32_t index = wheel->free_head - 1;
+  TimerEntry *entry = &wheel->entries[index];
+  wheel->free_head = entry->next;
+  wheel->count++;
+
+  entry->due = due > wheel->now ? due : wheel->now + 1;
+  entry->period = period;
+  entry->in_use = 1;
+  memcpy(payload_of(wheel, index), elem, wheel->elem_size);
+  place(wheel, index);
+  return handle_of(wheel, index);
+}
+
+int timer_wheel_cancel(TimerWheel *wheel, TimerHandle handle, void *out) {
+  uint64_t slot = handle & 0xffffffffu;
+  if (slot == 0 || slot > wheel->capacity) {
+    return 0;
+  }
+  uint32_t index = (uint32_t)slot - 1;
+  TimerEntry *entry = &wheel->entries[index];
+  if (!entry->in_use || entry->generation != (uint32_t)(handle >> 32)) {
+    return 0;
+  }
+
+  unlink_entry(wheel, index);
+  memcpy(out, payload_of(wheel, index), wheel->elem_size);
+  release(wheel, index);
+  return 1;
+}
+
+uint64_t timer_wheel_next_event(TimerWheel *wheel) {
+  uint64_t next = UINT64_MAX;
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    uint64_t occupied = wheel->occupied[level];
+    if (occupied == 0) {
+      continue;
+    }
+    int shift = TIMER_WHEEL_BITS * level;
+    uint64_t position = wheel->now >> shift;
+    // rotate so bit 0 is the slot after the current one
+    int from = (int)((position + 1) & SLOT_MASK);
+    uint64_t rotated = (occupied >> from) |
+                       (from == 0 ? 0 : occupied << (TIMER_WHEEL_SLOTS - from));
+    uint64_t distance = (uint64_t)__builtin_ctzll(rotated) + 1;
+    uint64_t tick = (position + distance) << shift;
+    if (tick < next) {
+      next = tick;
+    }
+  }
+  return next;
+}
+
+// now just moved onto a slot boundary of the upper levels, whatever waits
+// there moves down. Highest level first so timers can fall several levels
+static void cascade(TimerWheel *wheel) {
+  for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+    int shift = TIMER_WHEEL_BITS * level;
+    if ((wheel->now & (((uint64_t)1 << shift) - 1)) != 0) {
+      continue;
+    }
+    int slot = (int)((wheel->now >> shift) & SLOT_MASK);
+    uint32_t head = wheel->heads[level][slot];
+    wheel->heads[level][slot] = 0;
+    wheel->occupied[level] &= ~((uint64_t)1 << slot);
+    while (head != 0) {
+      uint32_t index = head - 1;
+      head = wheel->entries[index].next;
+      place(wheel, index);
+    }
+  }
+}
+
+int timer_wheel_expire(TimerWheel *wheel, uint64_t to, void *out) {
+  while (1) {
+    // level 0 slots only ever hold timers due within one lap, so whatever
+    // is in the current one is due right now
+    uint32_t head = wheel->heads[0][wheel->now & SLOT_MASK];
+    if (head != 0 && wheel->entries[head - 1].due == wheel->now) {
+      uint32_t index = head - 1;
+      TimerEntry *entry = &wheel->entries[index];
+      unlink_entry(wheel, index);
+      memcpy(out, payload_of(wheel, index), wheel->elem_size);
+      if (entry->period == 0) {
+        release(wheel, index);
+      } else {
+        // fixed rate, a late caller gets one firing and not a burst
+        uint64_t behind = to > entry->due ? to - entry->due : 0;
+        entry->due += entry->period * (behind / entry->period + 1);
+        place(wheel, index);
+      }
+      return 1;
+    }
+
+    uint64_t next = timer_wheel_next_event(wheel);
+    if (next > to) {
+      // nothing happens in between, jump straight there
+      if (to > wheel->now) {
+        wheel->now = to;
+      }
+      return 0;
+    }
+    wheel->now = next;
+    cascade(wheel);
+  }
+}
+
+int timer_wheel_drain(TimerWheel *wheel, void *out) {
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    uint64_t occupied = wheel->occupied[level];
+    if (occupied == 0) {
+      continue;
+    }
+    uint32_t index = wheel->heads[level][__builtin_ctzll(occupied)] - 1;
+    unlink_entry(wheel, index);
+    memcpy(out, payload_of(wheel, index), wheel->elem_size);
+    release(wheel, index);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef TIMER_WHEEL
+#define TIMER_WHEEL
+
+#include <stddef.h>
+#include <stdint.h>
+
+// every level has 64 slots, one bit each in the level's occupancy mask
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+// 4 levels cover 64^4 ticks, timers further out are parked in the top level
+// and placed again once it comes round
+#define TIMER_WHEEL_LEVELS 4
+
+// names one timer, 0 never does
+typedef uint64_t TimerHandle;
+
+typedef struct {
+  uint64_t due;    // tick the timer fires at
+  uint64_t period; // ticks between firings, 0 for one shot timers
+  // links of the slot list the timer sits in, index + 1, 0 ends the list.
+  // next also links the free list
+  uint32_t next;
+  uint32_t prev;
+  uint32_t generation; // bumped on every free so stale handles miss
+  uint8_t level;
+  uint8_t slot;
+  uint8_t in_use;
+} TimerEntry;
+
+/*
+ * Hierarchical timing wheel, not thread safe, the owner serializes access.
+ *
+ * Level L slot s holds the timers whose due tick, shifted right by 6 * L,
+ * ends in s, with L the lowest level whose range covers the distance from
+ * now. Adding and cancelling a timer is a list link or unlink. When time
+ * reaches the start of a slot on an upper level, its timers are placed
+ * again and fall to a lower level, so every timer is touched at most once
+ * per level before it fires. Idle stretches are skipped in one step using
+ * the occupancy masks, so the cost does not depend on how long nothing was
+ * due.
+ * Entries and their payloads live in arrays that grow by doubling and are
+ * reused through a free list.
+ */
+typedef struct {
+  uint64_t now; // every tick up to and including now has been processed
+  uint32_t heads[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  uint64_t occupied[TIMER_WHEEL_LEVELS];
+  TimerEntry *entries;
+  char *payloads;
+  size_t elem_size;
+  uint32_t capacity;
+  uint32_t free_head; // index + 1, 0 when no entry is free
+  size_t count;
+} TimerWheel;
+
+void timer_wheel_init(TimerWheel *wheel, size_t elem_size);
+
+void timer_wheel_destroy(TimerWheel *wheel);
+
+// schedule a copy of elem for tick due, every period ticks after that if
+// period is not 0. A due tick that already passed fires on the next one.
+// Returns the timer's handle, 0 if the wheel could not grow
+TimerHandle timer_wheel_add(TimerWheel *wheel, uint64_t due, uint64_t period,
+                            const void *elem);
+
+// remove a timer that has not fired yet (any periodic one) and copy its
+// payload into out, returns 1 if it was removed, 0 if the handle is stale
+int timer_wheel_cancel(TimerWheel *wheel, TimerHandle handle, void *out);
+
+// move time forward to tick to and take the next timer due by then, copying
+// its payload into out. Periodic timers are placed again, skipping firings
+// that were missed. Returns 1 if a timer fired, 0 once none is due
+int timer_wheel_expire(TimerWheel *wheel, uint64_t to, void *out);
+
+// earliest tick that needs timer_wheel_expire, UINT64_MAX if there are no
+// timers. May be a tick where timers only move down a level
+uint64_t timer_wheel_next_event(TimerWheel *wheel);
+
+// remove every timer and copy its payload into out one at a time, returns 1
+// while there was one
+int timer_wheel_drain(TimerWheel *wheel, void *out);
+
+#endif
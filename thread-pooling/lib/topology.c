@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include "topology.h"
+
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+#define CPU_LIST_MAX 4096
+
+// reads a small sysfs file into buf, returns 0 on success
+static int read_line(const char *path, char *buf, size_t size) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return -1;
+  }
+  char *res = fgets(buf, (int)size, file);
+  fclose(file);
+  if (res == NULL) {
+    return -1;
+  }
+  buf[strcspn(buf, "\n")] = '\0';
+  return 0;
+}
+
+// parses a kernel cpu list such as "0-3,8,10-11" into set
+static int parse_cpu_list(const char *list, cpu_set_t *set) {
+  CPU_ZERO(set);
+  const char *p = list;
+  while (*p != '\0') {
+    char *end;
+    long first = strtol(p, &end, 10);
+    if (end == p) {
+      return -1;
+    }
+    long last = first;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p) {
+        return -1;
+      }
+    }
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET((int)cpu, set);
+    }
+    p = *end == ',' ? end + 1 : end;
+    if (*end != ',' && *end != '\0') {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// lowest cpu of the list in a sysfs file, -1 if it cannot be read
+static int lowest_cpu_in(const char *path) {
+  char buf[CPU_LIST_MAX];
+  cpu_set_t set;
+  if (read_line(path, buf, sizeof(buf)) != 0 || parse_cpu_list(buf, &set)) {
+    return -1;
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set)) {
+      return cpu;
+    }
+  }
+  return -1;
+}
+
+// the highest level data or unified cache of a cpu is its last level cache
+static int llc_of(int cpu) {
+  char path[PATH_MAX];
+  char buf[64];
+  int best_level = -1;
+  int llc = -1;
+  for (int index = 0;; index++) {
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/level", cpu,
+             index);
+    if (read_line(path, buf, sizeof(buf)) != 0) {
+      break;
+    }
+    int level = atoi(buf);
+
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/type", cpu,
+             index);
+    if (read_line(path, buf, sizeof(buf)) == 0 &&
+        strcmp(buf, "Instruction") == 0) {
+      continue;
+    }
+    if (level <= best_level) {
+      continue;
+    }
+
+    snprintf(path, sizeof(path),
+             SYSFS_CPU "/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+    int shared = lowest_cpu_in(path);
+    if (shared >= 0) {
+      best_level = level;
+      llc = shared;
+    }
+  }
+  if (llc >= 0) {
+    return llc;
+  }
+
+  // no cache information, a socket is the next best guess
+  snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/package_cpus_list",
+           cpu);
+  llc = lowest_cpu_in(path);
+  return llc >= 0 ? llc : 0;
+}
+
+int topology_cpu_info(int cpu, CpuInfo *info) {
+  char path[PATH_MAX];
+  char buf[CPU_LIST_MAX];
+  cpu_set_t online;
+  if (cpu < 0 || cpu >= CPU_SETSIZE ||
+      read_line(SYSFS_CPU "/online", buf, sizeof(buf)) != 0 ||
+      parse_cpu_list(buf, &online) != 0 || !CPU_ISSET(cpu, &online)) {
+    return -1;
+  }
+
+  info->cpu = cpu;
+  // core_cpus_list is the newer name of thread_siblings_list
+  snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/core_cpus_list", cpu);
+  info->core = lowest_cpu_in(path);
+  if (info->core < 0) {
+    snprintf(path, sizeof(path),
+             SYSFS_CPU "/cpu%d/topology/thread_siblings_list", cpu);
+    info->core = lowest_cpu_in(path);
+  }
+  if (info->core < 0) {
+    info->core = cpu;
+  }
+  info->llc = llc_of(cpu);
+  return 0;
+}
+
+int topology_online_cpus(int *cpus, int max) {
+  char buf[CPU_LIST_MAX];
+  cpu_set_t online;
+  if (read_line(SYSFS_CPU "/online", buf, sizeof(buf)) != 0 ||
+      parse_cpu_list(buf, &online) != 0) {
+    return -1;
+  }
+
+  int count = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &online)) {
+      if (count < max) {
+        cpus[count] = cpu;
+      }
+      count++;
+    }
+  }
+  return count;
+}
+
+int topology_physical_cores(int *cpus, int max) {
+  int online[CPU_SETSIZE];
+  int num_online = topology_online_cpus(online, CPU_SETSIZE);
+  if (num_online < 0) {
+    return -1;
+  }
+
+  int count = 0;
+  for (int i = 0; i < num_online; i++) {
+    CpuInfo info;
+    // a core is counted at its first hyper thread
+    if (topology_cpu_info(online[i], &info) != 0 || info.core != info.cpu) {
+      continue;
+    }
+    if (count < max) {
+      cpus[count] = info.cpu;
+    }
+    count++;
+  }
+  return count;
+}
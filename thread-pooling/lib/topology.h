@@ -0,0 +1,23 @@
+#ifndef TOPOLOGY
+#define TOPOLOGY
+
+// Where a cpu sits, read from /sys/devices/system/cpu. Cores and caches are
+// named by the lowest numbered cpu that shares them
+typedef struct {
+  int cpu;
+  int core; // hyper thread siblings have the same core
+  int llc;  // cpus sharing the last level cache have the same llc
+} CpuInfo;
+
+// fills info for one cpu, returns 0 on success, -1 if it is not online
+int topology_cpu_info(int cpu, CpuInfo *info);
+
+// writes up to max online cpus into cpus, returns how many there are in
+// total or -1 if the topology could not be read
+int topology_online_cpus(int *cpus, int max);
+
+// one cpu for every physical core, the first hyper thread of each. Returns
+// how many cores there are in total, or -1 if the topology could not be read
+int topology_physical_cores(int *cpus, int max);
+
+#endif
@@ -0,0 +1,183 @@
+#define _GNU_SOURCE
+#include "trace.h"
+
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+__thread TraceBuffer *trace_local_buffer = NULL;
+__thread uint64_t trace_local_owner = 0;
+
+// 0 is what trace_local_owner starts as, no tracer gets it
+static atomic_uint_least64_t next_tracer_id = 1;
+
+static uint64_t monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+int tracer_init(Tracer *tracer, size_t buffer_events) {
+  if (buffer_events == 0) {
+    return -1;
+  }
+  size_t size = 1;
+  while (size < buffer_events) {
+    size <<= 1;
+  }
+  tracer->id = atomic_fetch_add(&next_tracer_id, 1);
+  tracer->epoch_ns = monotonic_ns();
+  tracer->buffer_events = size;
+  tracer->buffers = NULL;
+  pthread_mutex_init(&tracer->lock, NULL);
+  return 0;
+}
+
+void tracer_destroy(Tracer *tracer) {
+  TraceBuffer *buffer = tracer->buffers;
+  while (buffer != NULL) {
+    TraceBuffer *next = buffer->next;
+    free(buffer->events);
+    free(buffer);
+    buffer = next;
+  }
+  tracer->buffers = NULL;
+  pthread_mutex_destroy(&tracer->lock);
+}
+
+// A thread that alternates between pools finds its buffer again by its tid.
+// Threads that exited keep theirs, a new thread reusing the tid appends to
+// it, which is still a single writer
+TraceBuffer *tracer_register_thread(Tracer *tracer, int worker) {
+  pid_t tid = (pid_t)syscall(SYS_gettid);
+  pthread_mutex_lock(&tracer->lock);
+  TraceBuffer *buffer = tracer->buffers;
+  while (buffer != NULL && (buffer->tid != tid || buffer->worker != worker)) {
+    buffer = buffer->next;
+  }
+  if (buffer == NULL) {
+    buffer = (TraceBuffer *)aligned_alloc(CACHE_LINE_SIZE, sizeof(TraceBuffer));
+    TraceEvent *events =
+        (TraceEvent *)malloc(sizeof(TraceEvent) * tracer->buffer_events);
+    if (buffer == NULL || events == NULL) {
+      pthread_mutex_unlock(&tracer->lock);
+      free(buffer);
+      free(events);
+      return NULL;
+    }
+    buffer->tid = tid;
+    buffer->worker = worker;
+    buffer->mask = tracer->buffer_events - 1;
+    buffer->events = events;
+    atomic_init(&buffer->head, 0);
+    buffer->next = tracer->buffers;
+    tracer->buffers = buffer;
+  }
+  pthread_mutex_unlock(&tracer->lock);
+
+  trace_local_buffer = buffer;
+  trace_local_owner = tracer->id;
+  return buffer;
+}
+
+static int write_event(FILE *out, const TraceEvent *event, int pid, pid_t tid,
+                       int *first) {
+  unsigned long long id = (unsigned long long)event->task_id;
+  fprintf(out, "%s\n{\"pid\":%d,\"tid\":%d,\"ts\":%.3f,", *first ? "" : ",",
+          pid, (int)tid, (double)event->ts / 1000.0);
+  *first = 0;
+  switch (event->type) {
+  case TRACE_ENQUEUE:
+    // queue waits are async spans, they begin and end on different threads
+    return fprintf(out,
+                   "\"ph\":\"b\",\"cat\":\"queue\",\"name\":\"queued\","
+                   "\"id\":%llu}",
+                   id);
+  case TRACE_DEQUEUE:
+    return fprintf(out,
+                   "\"ph\":\"e\",\"cat\":\"queue\",\"name\":\"queued\","
+                   "\"id\":%llu}",
+                   id);
+  case TRACE_START:
+    return fprintf(out,
+                   "\"ph\":\"B\",\"cat\":\"task\",\"name\":\"task\","
+                   "\"args\":{\"id\":%llu}}",
+                   id);
+  case TRACE_PARK:
+    return fprintf(out, "\"ph\":\"E\",\"args\":{\"parked\":true}}");
+  case TRACE_IDLE_BEGIN:
+    return fprintf(out, "\"ph\":\"B\",\"cat\":\"worker\",\"name\":\"idle\"}");
+  default:
+    return fprintf(out, "\"ph\":\"E\"}");
+  }
+}
+
+/*
+ * A buffer is copied out between two reads of its head. The writer fills
+ * the slot of the event after the first read before it moves head, so that
+ * slot may be torn as well and anything the second read shows as possibly
+ * overwritten, plus one, is dropped.
+ */
+static int write_buffer(TraceBuffer *buffer, FILE *out, int pid,
+                        TraceEvent *copy, int *first) {
+  uint64_t size = buffer->mask + 1;
+  uint64_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+  uint64_t from = head > size ? head - size : 0;
+  for (uint64_t i = from; i < head; i++) {
+    copy[i - from] = buffer->events[i & buffer->mask];
+  }
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t now = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+  uint64_t valid = now + 1 > size ? now + 1 - size : 0;
+
+  if (buffer->worker >= 0) {
+    fprintf(out,
+            "%s\n{\"pid\":%d,\"tid\":%d,\"ph\":\"M\",\"name\":\"thread_name\","
+            "\"args\":{\"name\":\"worker %d\"}}",
+            *first ? "" : ",", pid, (int)buffer->tid, buffer->worker);
+  } else {
+    fprintf(out,
+            "%s\n{\"pid\":%d,\"tid\":%d,\"ph\":\"M\",\"name\":\"thread_name\","
+            "\"args\":{\"name\":\"thread %d\"}}",
+            *first ? "" : ",", pid, (int)buffer->tid, (int)buffer->tid);
+  }
+  *first = 0;
+  // workers first and in slot order, other threads below them
+  fprintf(out,
+          ",\n{\"pid\":%d,\"tid\":%d,\"ph\":\"M\",\"name\":\"thread_sort_index\","
+          "\"args\":{\"sort_index\":%d}}",
+          pid, (int)buffer->tid,
+          buffer->worker >= 0 ? buffer->worker : 1000000 + (int)buffer->tid);
+
+  for (uint64_t i = from > valid ? from : valid; i < head; i++) {
+    if (write_event(out, &copy[i - from], pid, buffer->tid, first) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int tracer_write_json(Tracer *tracer, FILE *out) {
+  TraceEvent *copy =
+      (TraceEvent *)malloc(sizeof(TraceEvent) * tracer->buffer_events);
+  if (copy == NULL) {
+    return -1;
+  }
+  int pid = (int)getpid();
+  int first = 1;
+  int res = fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[") < 0;
+
+  pthread_mutex_lock(&tracer->lock);
+  for (TraceBuffer *buffer = tracer->buffers; buffer != NULL && res == 0;
+       buffer = buffer->next) {
+    res = write_buffer(buffer, out, pid, copy, &first);
+  }
+  pthread_mutex_unlock(&tracer->lock);
+  free(copy);
+
+  if (res != 0 || fprintf(out, "\n]}\n") < 0 || fflush(out) != 0) {
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,97 @@
+#ifndef TRACE
+#define TRACE
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "atomics.h"
+#include "mpmc_ring.h"
+
+// what happened to a task, or to the thread recording it
+typedef enum {
+  TRACE_ENQUEUE = 0,    // went into a queue
+  TRACE_DEQUEUE = 1,    // a thread took it out
+  TRACE_START = 2,      // started, or resumed on a fiber
+  TRACE_FINISH = 3,     // returned
+  TRACE_PARK = 4,       // its fiber parked in an await
+  TRACE_IDLE_BEGIN = 5, // a worker went to sleep waiting for work
+  TRACE_IDLE_END = 6,
+} TraceEventType;
+
+typedef struct {
+  uint64_t ts; // ns since the tracer started
+  uint64_t task_id;
+  uint32_t type; // TraceEventType
+} TraceEvent;
+
+/*
+ * Ring of the last events of one thread. Only that thread writes, an event
+ * is filled in and then published by moving head, so recording costs a
+ * clock read and a few stores and never waits. The oldest events are
+ * overwritten once it is full.
+ */
+typedef struct __trace_buffer {
+  struct __trace_buffer *next;
+  pid_t tid;
+  int worker; // slot of the worker thread that owns it, -1 for other threads
+  size_t mask;
+  TraceEvent *events;
+  TP_ALIGNAS(CACHE_LINE_SIZE) atomic_uint_least64_t head; // events ever written
+} TraceBuffer;
+
+// the buffers of every thread that recorded something for one pool
+typedef struct {
+  uint64_t id; // unique in the process, keys the per thread buffer cache
+  uint64_t epoch_ns;
+  size_t buffer_events;
+  pthread_mutex_t lock; // buffers are added and written out under it
+  TraceBuffer *buffers;
+} Tracer;
+
+// the calling thread's buffer for the tracer it used last
+extern __thread TraceBuffer *trace_local_buffer;
+extern __thread uint64_t trace_local_owner;
+
+// buffer_events is rounded up to a power of two. Returns 0 on success
+int tracer_init(Tracer *tracer, size_t buffer_events);
+
+void tracer_destroy(Tracer *tracer);
+
+// finds or makes the calling thread's buffer, NULL if memory ran out
+TraceBuffer *tracer_register_thread(Tracer *tracer, int worker);
+
+static inline TraceBuffer *tracer_buffer(Tracer *tracer, int worker) {
+  if (trace_local_owner == tracer->id) {
+    return trace_local_buffer;
+  }
+  return tracer_register_thread(tracer, worker);
+}
+
+// ns since the tracer started
+static inline uint64_t trace_now(Tracer *tracer) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec -
+         tracer->epoch_ns;
+}
+
+static inline void trace_record(TraceBuffer *buffer, uint64_t ts,
+                                TraceEventType type, uint64_t task_id) {
+  uint64_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+  TraceEvent *event = &buffer->events[head & buffer->mask];
+  event->ts = ts;
+  event->task_id = task_id;
+  event->type = type;
+  atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+// Writes every buffer as Chrome trace event JSON. Threads may keep recording
+// meanwhile, events overwritten while they are copied out are left out.
+// Returns 0, -1 if out failed
+int tracer_write_json(Tracer *tracer, FILE *out);
+
+#endif
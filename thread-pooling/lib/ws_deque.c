@@ -0,0 +1,99 @@
+#include "ws_deque.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Memory orderings follow "Correct and Efficient Work-Stealing for Weak
+// Memory Models" (Le, Pop, Cohen, Zappa Nardelli)
+
+static char *slot_at(WsDeque *deque, long long pos) {
+  return deque->slots + (size_t)(pos & deque->mask) * deque->elem_size;
+}
+
+int ws_deque_init(WsDeque *deque, size_t capacity, size_t elem_size) {
+  size_t rounded = 1;
+  while (rounded < capacity) {
+    rounded <<= 1;
+  }
+
+  deque->slots = (char *)malloc(rounded * elem_size);
+  if (deque->slots == NULL) {
+    return -1;
+  }
+
+  deque->mask = (long long)rounded - 1;
+  deque->elem_size = elem_size;
+  atomic_init(&deque->top, 0);
+  atomic_init(&deque->bottom, 0);
+  return 0;
+}
+
+void ws_deque_destroy(WsDeque *deque) {
+  free(deque->slots);
+  deque->slots = NULL;
+}
+
+int ws_deque_push(WsDeque *deque, const void *elem) {
+  long long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  long long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+  // a stale top only makes us think we are fuller than we are
+  if (b - t > deque->mask) {
+    return 0;
+  }
+
+  memcpy(slot_at(deque, b), elem, deque->elem_size);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+  return 1;
+}
+
+int ws_deque_pop(WsDeque *deque, void *out) {
+  long long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+  if (t > b) {
+    // already empty, undo the reservation
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return 0;
+  }
+
+  memcpy(out, slot_at(deque, b), deque->elem_size);
+  if (t == b) {
+    // last element, race thieves for it through top
+    int won = atomic_compare_exchange_strong_explicit(
+        &deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return won;
+  }
+  return 1;
+}
+
+WsDequeStealResult ws_deque_steal(WsDeque *deque, void *out) {
+  long long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+  if (t >= b) {
+    return WS_DEQUE_EMPTY;
+  }
+
+  // The copy may race with the owner reusing the slot only if top moved
+  // past t, in which case the CAS below fails and the copy is discarded
+  memcpy(out, slot_at(deque, t), deque->elem_size);
+  if (!atomic_compare_exchange_strong_explicit(
+          &deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+    return WS_DEQUE_ABORT;
+  }
+  return WS_DEQUE_SUCCESS;
+}
+
+long long ws_deque_size(WsDeque *deque) {
+  long long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  long long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+  return b > t ? b - t : 0;
+}
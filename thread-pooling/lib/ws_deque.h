@@ -0,0 +1,51 @@
+#ifndef WS_DEQUE
+#define WS_DEQUE
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "atomics.h"
+#include "mpmc_ring.h"
+
+/*
+ * Bounded Chase-Lev work stealing deque.
+ *
+ * Exactly one thread (the owner) pushes and pops at the bottom, in LIFO order
+ * so the most recently spawned, cache hot, work runs next. Any other thread
+ * may steal from the top in FIFO order, taking the oldest and usually
+ * largest piece of work. Owner operations are plain loads and stores except
+ * when racing a thief for the very last element.
+ */
+typedef struct {
+  TP_ALIGNAS(CACHE_LINE_SIZE) atomic_llong top;    // thieves take from here
+  TP_ALIGNAS(CACHE_LINE_SIZE) atomic_llong bottom; // owner works here
+  TP_ALIGNAS(CACHE_LINE_SIZE) char *slots;
+  long long mask;
+  size_t elem_size;
+} WsDeque;
+
+typedef enum {
+  WS_DEQUE_EMPTY = 0,
+  WS_DEQUE_SUCCESS = 1,
+  WS_DEQUE_ABORT = 2, // lost a race with another thief, worth retrying
+} WsDequeStealResult;
+
+// returns 0 on success, -1 if the slots could not be allocated
+int ws_deque_init(WsDeque *deque, size_t capacity, size_t elem_size);
+
+void ws_deque_destroy(WsDeque *deque);
+
+// owner only, returns 1 on success and 0 if the deque is full
+int ws_deque_push(WsDeque *deque, const void *elem);
+
+// owner only, returns 1 if the newest element was copied to out, 0 if empty
+int ws_deque_pop(WsDeque *deque, void *out);
+
+// any thread, copies the oldest element to out on WS_DEQUE_SUCCESS
+WsDequeStealResult ws_deque_steal(WsDeque *deque, void *out);
+
+// approximate number of elements, exact only when called by the owner with
+// no thieves around
+long long ws_deque_size(WsDeque *deque);
+
+#endif